@@ -4,8 +4,12 @@
 #include <complex>
 #include <atomic>
 #include "spscqueue.h"
+#include "AsyncLogger.h"
 #include "fftw3.h"
 #include "WavenumberInterpolationPlan.h"
+#include "DisplayProducts.h"
+#include "SpectrometerStats.h"
+#include "PipelineStats.h"
 
 # define IDLE_SLEEP_MS 10
 
@@ -17,6 +21,11 @@ struct aline_processing_job_msg {
 	float* apod_window;
 	float* background_spectrum;
 	fftwf_plan* fft_plan;  // if NULL, no FFT
+	DisplayProducts* display;  // if NULL, display products are not accumulated
+	SpectrometerStats* stats;  // if NULL, spectrometer stats are not accumulated
+	PipelineStats* timing;  // if NULL, the job is not timed
+	int64_t first_aline;  // Index of the job's first A-line in the frame
+	int worker_index;
 };
 
 
@@ -35,16 +44,40 @@ inline void process_alines(
 	float* background_spectrum,  // Fixed pattern background spectrum to be subtracted 
 	float* apod_window,  // Spectral shaping window to be multiplied
 	void* fft_buffer,  // Buffer used for in-place FFT prior to cropping to the destination buffer
-	float *interp_buffer  // Buffer used for A-line interpolation
+	float *interp_buffer,  // Buffer used for A-line interpolation
+	SpectrometerStats* stats = NULL,  // If not NULL, raw and processed A-lines are accumulated into the stats
+	int64_t first_aline = 0,  // Index of the first A-line in the frame, for per A-line stats
+	int worker = 0  // Index of the stats partials to accumulate into
 )
 {
 	// Subtract background spectrum
 	for (int i = 0; i < number_of_alines; i++)
 	{
-		for (int j = 0; j < aline_size; j++)
+		if (stats != NULL)
 		{
-			interp_buffer[j] = src[i * aline_size + j];  // Convert raw spectral data to float
-			interp_buffer[j] -= background_spectrum[j];  // Subtract background/DC spectrum (will be zero if disabled)
+			// Accumulate the raw spectrum as it is converted
+			double* sum = stats->spectrum_sum(worker);
+			uint16_t* maximum = stats->spectrum_max(worker);
+			uint16_t saturation_level = stats->saturation_level;
+			int32_t saturated = 0;
+			for (int j = 0; j < aline_size; j++)
+			{
+				uint16_t v = src[i * aline_size + j];
+				sum[j] += v;
+				maximum[j] = (v > maximum[j]) ? v : maximum[j];
+				saturated += (v >= saturation_level);
+				interp_buffer[j] = v;  // Convert raw spectral data to float
+				interp_buffer[j] -= background_spectrum[j];  // Subtract background/DC spectrum (will be zero if disabled)
+			}
+			stats->saturated[first_aline + i] = saturated;
+		}
+		else
+		{
+			for (int j = 0; j < aline_size; j++)
+			{
+				interp_buffer[j] = src[i * aline_size + j];  // Convert raw spectral data to float
+				interp_buffer[j] -= background_spectrum[j];  // Subtract background/DC spectrum (will be zero if disabled)
+			}
 		}
 		// Apply wavenumber-linearization interpolation
 		if (interp_plan != NULL)
@@ -78,6 +111,10 @@ inline void process_alines(
 		dst[i][0] /= aline_size;
 		dst[i][1] /= aline_size;
 	}
+	if (stats != NULL)
+	{
+		stats->accumulate_processed(dst, number_of_alines, worker);
+	}
 }
 
 
@@ -94,15 +131,16 @@ void aline_processing_worker(
 )
 {
 	int spatial_aline_size = aline_size / 2 + 1;
+	TRACE_THREAD_NAME("worker");
 
-	printf("Worker %i launched. Params: A-line size %i, Number of A-lines %i, Z ROI [%i %i]\n", std::this_thread::get_id(), aline_size, number_of_alines, roi_offset, roi_size);
+	async_printf("Worker %i launched. Params: A-line size %i, Number of A-lines %i, Z ROI [%i %i]\n", std::this_thread::get_id(), aline_size, number_of_alines, roi_offset, roi_size);
 
 	while (running->load() == true)
 	{
 		aline_processing_job_msg msg;
 		if (queue->dequeue(msg))
 		{
-
+			int64_t t0 = PipelineStats::now();
 			process_alines(
 				msg.dst_frame,
 				msg.src_frame, 
@@ -115,8 +153,19 @@ void aline_processing_worker(
 				msg.background_spectrum,
 				msg.apod_window,
 				fft_buffer,
-				interp_buffer
+				interp_buffer,
+				msg.stats,
+				msg.first_aline,
+				msg.worker_index
 			);
+			if (msg.display != NULL)
+			{
+				msg.display->accumulate(msg.dst_frame, msg.first_aline, number_of_alines, msg.worker_index);
+			}
+			if (msg.timing != NULL)
+			{
+				msg.timing->record_worker(msg.worker_index, t0, msg.first_aline);
+			}
 			msg.barrier->fetch_add(1);
 		}
 		else
@@ -155,8 +204,11 @@ public:
 	int number_of_workers;
 	int64_t alines_per_worker;
 
+	PipelineStats* timing;  // If not NULL, each worker's jobs are timed
+
 	AlineProcessingPool()
 	{
+		timing = NULL;
 		_running.store(false);
 		number_of_workers = 0;
 		total_alines = 0;
@@ -171,7 +223,9 @@ public:
 		bool fft_enabled  // Whether or not to perform an FFT. If false, axial ROI cropping does not take place.
 	)
 	{
-		printf("fastnisdoct: AlineProcessingPool initialized with A-line size: %i, number of A-lines: %i\n", aline_size, number_of_alines);
+		async_printf("fastnisdoct: AlineProcessingPool initialized with A-line size: %i, number of A-lines: %i\n", aline_size, number_of_alines);
+
+		timing = NULL;
 
 		// Need these for second constructor phase
 		this->aline_size = aline_size;
@@ -223,7 +277,7 @@ public:
 		int64_t fft_buffer_size = (aline_size * alines_per_worker + 8 * alines_per_worker) * number_of_workers;
 		fft_buffer = fftwf_alloc_real(fft_buffer_size);
 		// The trasform will be in place, so the buffer will contain first real data and then complex
-		printf("fastnisdoct: Allocated FFTW transform buffer.\n");
+		async_printf("fastnisdoct: Allocated FFTW transform buffer.\n");
 		interp_buffer = std::make_unique<float[]>(aline_size * number_of_workers);  // Single A-line sized buffer
 
 		fftwf_import_wisdom_from_filename(".fftwf_wisdom");
@@ -231,11 +285,11 @@ public:
 		fft_plan = fftwf_plan_many_dft_r2c(1, n, alines_per_worker, (float*)fft_buffer, inembed, istride, idist, (fftwf_complex*)fft_buffer, onembed, ostride, odist, FFTW_PATIENT);
 		if (fft_plan == NULL)
 		{
-			printf("fastnisdoct: Failed to generate FFTWF plan!\n");
+			async_printf("fastnisdoct: Failed to generate FFTWF plan!\n");
 		}
 		else
 		{
-			printf("fastnisdoct: Generated FFTWF plan.\n");
+			async_printf("fastnisdoct: Generated FFTWF plan.\n");
 			fftwf_export_wisdom_to_filename(".fftwf_wisdom");
 		}
 	}
@@ -257,7 +311,9 @@ public:
 		bool interpolation_enabled, // Whether or not to perform wavenumber-linearization interpolation.
 		double interpdk, // Wavenumber-linearization interpolation parameter.
 		float* apodization_window,  // Window function to multiply spectral A-line by prior to FFT.
-		float* background_spectrum  // Spectrum to subtract from each raw spectrum prior to multiplication by the apod window
+		float* background_spectrum,  // Spectrum to subtract from each raw spectrum prior to multiplication by the apod window
+		DisplayProducts* display = NULL,  // If not NULL, workers reduce their A-lines into the display products
+		SpectrometerStats* stats = NULL  // If not NULL, workers accumulate spectrometer stats from their A-lines
 	)
 	{
 		if (is_finished())
@@ -272,18 +328,17 @@ public:
 				}
 				else
 				{
-					printf("fastnisdoct/AlineProcessingPool: Planning lambda->k interpolation... ");
+					async_printf("fastnisdoct/AlineProcessingPool: Planning lambda->k interpolation... ");
 					this->interpdk_plan = WavenumberInterpolationPlan(this->aline_size, interpdk);
 					interpdk_plan_p = &this->interpdk_plan;
-					printf("Finished.\n");
-					fflush(stdout);
+					async_printf("Finished.\n");
 				}
 			}
 			if (number_of_workers > 1)
 			{
 				for (int i = 0; i < queues.size(); i++)
 				{
-					// printf("fastnisdoct/AlineProcessingPool: Enqueuing job in JobQueue at %p\n", queues[i]);
+					// async_printf("fastnisdoct/AlineProcessingPool: Enqueuing job in JobQueue at %p\n", queues[i]);
 					aline_processing_job_msg job;
 					job.dst_frame = dst_frame + i * this->roi_size * this->alines_per_worker;
 					job.src_frame = src_frame + i * this->aline_size * this->alines_per_worker;
@@ -292,19 +347,33 @@ public:
 					job.apod_window = apodization_window;
 					job.background_spectrum = background_spectrum;
 					job.fft_plan = &fft_plan;
+					job.display = display;
+					job.stats = stats;
+					job.timing = timing;
+					job.first_aline = i * this->alines_per_worker;
+					job.worker_index = i;
 					queues[i]->enqueue(job);
 				}
 			}
 			else
 			{
-				process_alines(dst_frame, src_frame, aline_size, alines_per_worker, roi_offset, roi_size, &fft_plan, interpdk_plan_p, background_spectrum, apodization_window, fft_buffer, interp_buffer.get());
+				int64_t t0 = PipelineStats::now();
+				process_alines(dst_frame, src_frame, aline_size, alines_per_worker, roi_offset, roi_size, &fft_plan, interpdk_plan_p, background_spectrum, apodization_window, fft_buffer, interp_buffer.get(), stats, 0, 0);
+				if (display != NULL)
+				{
+					display->accumulate(dst_frame, 0, alines_per_worker, 0);
+				}
+				if (timing != NULL)
+				{
+					timing->record_worker(0, t0);
+				}
 				_barrier++;
 			}
 			return 0;
 		}
 		else
 		{
-			printf("fastnisdoct/AlineProcessingPool: Failed to submit job... pool not finished with previous!\n");
+			async_printf("fastnisdoct/AlineProcessingPool: Failed to submit job... pool not finished with previous!\n");
 			return -1;
 		}
 	}
@@ -333,7 +402,7 @@ public:
 		_running.store(true);
 		if (number_of_workers > 1)
 		{
-			printf("fastnisdoct/AlineProcessingPool: Spawning %i threads on %i cores, each processing %i of %i A-lines\n", number_of_workers, std::thread::hardware_concurrency(), alines_per_worker, total_alines);
+			async_printf("fastnisdoct/AlineProcessingPool: Spawning %i threads on %i cores, each processing %i of %i A-lines\n", number_of_workers, std::thread::hardware_concurrency(), alines_per_worker, total_alines);
 			for (int i = 0; i < number_of_workers; i++)
 			{
 				queues.emplace_back( new JobQueue(32) );
@@ -342,7 +411,7 @@ public:
 		}
 		else
 		{
-			printf("fastnisdoct/AlineProcessingPool: Synchronous mode: Spawning zero new workers.\n");
+			async_printf("fastnisdoct/AlineProcessingPool: Synchronous mode: Spawning zero new workers.\n");
 		}
 		// else do work in calling thread
 		_barrier.store(number_of_workers);  // Set barrier to "finished" state.
@@ -364,7 +433,7 @@ public:
 			pool.clear();
 			queues.clear();
 		}
-		printf("fastnisdoct/AlineProcessingPool: terminated.\n");
+		async_printf("fastnisdoct/AlineProcessingPool: terminated.\n");
 	}
 };
 
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdarg>
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include <Windows.h>
+
+/*
+Lock-free asynchronous logger so that real-time threads never block on a slow console or Python stdout.
+
+async_printf() formats the message into a slot of a preallocated ring, a bounded MPMC queue after Dmitry
+Vyukov [1], and returns. A background thread drains the ring to stdout. If the ring is full, or more than
+ASYNC_LOG_MAX_PER_WINDOW messages are logged within ASYNC_LOG_WINDOW_MS, the message is discarded and
+counted, and the drain thread reports how many were lost. Messages are truncated to ASYNC_LOG_MESSAGE_SIZE.
+
+async_printf_every() additionally limits a call site, such as a per-frame message, to one message per
+period. The messages it skips are not counted.
+
+If the drain thread is not running, i.e. before the controller is opened or after it is closed, messages
+are printed synchronously.
+
+[1] http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+*/
+
+#define ASYNC_LOG_RING_SIZE 1024  // Must be a power of 2
+#define ASYNC_LOG_MESSAGE_SIZE 256
+#define ASYNC_LOG_WINDOW_MS 100
+#define ASYNC_LOG_MAX_PER_WINDOW 64
+#define ASYNC_LOG_DRAIN_SLEEP_MS 5
+#define LOG_PERIOD_MS 1000  // Period of async_printf_every for messages which may repeat every frame
+
+
+class AsyncLogger
+{
+private:
+
+	struct Slot
+	{
+		std::atomic<size_t> sequence;
+		char text[ASYNC_LOG_MESSAGE_SIZE];
+	};
+
+	Slot* ring;
+	alignas(64) std::atomic<size_t> enqueue_pos;
+	alignas(64) size_t dequeue_pos;  // Drain thread only
+
+	std::atomic_int in_window;  // Messages logged in the current rate limiting window
+	std::atomic_int dropped;  // Messages discarded since the drain thread last reported
+
+	std::atomic_bool running;
+	std::thread drain_thread;
+
+	// Pop and print every message in the ring. Returns the number printed.
+	int drain()
+	{
+		int n = 0;
+		while (true)
+		{
+			Slot* slot = &ring[dequeue_pos & (ASYNC_LOG_RING_SIZE - 1)];
+			size_t seq = slot->sequence.load(std::memory_order_acquire);
+			if (seq != dequeue_pos + 1)
+			{
+				break;  // Empty, or the producer has not finished writing the slot
+			}
+			fputs(slot->text, stdout);
+			slot->sequence.store(dequeue_pos + ASYNC_LOG_RING_SIZE, std::memory_order_release);
+			dequeue_pos++;
+			n++;
+		}
+		int lost = dropped.exchange(0);
+		if (lost > 0)
+		{
+			fprintf(stdout, "fastnisdoct: %i log messages were discarded.\n", lost);
+			n++;
+		}
+		if (n > 0)
+		{
+			fflush(stdout);
+		}
+		return n;
+	}
+
+	void _drain()
+	{
+		auto window_start = GetTickCount64();
+		while (running.load())
+		{
+			if (drain() == 0)
+			{
+				Sleep(ASYNC_LOG_DRAIN_SLEEP_MS);
+			}
+			auto now = GetTickCount64();
+			if (now - window_start >= ASYNC_LOG_WINDOW_MS)
+			{
+				in_window.store(0);
+				window_start = now;
+			}
+		}
+		drain();
+	}
+
+public:
+
+	AsyncLogger()
+	{
+		ring = new Slot[ASYNC_LOG_RING_SIZE];
+		for (size_t i = 0; i < ASYNC_LOG_RING_SIZE; i++)
+		{
+			ring[i].sequence.store(i);
+		}
+		enqueue_pos.store(0);
+		dequeue_pos = 0;
+		in_window.store(0);
+		dropped.store(0);
+		running.store(false);
+	}
+
+	~AsyncLogger()
+	{
+		stop();
+		delete[] ring;
+	}
+
+	void start()
+	{
+		if (!running.load())
+		{
+			running.store(true);
+			drain_thread = std::thread(&AsyncLogger::_drain, this);
+		}
+	}
+
+	// Stop the drain thread once it has printed every message in the ring
+	void stop()
+	{
+		if (running.load())
+		{
+			running.store(false);
+			drain_thread.join();
+		}
+	}
+
+	void vlog(const char* fmt, va_list args)
+	{
+		if (!running.load())
+		{
+			vprintf(fmt, args);
+			fflush(stdout);
+			return;
+		}
+		if (in_window.fetch_add(1, std::memory_order_relaxed) >= ASYNC_LOG_MAX_PER_WINDOW)
+		{
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+		Slot* slot;
+		while (true)
+		{
+			slot = &ring[pos & (ASYNC_LOG_RING_SIZE - 1)];
+			size_t seq = slot->sequence.load(std::memory_order_acquire);
+			intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+			if (dif == 0)
+			{
+				if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					break;
+				}
+			}
+			else if (dif < 0)
+			{
+				dropped.fetch_add(1, std::memory_order_relaxed);  // Full
+				return;
+			}
+			else
+			{
+				pos = enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+		vsnprintf(slot->text, ASYNC_LOG_MESSAGE_SIZE, fmt, args);
+		slot->sequence.store(pos + 1, std::memory_order_release);
+	}
+
+};
+
+
+inline AsyncLogger& async_logger()
+{
+	static AsyncLogger logger;
+	return logger;
+}
+
+
+// Drop-in replacement for printf which never blocks
+inline void async_printf(const char* fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	async_logger().vlog(fmt, args);
+	va_end(args);
+}
+
+
+// Log at most once per period_ms from this call site
+#define async_printf_every(period_ms, ...) \
+	do \
+	{ \
+		static std::atomic<uint64_t> _last_logged_ms(0); \
+		uint64_t _now_ms = GetTickCount64(); \
+		uint64_t _last_ms = _last_logged_ms.load(std::memory_order_relaxed); \
+		if (_now_ms - _last_ms >= (period_ms) && _last_logged_ms.compare_exchange_strong(_last_ms, _now_ms)) \
+		{ \
+			async_printf(__VA_ARGS__); \
+		} \
+	} while (0)
@@ -1,34 +1,59 @@
 #pragma once
 #include <cstdint>
+#include <cstring>
 #include <atomic>
-#include <mutex>
-#include <deque>
-#include <chrono>
+#include <Windows.h>
+#include "AsyncLogger.h"
+#include "TraceRecorder.h"
+#include "LargePageArena.h"
 
 /*
 Push-only ring buffer inspired by ring buffer interface of National Instruments IMAQ software.
 
-Elements pushed to the ring are given a count corresponding to the number of times push() has been called 
-since the buffer was initialized. A push() constitutes a copy into buffer-managed memory.
+Elements pushed to the ring are given a count corresponding to the number of times push() has been called
+since the buffer was initialized. A push() constitutes a copy into buffer-managed memory. Alternatively, the
+producer can write the next element in place between lock_out_head() and release_head().
 
-Any n-th element can be locked out of the ring for processing, copy or display and then subsequently released.
+Any number of readers can borrow() elements from the ring at the same time without a copy, each keeping its
+own cursor: the count of the next element it wants. Borrowed elements must be returned with release().
 
-If the n-th element isn't available yet, is already locked out, or is being accessed by another thread,
-lock_out() returns -1 after timing out.
+If the n-th element isn't available yet, borrow() spins briefly and then sleeps on the cumulative count with
+WaitOnAddress until the producer publishes another element or the timeout expires, in which case it returns -1.
+The producer only wakes readers if any are sleeping.
 
-If the n-th element has been overwritten, the buffer where the n-th element would have been
-is returned instead along with the count of the element you have actually locked out.
+If the n-th element has been overwritten, the element which replaced it is borrowed instead and its count
+returned, so that the reader can tell how many elements it has missed.
+
+The producer never waits for readers. Each slot of the ring points to an element whose pin count is
+incremented by each reader which borrows it. If the producer comes around to a slot which is still pinned, it
+swaps a spare element into the slot and orphans the pinned one, which is returned to the spares by the
+last reader to release it. There are as many spares as there may be borrows outstanding at once. If a reader
+holds more than that, the producer cannot write the element and lock_out_head() returns NULL.
+
+A reader which loaded an element from its slot just before it was swapped out pins it only for a moment, and
+may do so after the element has been returned to the spares. So that such a pin cannot return the element a
+second time, the pin state carries a generation which changes each time the element is taken from the spares,
+and an element is only returned by the release which moves it from orphaned to spare in its generation.
+
+Elements are carved from a LargePageArena, so the ring is pre-faulted and locked into memory when it is
+constructed. Each element is aligned to ARENA_ALIGNMENT.
 
 github.com/sstucker
 2021
 */
 
-typedef std::chrono::high_resolution_clock clk;
-typedef std::chrono::microseconds us;
+#define CIRC_ACQ_WRITING -2  // Count of an element the producer is writing
+#define CIRC_ACQ_PIN_MASK 0x3FFFFFFFULL  // Pins in the low bits of the pin state
+#define CIRC_ACQ_ORPHANED 0x40000000ULL  // Set in the pin state of an element which has been swapped out of the ring
+#define CIRC_ACQ_SPARE 0x80000000ULL  // Set in the pin state of an element which is in the spares
+#define CIRC_ACQ_STATE_MASK (CIRC_ACQ_PIN_MASK | CIRC_ACQ_ORPHANED | CIRC_ACQ_SPARE)
+#define CIRC_ACQ_GENERATION 0x100000000ULL  // Generation of the element in the high bits of the pin state
+#define CIRC_ACQ_DEFAULT_MAX_BORROWS 6  // A writer holds up to UNBUFFERED_QUEUE_DEPTH frames and the main thread one
+#define CIRC_ACQ_SPIN 256  // Attempts to borrow before a reader sleeps
 
-inline int mod2(int a, int b)
+inline int mod2(int64_t a, int b)
 {
-	int r = a % b;
+	int r = (int)(a % b);
 	return r < 0 ? r + b : r;
 }
 
@@ -36,8 +61,18 @@ template <typename T>
 struct CircAcqElement
 {
 	T* arr;  // the buffer
-	int index;  // position of data in ring 
-	std::atomic_int count;  // the count of the data currently in the buffer. Needs to be atomic as it is polled from outside the lock
+	std::atomic<int64_t> count;  // the count of the data currently in the buffer, -1 if empty or CIRC_ACQ_WRITING
+	std::atomic<uint64_t> pins;  // generation | CIRC_ACQ_SPARE | CIRC_ACQ_ORPHANED | number of outstanding pins
+};
+
+
+// Handle to an element borrowed from a CircAcqBuffer
+template <typename T>
+struct CircAcqBorrow
+{
+	T* arr;
+	int64_t count;
+	CircAcqElement<T>* element;
 };
 
 
@@ -46,169 +81,312 @@ class CircAcqBuffer
 {
 protected:
 
-	CircAcqElement<T>** ring;
-	CircAcqElement<T>* locked_out_buffer;
+	std::atomic<CircAcqElement<T>*>* ring;
+	CircAcqElement<T>* elements;  // Backing storage for ring_size + number_of_spares elements
+	LargePageArena* arena;  // Memory of the elements' arrays
+	std::atomic<CircAcqElement<T>*>* spares;  // NULL where a spare has been taken
 	int ring_size;
+	int number_of_spares;
 	uint64_t element_size;
-	std::atomic_long count;  // cumulative count
-	std::atomic_int locked;  // index of currently locked out buffer
-	std::atomic_int head;  // Head of buffer (receives push)
-	std::deque<std::mutex> locks;
+	std::atomic<int64_t> count;  // cumulative count. Readers wait on its address for the next element
+	std::atomic_int waiters;  // Readers sleeping on count
+	int head;  // Head of buffer (receives push). Producer only
+	CircAcqElement<T>* writing;  // Element between lock_out_head() and release_head(). Producer only
+	std::atomic<int64_t> failed_pushes;  // Pushes which found no spare for a pinned slot
 
-	inline void _swap(int n)
+	CircAcqElement<T>* _take_spare()
 	{
-		locked.store(n);  // Update locked out value
-
-		// Pointer swap
-		CircAcqElement<T>* tmp = locked_out_buffer;
-		locked_out_buffer = ring[n];
-		ring[n] = tmp;
-
-		// Update index to buffer's new position in ring
-		ring[n]->index = n;
+		for (int i = 0; i < number_of_spares; i++)
+		{
+			CircAcqElement<T>* e = spares[i].exchange(NULL);
+			if (e != NULL)
+			{
+				// Next generation. Stale readers may still hold a transient pin, which they will drop
+				uint64_t state = e->pins.load();
+				while (!e->pins.compare_exchange_weak(state, (state & ~CIRC_ACQ_STATE_MASK) + CIRC_ACQ_GENERATION + (state & CIRC_ACQ_PIN_MASK)));
+				return e;
+			}
+		}
+		return NULL;
 	}
 
-	inline long _lock_out(int n, T** buffer, int timeout_ms)
+	void _return_spare(CircAcqElement<T>* e)
 	{
-		auto start = clk::now();  // Start timeout timer
-		int timeout_us = timeout_ms * 1000;  // Compare using integer microseconds
-		while (locked.load() != -1)
+		while (true)  // There is always room, as there are as many spare slots as spare elements and each is returned once
 		{
-			if (std::chrono::duration_cast<us>(clk::now() - start).count() > timeout_us)
+			for (int i = 0; i < number_of_spares; i++)
 			{
-				printf("CircAcqBuffer: Timed out waiting for locked out buffer to be released.\n");
-				return -1;
+				CircAcqElement<T>* expected = NULL;
+				if (spares[i].compare_exchange_strong(expected, e))
+				{
+					return;
+				}
 			}
 		}
-		int requested = mod2(n, ring_size);  // Get index of buffer where requested element is/was
-		while (n > ring[requested]->count.load())
+	}
+
+	// Return an orphaned element to the spares if its pin state is still orphaned, unpinned and of the same generation
+	inline void _reclaim(CircAcqElement<T>* e, uint64_t orphaned)
+	{
+		if (e->pins.compare_exchange_strong(orphaned, (orphaned & ~CIRC_ACQ_ORPHANED) | CIRC_ACQ_SPARE))
 		{
-			if (std::chrono::duration_cast<us>(clk::now() - start).count() > timeout_us)
-			{
-				printf("CircAcqBuffer: Timed out trying to acquire %i for %i ms.\n", n, timeout_ms);
-				return -1;
-			}
+			_return_spare(e);
 		}
-		while (!locks[requested].try_lock())
+	}
+
+	inline void _unpin(CircAcqElement<T>* e)
+	{
+		uint64_t state = e->pins.fetch_sub(1);
+		if ((state & CIRC_ACQ_STATE_MASK) == (CIRC_ACQ_ORPHANED | 1))
 		{
-			if (std::chrono::duration_cast<us>(clk::now() - start).count() > timeout_us)
-			{
-				printf("CircAcqBuffer: Timed out trying to unlock buffer %i for %i ms.\n", requested, timeout_ms);
-				return -1;
-			}
+			_reclaim(e, state - 1);  // Last reader of an orphaned element, unless another has pinned it since
 		}
-		_swap(requested);
-		*buffer = locked_out_buffer->arr;  // Return pointer to locked out buffer's array by reference
-		auto locked_out = locked_out_buffer->count.load();  // Return true count of the locked out buffer
-		locks[requested].unlock();
-		return locked_out;
+	}
+
+	// Try once to pin the element in slot i which holds count n or newer. Returns its count, or -1 if it holds an older element.
+	inline int64_t _try_borrow(int i, int64_t n, CircAcqBorrow<T>* borrowed)
+	{
+		CircAcqElement<T>* e = ring[i].load();
+		uint64_t state = e->pins.fetch_add(1);
+		if ((state & (CIRC_ACQ_ORPHANED | CIRC_ACQ_SPARE)) || ring[i].load() != e)
+		{
+			_unpin(e);  // Swapped out by the producer since it was loaded
+			return -1;
+		}
+		int64_t c = e->count.load();
+		if (c < n || c < 0)  // Not written yet, or being written
+		{
+			_unpin(e);
+			return -1;
+		}
+		borrowed->arr = e->arr;
+		borrowed->count = c;
+		borrowed->element = e;
+		return c;
 	}
 
 public:
 
 	CircAcqBuffer()
 	{
+		ring = NULL;
+		elements = NULL;
+		arena = NULL;
+		spares = NULL;
 		ring_size = 0;
+		number_of_spares = 0;
 		element_size = 0;
-		head = ATOMIC_VAR_INIT(0);
+		head = 0;
+		writing = NULL;
+		waiters.store(0);
 	}
 
-	CircAcqBuffer(int number_of_buffers, uint64_t frame_size)
+	CircAcqBuffer(int number_of_buffers, uint64_t frame_size, int max_borrows = CIRC_ACQ_DEFAULT_MAX_BORROWS)
 	{
 		ring_size = number_of_buffers;
+		number_of_spares = max_borrows;
 		element_size = frame_size;
-		head = ATOMIC_VAR_INIT(0);
-		locked = ATOMIC_VAR_INIT(-1);
-		ring = new CircAcqElement<T>*[ring_size];
-		locks.resize(ring_size);
+		head = 0;
+		writing = NULL;
+		ring = new std::atomic<CircAcqElement<T>*>[ring_size];
+		spares = new std::atomic<CircAcqElement<T>*>[number_of_spares];
+		elements = new CircAcqElement<T>[ring_size + number_of_spares];
+		size_t element_bytes = arena_round_up(sizeof(T) * element_size, ARENA_ALIGNMENT);
+		arena = new LargePageArena(element_bytes * (ring_size + number_of_spares));
+		bool carved = true;
+		for (int i = 0; i < ring_size + number_of_spares; i++)
+		{
+			elements[i].arr = (T*)arena->carve(element_bytes);
+			elements[i].count.store(-1);
+			elements[i].pins.store((i < ring_size) ? 0 : CIRC_ACQ_SPARE);
+			carved = carved && (elements[i].arr != NULL);
+		}
+		if (!carved)  // The ring cannot be used. get_page_size() reports 0
+		{
+			async_printf("fastnisdoct/CircAcqBuffer: Failed to allocate %i elements of %llu bytes!\n", ring_size + number_of_spares, (unsigned long long)element_bytes);
+			for (int i = 0; i < ring_size + number_of_spares; i++)
+			{
+				elements[i].arr = NULL;
+			}
+			delete arena;
+			arena = NULL;
+		}
 		for (int i = 0; i < ring_size; i++)
 		{
-			ring[i] = new(CircAcqElement<T>);
-			ring[i]->arr = new T[element_size];
-			ring[i]->index = i;
-			ring[i]->count = -1;
+			ring[i].store(&elements[i]);
 		}
-		// locked_out_buffer maps to memory swapped in to replace a buffer when it is locked out
-		locked_out_buffer = new(CircAcqElement<T>);
-		locked_out_buffer->arr = new T[element_size];
-		locked_out_buffer->index = -1;
-		locked_out_buffer->count = -1;
-		count = ATOMIC_VAR_INIT(-1);
+		for (int i = 0; i < number_of_spares; i++)
+		{
+			spares[i].store(&elements[ring_size + i]);
+		}
+		count.store(-1);
+		waiters.store(0);
+		failed_pushes.store(0);
 	}
 
-	long lock_out(int n, T** buffer, int timeout_ms)
+	// Borrow the n-th element, or the element which has overwritten it. Returns the count of the borrowed element or -1 if timed out.
+	int64_t borrow(int64_t n, CircAcqBorrow<T>* borrowed, int timeout_ms)
 	{
-		return _lock_out(n, buffer, timeout_ms);
+		TRACE_SCOPE_N("ring borrow", n);
+		int i = mod2(n, ring_size);  // Get index of buffer where requested element is/was
+		uint64_t deadline = GetTickCount64() + timeout_ms;
+		int spins = 0;
+		while (true)
+		{
+			int64_t published = count.load();  // Loaded before trying so that a publish in between wakes the wait below
+			int64_t c = _try_borrow(i, n, borrowed);
+			if (c > -1)
+			{
+				return c;
+			}
+			if (spins < CIRC_ACQ_SPIN)
+			{
+				spins++;
+				YieldProcessor();
+				continue;
+			}
+			uint64_t now = GetTickCount64();
+			if (now >= deadline)
+			{
+				return -1;
+			}
+			waiters.fetch_add(1);
+			WaitOnAddress((volatile void*)&count, &published, sizeof(int64_t), (DWORD)(deadline - now));  // Returns at once if count != published
+			waiters.fetch_sub(1);
+		}
 	}
 
-	long lock_out(int n, T** buffer)
+	int64_t borrow(int64_t n, CircAcqBorrow<T>* borrowed)
 	{
-		return _lock_out(n, buffer, 0);
+		return borrow(n, borrowed, 0);
 	}
 
-	void release()
+	void release(CircAcqBorrow<T>* borrowed)
 	{
-		locked.store(-1);
+		_unpin(borrowed->element);
+		borrowed->element = NULL;
+		borrowed->arr = NULL;
 	}
 
+	// Copy src into the head of the ring. Returns the index it was written to, or -1 if it could not be written.
 	int push(T* src)
 	{
-		int oldhead = head;
-		locks[head].lock();
-		memcpy(ring[head]->arr, src, sizeof(T) * element_size);
-		ring[head]->count.store(count);
-		head = mod2(head + 1, ring_size);
-		count += 1;
-		locks[oldhead].unlock();
-		return oldhead;
+		T* dst = lock_out_head();
+		if (dst == NULL)
+		{
+			return -1;
+		}
+		memcpy(dst, src, sizeof(T) * element_size);
+		return release_head();
 	}
 
+	// Get the head of the ring to write the next element into in place. Returns NULL if every spare is borrowed.
 	T* lock_out_head()
 	{
-		locks[head].lock();
-		return ring[head]->arr;
+		TRACE_SCOPE("ring lock out head");
+		CircAcqElement<T>* e = ring[head].load();
+		int64_t previous_count = e->count.exchange(CIRC_ACQ_WRITING);  // Readers which pin the element from now on will not read it
+		if ((e->pins.load() & CIRC_ACQ_PIN_MASK) == 0)
+		{
+			writing = e;
+			return e->arr;
+		}
+		// Still borrowed: orphan it and write into a spare instead
+		CircAcqElement<T>* spare = _take_spare();
+		if (spare == NULL)
+		{
+			e->count.store(previous_count);
+			failed_pushes.fetch_add(1);
+			async_printf_every(LOG_PERIOD_MS, "CircAcqBuffer: Element %lli is still borrowed and there are no spares. Cannot write to the ring.\n", previous_count);
+			return NULL;
+		}
+		e->count.store(previous_count);  // Readers of the orphan have the count already, but keep it consistent
+		spare->count.store(CIRC_ACQ_WRITING);
+		ring[head].store(spare);
+		uint64_t state = e->pins.fetch_or(CIRC_ACQ_ORPHANED);
+		if ((state & CIRC_ACQ_PIN_MASK) == 0)
+		{
+			_reclaim(e, state | CIRC_ACQ_ORPHANED);  // Released since it was checked
+		}
+		writing = spare;
+		return spare->arr;
 	}
 
+	// Publish the element written since lock_out_head(). Returns the index it was written to.
 	int release_head()
 	{
-		count += 1;
-		ring[head]->count = count;
+		return release_head(NULL);
+	}
+
+	// Publish the element written since lock_out_head() and keep borrowing it, i.e. so that the producer can go on
+	// reading the element in place. It must be returned with release() like any other borrow.
+	int release_head(CircAcqBorrow<T>* keep)
+	{
+		int64_t c = count.load() + 1;
+		if (keep != NULL)
+		{
+			writing->pins.fetch_add(1);  // Pinned before it is published so that it cannot be reclaimed
+			keep->arr = writing->arr;
+			keep->count = c;
+			keep->element = writing;
+		}
+		writing->count.store(c);
+		count.store(c);
+		if (waiters.load() > 0)
+		{
+			WakeByAddressAll((void*)&count);
+		}
+		writing = NULL;
 		int oldhead = head;
 		head = mod2(head + 1, ring_size);
-		locks[oldhead].unlock();
 		return oldhead;
 	}
 
-	int get_count()
+	// Discard the element written since lock_out_head(), i.e. if it could not be completed. The head does not advance.
+	void abandon_head()
+	{
+		writing->count.store(-1);
+		writing = NULL;
+	}
+
+	int get_size()
+	{
+		return ring_size;
+	}
+
+	int64_t get_count()
 	{
 		return count.load();
 	}
 
+	// Size of the pages backing the ring in bytes, 0 if it could not be allocated
+	size_t get_page_size()
+	{
+		return (arena != NULL) ? arena->page_size() : 0;
+	}
+
+	int64_t get_failed_pushes()
+	{
+		return failed_pushes.load();
+	}
+
+	// Forget all elements. Borrowed elements remain valid until they are released.
 	void clear()
 	{
 		for (int i = 0; i < ring_size; i++)
 		{
-			locks[i].lock();
-			ring[i]->index = i;
-			ring[i]->count = -1;
-			locks[i].unlock();
+			ring[i].load()->count.store(-1);
 		}
 		count.store(-1);
-		head.store(0);
-		locked.store(-1);
-		locked_out_buffer->index = -1;
-		locked_out_buffer->count = -1;
+		head = 0;
 	}
 
 	~CircAcqBuffer()
 	{
-		for (int i = 0; i < ring_size; i++)
-		{
-			delete[] ring[i]->arr;
-		}
+		delete arena;
+		delete[] elements;
 		delete[] ring;
-		delete[] locked_out_buffer->arr;
-		delete locked_out_buffer;
+		delete[] spares;
 	}
 
 };
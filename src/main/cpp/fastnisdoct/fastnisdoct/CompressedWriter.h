@@ -0,0 +1,217 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <Windows.h>
+#include "AsyncLogger.h"
+#include "SpectralCodec.h"
+#include "Writer.h"
+#include "CompressionQueue.h"
+
+/*
+Writer of frames of raw spectra compressed with the SpectralCodec, in a container with the suffix .fnz.
+
+Frames are compressed in parallel by CODEC_THREADS threads of a CompressionQueue and written in order by its writing
+thread. A frame is pending until it has been compressed, so the frames held by the writer are bounded by
+CODEC_MAX_PENDING, and up to CODEC_QUEUE_DEPTH compressed frames wait to be written.
+
+The file begins with a CODEC_HEADER_SIZE byte header: the magic "FNZSPEC1", the uint32 version and CODEC_BLOCK,
+then the uint64 number of samples per frame and per A-line. Each frame follows as its uint32 size in bytes and then
+its encoding. When the file is closed, an index of the uint64 offset of each frame is appended, followed by the
+uint64 number of frames and the magic "FNZINDEX". Without the index, the frames can be found by their sizes.
+
+The number of bytes in and out is accumulated in CodecStats, so the compression ratio can be reported live.
+*/
+
+#define CODEC_THREADS 4
+#define CODEC_QUEUE_DEPTH 8
+#define CODEC_MAX_PENDING UNBUFFERED_QUEUE_DEPTH
+#define CODEC_HEADER_SIZE 64
+#define CODEC_VERSION 1
+
+
+struct CodecStats
+{
+	std::atomic<uint64_t> bytes_in;
+	std::atomic<uint64_t> bytes_out;
+
+	CodecStats()
+	{
+		bytes_in.store(0);
+		bytes_out.store(0);
+	}
+
+	void reset()
+	{
+		bytes_in.store(0);
+		bytes_out.store(0);
+	}
+
+	// Raw bytes per byte written, 0 if nothing has been written
+	double ratio()
+	{
+		uint64_t out = bytes_out.load();
+		return (out > 0) ? (double)bytes_in.load() / (double)out : 0.0;
+	}
+};
+
+
+class CompressedWriter : public Writer
+{
+private:
+
+	HANDLE file;
+	char name[MAX_PATH];
+	size_t frame_samples;
+	size_t line_samples;
+	CodecStats* stats;
+
+	std::unique_ptr<CompressionQueue> queue;  // Of records. Each slot's first buffer holds the size, then the encoding
+	uint64_t offset;  // Of the next frame. Writing thread only while the file is open
+	std::vector<uint64_t> index;
+
+	bool write(const void* src, DWORD n)
+	{
+		DWORD written = 0;
+		if (!WriteFile(file, src, n, &written, NULL) || written != n)
+		{
+			async_printf_every(LOG_PERIOD_MS, "fastnisdoct/CompressedWriter: Failed to write to %s: error %lu\n", name, GetLastError());
+			return false;
+		}
+		offset += n;
+		return true;
+	}
+
+	void _compress(CompressionSlot* slot)
+	{
+		uint8_t* record = (uint8_t*)slot->buffers[0].get();
+		uint32_t n = (uint32_t)codec_encode((const uint16_t*)slot->frame, frame_samples, line_samples, record + sizeof(uint32_t));
+		memcpy(record, &n, sizeof(uint32_t));
+		slot->out = record;
+		slot->out_size = n + sizeof(uint32_t);
+	}
+
+	void _write(CompressionSlot* slot)
+	{
+		index.push_back(offset);
+		write(slot->out, (DWORD)slot->out_size);
+		if (stats != NULL)
+		{
+			stats->bytes_in.fetch_add(frame_samples * sizeof(uint16_t));
+			stats->bytes_out.fetch_add(slot->out_size);
+		}
+	}
+
+public:
+
+	// Frames of frame_samples samples in A-lines of line_samples. Bytes in and out are accumulated in stats if not NULL
+	CompressedWriter(size_t frame_samples, size_t line_samples, CodecStats* stats)
+	{
+		file = INVALID_HANDLE_VALUE;
+		this->frame_samples = frame_samples;
+		this->line_samples = (line_samples > 0) ? line_samples : frame_samples;
+		this->stats = stats;
+		queue = std::make_unique<CompressionQueue>(CODEC_QUEUE_DEPTH, CODEC_THREADS, [this](CompressionSlot* slot) { _compress(slot); }, [this](CompressionSlot* slot) { _write(slot); });
+		for (int i = 0; i < CODEC_QUEUE_DEPTH; i++)
+		{
+			queue->slot(i)->buffers[0] = std::make_unique<char[]>(sizeof(uint32_t) + codec_bound(frame_samples));
+		}
+	}
+
+	~CompressedWriter()
+	{
+		close();
+		queue.reset();
+	}
+
+	void open(const char* fname) override
+	{
+		strcpy_s(name, MAX_PATH, fname);
+		queue->reset();
+		file = CreateFileA(fname, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			async_printf("Failed to open file: %s, error %lu\n", fname, GetLastError());
+			return;
+		}
+		char header[CODEC_HEADER_SIZE];
+		memset(header, 0, CODEC_HEADER_SIZE);
+		uint32_t version = CODEC_VERSION;
+		uint32_t block = CODEC_BLOCK;
+		uint64_t samples[2] = { frame_samples, line_samples };
+		memcpy(header, "FNZSPEC1", 8);
+		memcpy(header + 8, &version, 4);
+		memcpy(header + 12, &block, 4);
+		memcpy(header + 16, samples, 16);
+		offset = 0;
+		write(header, CODEC_HEADER_SIZE);
+		index.clear();
+	}
+
+	bool is_open() override
+	{
+		return file != INVALID_HANDLE_VALUE;
+	}
+
+	void preallocate(int64_t bytes) override
+	{
+		if (file != INVALID_HANDLE_VALUE)
+		{
+			preallocate_file(file, name, CODEC_HEADER_SIZE + bytes / 2);  // Spectra compress to about half or less
+		}
+	}
+
+	void writeFrame(void* f, long frame_size) override
+	{
+		wait_pending(CODEC_MAX_PENDING - 1);  // Bound the frames borrowed from the ring
+		queue->submit(f);  // Waits for the frame submitted CODEC_QUEUE_DEPTH frames ago to be written
+	}
+
+	// Frames from the oldest which has yet to be compressed
+	int pending() override
+	{
+		return queue->uncompressed();
+	}
+
+	void wait_pending(int n) override
+	{
+		queue->wait_uncompressed(n);
+	}
+
+	void close() override
+	{
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			return;
+		}
+		queue->wait_unwritten(0);
+		uint64_t n = index.size();
+		bool ok = write(index.data(), (DWORD)(n * sizeof(uint64_t)));
+		ok = ok && write(&n, sizeof(uint64_t));
+		ok = ok && write("FNZINDEX", 8);
+		if (!ok)
+		{
+			async_printf("fastnisdoct/CompressedWriter: Failed to write the index of %s. It contains %lli frames\n", name, (long long)n);
+		}
+		CloseHandle(file);
+		file = INVALID_HANDLE_VALUE;
+	}
+
+};
+
+
+// Only raw spectra are compressed. Returns NULL for other frames
+inline Writer* make_compressed_writer(uint16_t*, size_t frame_samples, size_t line_samples, CodecStats* stats)
+{
+	return new CompressedWriter(frame_samples, line_samples, stats);
+}
+
+template <class T>
+inline Writer* make_compressed_writer(T*, size_t frame_samples, size_t line_samples, CodecStats* stats)
+{
+	return NULL;
+}
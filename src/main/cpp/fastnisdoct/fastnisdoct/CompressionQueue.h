@@ -0,0 +1,244 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include "TraceRecorder.h"
+
+/*
+Queue of frames which are compressed in parallel by a pool of threads and then written in the order they were
+submitted by one writing thread, shared by the writers of compressed formats.
+
+Each frame submitted takes the next of depth slots and is passed to compress() by whichever thread is free, then to
+write() once the frames before it have been written, after which its slot is free again. If compress is empty, frames
+are passed straight to write(). Every thread blocks while it has nothing to do, as does a producer which is waiting
+for a slot or for frames to be compressed or written.
+*/
+
+
+enum CompressionSlotState
+{
+	COMPRESSION_SLOT_FREE = 0,
+	COMPRESSION_SLOT_SUBMITTED = 1,  // Waiting for a compression thread
+	COMPRESSION_SLOT_COMPRESSING = 2,
+	COMPRESSION_SLOT_READY = 3  // Waiting to be written
+};
+
+
+struct CompressionSlot
+{
+	int state;  // Guarded by the queue
+	int64_t n;  // Number of the frame since the queue was reset
+	const void* frame;
+	const void* out;  // What write() writes: the frame or its compressed copy
+	size_t out_size;
+	uint32_t flags;  // Of the writer, i.e. to tell write() how the frame was compressed
+	std::unique_ptr<char[]> buffers[2];  // Of the writer, i.e. to compress the frame into
+};
+
+
+class CompressionQueue
+{
+private:
+
+	std::unique_ptr<CompressionSlot[]> slots;
+	int depth;
+	std::function<void(CompressionSlot*)> compress;
+	std::function<void(CompressionSlot*)> write;
+
+	std::mutex lock;
+	std::condition_variable changed;  // Of the state of any slot
+	int64_t submitted;
+	int64_t written;
+	bool running;
+
+	std::thread write_thread;
+	std::vector<std::thread> compression_threads;
+
+	// The frames from the oldest which has yet to be compressed, with the lock held
+	int _uncompressed()
+	{
+		for (int64_t k = written; k < submitted; k++)
+		{
+			int state = slots[k % depth].state;
+			if (state == COMPRESSION_SLOT_SUBMITTED || state == COMPRESSION_SLOT_COMPRESSING)
+			{
+				return (int)(submitted - k);
+			}
+		}
+		return 0;
+	}
+
+	void _compress()
+	{
+		TRACE_THREAD_NAME("compress");
+		std::unique_lock<std::mutex> guard(lock);
+		while (true)
+		{
+			CompressionSlot* slot = NULL;
+			changed.wait(guard, [&]
+			{
+				for (int64_t k = written; k < submitted && slot == NULL; k++)
+				{
+					if (slots[k % depth].state == COMPRESSION_SLOT_SUBMITTED)
+					{
+						slot = &slots[k % depth];
+					}
+				}
+				return slot != NULL || !running;
+			});
+			if (slot == NULL)
+			{
+				return;
+			}
+			slot->state = COMPRESSION_SLOT_COMPRESSING;
+			guard.unlock();
+			{
+				TRACE_SCOPE_N("compress", slot->n);
+				compress(slot);
+			}
+			guard.lock();
+			slot->state = COMPRESSION_SLOT_READY;
+			changed.notify_all();
+		}
+	}
+
+	void _write()
+	{
+		TRACE_THREAD_NAME("compressed writer");
+		std::unique_lock<std::mutex> guard(lock);
+		while (true)
+		{
+			changed.wait(guard, [this] { return (written < submitted && slots[written % depth].state == COMPRESSION_SLOT_READY) || (!running && written == submitted); });
+			if (written == submitted)
+			{
+				return;  // Stopped with nothing left to write
+			}
+			CompressionSlot* slot = &slots[written % depth];
+			guard.unlock();
+			{
+				TRACE_SCOPE_N("write compressed", slot->n);
+				write(slot);
+			}
+			guard.lock();
+			slot->state = COMPRESSION_SLOT_FREE;
+			written++;
+			changed.notify_all();
+		}
+	}
+
+public:
+
+	// Frames are compressed by n_threads threads with compress, unless it is empty, and written with write
+	CompressionQueue(int depth, int n_threads, std::function<void(CompressionSlot*)> compress, std::function<void(CompressionSlot*)> write)
+	{
+		this->depth = depth;
+		this->compress = compress;
+		this->write = write;
+		slots = std::make_unique<CompressionSlot[]>(depth);
+		for (int i = 0; i < depth; i++)
+		{
+			slots[i].state = COMPRESSION_SLOT_FREE;
+			slots[i].n = -1;
+			slots[i].frame = NULL;
+			slots[i].out = NULL;
+			slots[i].out_size = 0;
+			slots[i].flags = 0;
+		}
+		submitted = 0;
+		written = 0;
+		running = true;
+		write_thread = std::thread(&CompressionQueue::_write, this);
+		if (compress)
+		{
+			for (int i = 0; i < n_threads; i++)
+			{
+				compression_threads.emplace_back(&CompressionQueue::_compress, this);
+			}
+		}
+	}
+
+	// Stops the threads once every frame submitted has been written
+	~CompressionQueue()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			running = false;
+			changed.notify_all();
+		}
+		write_thread.join();
+		for (auto& t : compression_threads)
+		{
+			t.join();
+		}
+	}
+
+	int get_depth()
+	{
+		return depth;
+	}
+
+	// The i-th slot, to allocate its buffers before any frame is submitted
+	CompressionSlot* slot(int i)
+	{
+		return &slots[i];
+	}
+
+	// Queue frame, waiting for the frame submitted depth frames before it to be written
+	void submit(const void* frame)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		changed.wait(guard, [this] { return slots[submitted % depth].state == COMPRESSION_SLOT_FREE; });
+		CompressionSlot* slot = &slots[submitted % depth];
+		slot->n = submitted;
+		slot->frame = frame;
+		slot->out = frame;
+		slot->out_size = 0;
+		slot->flags = 0;
+		slot->state = compress ? COMPRESSION_SLOT_SUBMITTED : COMPRESSION_SLOT_READY;
+		submitted++;
+		changed.notify_all();
+	}
+
+	// Frames from the oldest which has yet to be compressed, i.e. which the queue still reads from
+	int uncompressed()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		return _uncompressed();
+	}
+
+	// Frames which have yet to be written
+	int unwritten()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		return (int)(submitted - written);
+	}
+
+	// Wait until no more than n frames are uncompressed()
+	void wait_uncompressed(int n)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		changed.wait(guard, [this, n] { return _uncompressed() <= n; });
+	}
+
+	// Wait until no more than n frames are unwritten()
+	void wait_unwritten(int n)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		changed.wait(guard, [this, n] { return submitted - written <= n; });
+	}
+
+	// Number frames from 0 again, once every frame has been written
+	void reset()
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		changed.wait(guard, [this] { return written == submitted; });
+		submitted = 0;
+		written = 0;
+	}
+
+};
@@ -0,0 +1,366 @@
+#pragma once
+
+#include <memory>
+#include <cmath>
+#include <cstring>
+#include <cfloat>
+#include "fftw3.h"
+
+/*
+Reduces processed frames to the small 2D images displayed by the client: a B-scan (slice or projection
+along one lateral axis), an en face image (slice or projection along z), their log scaling, a histogram
+of each for automatic levels and the final uint8 quantization.
+
+Processed frames are FORTRAN-ordered [z, x, y]. accumulate() can be called concurrently by any number of
+workers on disjoint ranges of A-lines, so the reduction takes place while each worker's A-lines are still
+in its cache. Projections across the B-scan axis are summed into per-worker partials which are combined by
+finish() along with the log scaling, histograms and quantization, all of which operate only on the 2D images.
+*/
+
+#define DISPLAY_HISTOGRAM_BINS 256
+
+enum DisplayProjection
+{
+	DISPLAY_SLICE = 0,
+	DISPLAY_MAX = 1,
+	DISPLAY_MEAN = 2
+};
+
+
+enum DisplayBScanAxis
+{
+	DISPLAY_BSCAN_X = 0,  // [z, x] image at y = bscan_index
+	DISPLAY_BSCAN_Y = 1  // [z, y] image at x = bscan_index
+};
+
+
+struct DisplayConfig
+{
+	int bscan_axis;  // DisplayBScanAxis
+	int bscan_projection;  // DisplayProjection across the axis not displayed in the B-scan
+	int bscan_index;  // Index of the slice if bscan_projection is DISPLAY_SLICE
+	int enface_projection;  // DisplayProjection along z
+	int enface_index;  // Index in z of the slice if enface_projection is DISPLAY_SLICE
+	bool log_scale;  // If true, 20 * log10 is taken of the magnitude prior to quantization
+	bool auto_levels;  // If true, levels are set from the histogram percentiles below. Otherwise the manual levels are used.
+	float percentile_low;  // [0, 100]
+	float percentile_high;  // [0, 100]
+	float bscan_levels[2];  // Manual levels mapped to 0 and 255
+	float enface_levels[2];
+};
+
+
+inline DisplayConfig default_display_config()
+{
+	DisplayConfig config;
+	config.bscan_axis = DISPLAY_BSCAN_X;
+	config.bscan_projection = DISPLAY_SLICE;
+	config.bscan_index = 0;
+	config.enface_projection = DISPLAY_MAX;
+	config.enface_index = 0;
+	config.log_scale = true;
+	config.auto_levels = true;
+	config.percentile_low = 1.0;
+	config.percentile_high = 99.9;
+	config.bscan_levels[0] = 0.0;
+	config.bscan_levels[1] = 1.0;
+	config.enface_levels[0] = 0.0;
+	config.enface_levels[1] = 1.0;
+	return config;
+}
+
+
+// Histogram of image spanning its own range, then levels at the requested percentiles
+inline void histogram_levels(const float* image, int64_t n, float percentile_low, float percentile_high, uint32_t* histogram, float* levels)
+{
+	memset(histogram, 0, DISPLAY_HISTOGRAM_BINS * sizeof(uint32_t));
+	float lo = FLT_MAX;
+	float hi = -FLT_MAX;
+	for (int64_t i = 0; i < n; i++)
+	{
+		lo = (image[i] < lo) ? image[i] : lo;
+		hi = (image[i] > hi) ? image[i] : hi;
+	}
+	if (n == 0 || hi <= lo)
+	{
+		levels[0] = (n == 0) ? 0.0 : lo;
+		levels[1] = levels[0] + 1.0;
+		return;
+	}
+	float bin_width = (hi - lo) / DISPLAY_HISTOGRAM_BINS;
+	for (int64_t i = 0; i < n; i++)
+	{
+		int bin = (int)((image[i] - lo) / bin_width);
+		histogram[(bin < DISPLAY_HISTOGRAM_BINS) ? bin : DISPLAY_HISTOGRAM_BINS - 1]++;
+	}
+	int64_t target_low = (int64_t)(n * percentile_low / 100.0);
+	int64_t target_high = (int64_t)(n * percentile_high / 100.0);
+	int64_t cumulative = 0;
+	levels[0] = lo;
+	levels[1] = hi;
+	bool low_found = false;
+	for (int i = 0; i < DISPLAY_HISTOGRAM_BINS; i++)
+	{
+		cumulative += histogram[i];
+		if (!low_found && cumulative > target_low)
+		{
+			levels[0] = lo + i * bin_width;
+			low_found = true;
+		}
+		if (cumulative >= target_high)
+		{
+			levels[1] = lo + (i + 1) * bin_width;
+			break;
+		}
+	}
+}
+
+
+inline void quantize(const float* image, int64_t n, const float* levels, uint8_t* dst)
+{
+	float scale = (levels[1] > levels[0]) ? 255.0 / (levels[1] - levels[0]) : 0.0;
+	for (int64_t i = 0; i < n; i++)
+	{
+		float v = (image[i] - levels[0]) * scale;
+		v = (v < 0.0) ? 0.0 : v;
+		v = (v > 255.0) ? 255.0 : v;
+		dst[i] = (uint8_t)(v + 0.5);
+	}
+}
+
+
+inline void log_scale(float* image, int64_t n)
+{
+	for (int64_t i = 0; i < n; i++)
+	{
+		image[i] = 20 * log10f((image[i] > FLT_MIN) ? image[i] : FLT_MIN);
+	}
+}
+
+
+class DisplayProducts
+{
+private:
+
+	DisplayConfig config;
+
+	std::unique_ptr<float[]> enface;  // [x, y]
+	std::unique_ptr<float[]> bscan;  // [z, x] or [z, y]
+	std::unique_ptr<float[]> bscan_partials;  // One B-scan sized buffer per worker for projections
+	std::unique_ptr<float[]> magnitude;  // One A-line sized buffer per worker
+
+public:
+
+	int roi_size;  // z
+	int nx;  // A-lines per B-line in the processed frame
+	int ny;  // B-lines in the processed frame
+	int number_of_workers;
+
+	std::unique_ptr<uint8_t[]> bscan_image;  // Quantized products for export
+	std::unique_ptr<uint8_t[]> enface_image;
+	uint32_t bscan_histogram[DISPLAY_HISTOGRAM_BINS];
+	uint32_t enface_histogram[DISPLAY_HISTOGRAM_BINS];
+	float bscan_levels[2];  // Levels used to quantize the products
+	float enface_levels[2];
+	int bscan_image_axis;  // DisplayBScanAxis of bscan_image, which may lag a reconfiguration by a frame
+	int64_t frame_number;  // Number of the frame the products were reduced from
+
+	DisplayProducts(int roi_size, int nx, int ny, int number_of_workers)
+	{
+		this->roi_size = roi_size;
+		this->nx = nx;
+		this->ny = ny;
+		this->number_of_workers = number_of_workers;
+
+		int64_t bscan_size = (int64_t)roi_size * ((nx > ny) ? nx : ny);  // Large enough for either axis
+		enface = std::make_unique<float[]>((int64_t)nx * ny);
+		bscan = std::make_unique<float[]>(bscan_size);
+		bscan_partials = std::make_unique<float[]>(bscan_size * number_of_workers);
+		magnitude = std::make_unique<float[]>((int64_t)roi_size * number_of_workers);
+		enface_image = std::make_unique<uint8_t[]>((int64_t)nx * ny);
+		bscan_image = std::make_unique<uint8_t[]>(bscan_size);
+
+		memset(enface_image.get(), 0, (int64_t)nx * ny * sizeof(uint8_t));
+		memset(bscan_image.get(), 0, bscan_size * sizeof(uint8_t));
+		memset(bscan_histogram, 0, sizeof(bscan_histogram));
+		memset(enface_histogram, 0, sizeof(enface_histogram));
+
+		config = default_display_config();
+		bscan_image_axis = config.bscan_axis;
+		frame_number = -1;
+	}
+
+	void configure(DisplayConfig config)
+	{
+		// Slices beyond the edge of the frame are clamped to it
+		int bscan_max_index = ((config.bscan_axis == DISPLAY_BSCAN_X) ? ny : nx) - 1;
+		config.bscan_index = (config.bscan_index < 0) ? 0 : config.bscan_index;
+		config.bscan_index = (config.bscan_index > bscan_max_index) ? bscan_max_index : config.bscan_index;
+		config.enface_index = (config.enface_index < 0) ? 0 : config.enface_index;
+		config.enface_index = (config.enface_index > roi_size - 1) ? roi_size - 1 : config.enface_index;
+		this->config = config;
+	}
+
+	// Number of voxels in the B-scan product for the current configuration
+	int64_t bscan_size()
+	{
+		return (int64_t)roi_size * ((config.bscan_axis == DISPLAY_BSCAN_X) ? nx : ny);
+	}
+
+	// Number of voxels in the latest quantized B-scan
+	int64_t bscan_image_size()
+	{
+		return (int64_t)roi_size * ((bscan_image_axis == DISPLAY_BSCAN_X) ? nx : ny);
+	}
+
+	int64_t enface_size()
+	{
+		return (int64_t)nx * ny;
+	}
+
+	// Called before the frame's A-lines are accumulated
+	void begin_frame()
+	{
+		if (config.bscan_projection != DISPLAY_SLICE)
+		{
+			// Magnitudes are non-negative so 0 is the identity for both max and sum
+			memset(bscan_partials.get(), 0, bscan_size() * number_of_workers * sizeof(float));
+		}
+	}
+
+	// Reduce A-lines [first_aline, first_aline + n_alines) of a processed frame. Workers must pass distinct worker indices.
+	void accumulate(const fftwf_complex* alines, int64_t first_aline, int64_t n_alines, int worker)
+	{
+		float* mag = magnitude.get() + (int64_t)roi_size * worker;
+		float* partial = bscan_partials.get() + bscan_size() * worker;
+		bool bscan_along_x = (config.bscan_axis == DISPLAY_BSCAN_X);
+		for (int64_t i = 0; i < n_alines; i++)
+		{
+			int64_t a = first_aline + i;
+			int x = a % nx;
+			int y = a / nx;
+			int col = bscan_along_x ? x : y;  // Column of the B-scan this A-line contributes to
+			bool in_slice = (bscan_along_x ? y : x) == config.bscan_index;
+			const fftwf_complex* v = alines + i * roi_size;
+
+			// Avoid computing the magnitude of the entire A-line if only slices are needed
+			bool need_aline = (config.enface_projection != DISPLAY_SLICE) || (config.bscan_projection != DISPLAY_SLICE) || in_slice;
+			if (!need_aline)
+			{
+				int z = config.enface_index;
+				enface[a] = sqrtf(v[z][0] * v[z][0] + v[z][1] * v[z][1]);
+				continue;
+			}
+			for (int z = 0; z < roi_size; z++)
+			{
+				mag[z] = sqrtf(v[z][0] * v[z][0] + v[z][1] * v[z][1]);
+			}
+
+			// En face
+			if (config.enface_projection == DISPLAY_SLICE)
+			{
+				enface[a] = mag[config.enface_index];
+			}
+			else if (config.enface_projection == DISPLAY_MAX)
+			{
+				float m = 0.0;
+				for (int z = 0; z < roi_size; z++)
+				{
+					m = (mag[z] > m) ? mag[z] : m;
+				}
+				enface[a] = m;
+			}
+			else
+			{
+				float s = 0.0;
+				for (int z = 0; z < roi_size; z++)
+				{
+					s += mag[z];
+				}
+				enface[a] = s / roi_size;
+			}
+
+			// B-scan
+			if (config.bscan_projection == DISPLAY_SLICE)
+			{
+				if (in_slice)
+				{
+					memcpy(bscan.get() + (int64_t)col * roi_size, mag, roi_size * sizeof(float));
+				}
+			}
+			else if (config.bscan_projection == DISPLAY_MAX)
+			{
+				float* dst = partial + (int64_t)col * roi_size;
+				for (int z = 0; z < roi_size; z++)
+				{
+					dst[z] = (mag[z] > dst[z]) ? mag[z] : dst[z];
+				}
+			}
+			else
+			{
+				float* dst = partial + (int64_t)col * roi_size;
+				for (int z = 0; z < roi_size; z++)
+				{
+					dst[z] += mag[z];
+				}
+			}
+		}
+	}
+
+	// Combine worker partials, scale and quantize. Called once all A-lines of the frame have been accumulated.
+	void finish(int64_t frame_number)
+	{
+		this->frame_number = frame_number;
+		int64_t n_bscan = bscan_size();
+		int64_t n_enface = enface_size();
+		if (config.bscan_projection != DISPLAY_SLICE)
+		{
+			memcpy(bscan.get(), bscan_partials.get(), n_bscan * sizeof(float));
+			for (int w = 1; w < number_of_workers; w++)
+			{
+				float* partial = bscan_partials.get() + n_bscan * w;
+				for (int64_t i = 0; i < n_bscan; i++)
+				{
+					if (config.bscan_projection == DISPLAY_MAX)
+					{
+						bscan[i] = (partial[i] > bscan[i]) ? partial[i] : bscan[i];
+					}
+					else
+					{
+						bscan[i] += partial[i];
+					}
+				}
+			}
+			if (config.bscan_projection == DISPLAY_MEAN)
+			{
+				float norm = 1.0 / ((config.bscan_axis == DISPLAY_BSCAN_X) ? ny : nx);
+				for (int64_t i = 0; i < n_bscan; i++)
+				{
+					bscan[i] *= norm;
+				}
+			}
+		}
+		if (config.log_scale)
+		{
+			log_scale(bscan.get(), n_bscan);
+			log_scale(enface.get(), n_enface);
+		}
+		if (config.auto_levels)
+		{
+			histogram_levels(bscan.get(), n_bscan, config.percentile_low, config.percentile_high, bscan_histogram, bscan_levels);
+			histogram_levels(enface.get(), n_enface, config.percentile_low, config.percentile_high, enface_histogram, enface_levels);
+		}
+		else
+		{
+			float unused[2];
+			histogram_levels(bscan.get(), n_bscan, 0.0, 100.0, bscan_histogram, unused);
+			histogram_levels(enface.get(), n_enface, 0.0, 100.0, enface_histogram, unused);
+			memcpy(bscan_levels, config.bscan_levels, 2 * sizeof(float));
+			memcpy(enface_levels, config.enface_levels, 2 * sizeof(float));
+		}
+		quantize(bscan.get(), n_bscan, bscan_levels, bscan_image.get());
+		bscan_image_axis = config.bscan_axis;
+		quantize(enface.get(), n_enface, enface_levels, enface_image.get());
+	}
+
+};
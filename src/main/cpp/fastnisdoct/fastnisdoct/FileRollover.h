@@ -0,0 +1,165 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <Windows.h>
+#include "AsyncLogger.h"
+#include "TraceRecorder.h"
+#include "Writer.h"
+
+/*
+Helper thread of a FileStreamWorker which opens the next part file of a recording ahead of time and closes the part
+which has been filled behind it, so that the writer thread is not held up by the file system when the recording
+rolls over from one part file to the next.
+
+The next part is opened and preallocated to the size of a part while the current part is being written, so at the
+boundary the writer thread only swaps one writer for the other. The filled part is then flushed, finalized and
+closed here while the writer thread goes on with the next. A writer must have no frames pending() when it is handed
+over to be closed, as the frames it reads from are returned to the ring by the writer thread.
+
+A part opened ahead which is not needed, i.e. because the recording was stopped, is closed and deleted by stop().
+*/
+
+
+class FileRollover
+{
+private:
+
+	std::thread thread;
+	std::mutex lock;
+	std::condition_variable wake;  // Of both the helper and a writer thread waiting for the part opened ahead
+	bool running;
+
+	std::deque<std::unique_ptr<Writer>> to_close;
+	std::unique_ptr<Writer> to_open;
+	bool opening;  // A writer is being opened outside of the lock
+	std::unique_ptr<Writer> opened;
+	char name[MAX_PATH];  // Of the part opened ahead
+	int64_t preallocate_bytes;
+
+	void _work()
+	{
+		TRACE_THREAD_NAME("rollover");
+		std::unique_lock<std::mutex> guard(lock);
+		while (true)
+		{
+			wake.wait(guard, [this] { return !running || !to_close.empty() || to_open != NULL; });
+			if (!to_close.empty())  // The filled part first, as the part opened ahead is not needed until the next is filled
+			{
+				std::unique_ptr<Writer> writer = std::move(to_close.front());
+				to_close.pop_front();
+				guard.unlock();
+				ULONGLONG t0 = GetTickCount64();
+				{
+					TRACE_SCOPE("rollover close");
+					writer->close();
+					writer.reset();
+				}
+				async_printf("fastnisdoct/FileRollover: Closed a part in %llu ms\n", GetTickCount64() - t0);
+				guard.lock();
+			}
+			else if (to_open != NULL)
+			{
+				std::unique_ptr<Writer> writer = std::move(to_open);
+				opening = true;
+				guard.unlock();
+				ULONGLONG t0 = GetTickCount64();
+				{
+					TRACE_SCOPE("rollover open");
+					writer->open(name);
+					if (writer->is_open())
+					{
+						writer->preallocate(preallocate_bytes);
+					}
+				}
+				async_printf("fastnisdoct/FileRollover: Opened %s in %llu ms\n", name, GetTickCount64() - t0);
+				guard.lock();
+				opened = std::move(writer);
+				opening = false;
+				wake.notify_all();
+			}
+			else  // Stopped with nothing left to do
+			{
+				break;
+			}
+		}
+	}
+
+public:
+
+	FileRollover()
+	{
+		running = false;
+		opening = false;
+		preallocate_bytes = 0;
+		name[0] = '\0';
+	}
+
+	~FileRollover()
+	{
+		stop();
+	}
+
+	void start()
+	{
+		running = true;
+		thread = std::thread(&FileRollover::_work, this);
+	}
+
+	// Open writer to fname in the background and preallocate bytes of disk to it. Replaces a part opened ahead which has
+	// not been taken
+	void open_ahead(std::unique_ptr<Writer> writer, const char* fname, int64_t bytes)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		wake.wait(guard, [this] { return !opening; });
+		opened.reset();
+		strcpy_s(name, MAX_PATH, fname);
+		preallocate_bytes = bytes;
+		to_open = std::move(writer);
+		wake.notify_all();
+	}
+
+	// The writer opened by open_ahead(), waiting for it if it is still being opened. NULL if none was asked for
+	std::unique_ptr<Writer> take_opened()
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		wake.wait(guard, [this] { return to_open == NULL && !opening; });
+		return std::move(opened);
+	}
+
+	// Close writer in the background. It must have no frames pending()
+	void close_behind(std::unique_ptr<Writer> writer)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		to_close.push_back(std::move(writer));
+		wake.notify_all();
+	}
+
+	// Wait for the parts being closed, then close and delete a part opened ahead which was not taken
+	void stop()
+	{
+		if (!thread.joinable())
+		{
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			running = false;
+			wake.notify_all();
+		}
+		thread.join();  // Once the parts to close and to open are done
+		if (opened != NULL)
+		{
+			opened->close();
+			opened.reset();
+			DeleteFileA(name);
+			async_printf("fastnisdoct/FileRollover: Deleted %s, which was not needed\n", name);
+		}
+	}
+
+};
@@ -9,107 +9,20 @@
 #include <complex>
 #include <chrono>
 #include "spscqueue.h"
+#include "AsyncLogger.h"
 #include "CircAcqBuffer.h"
+#include "SpillTier.h"
+#include "PipelineStats.h"
+#include "Writer.h"
+#include "StripedWriter.h"
+#include "NpyWriter.h"
+#include "MatWriter.h"
+#include "TiffWriter.h"
+#include "CompressedWriter.h"
+#include "FrameIndex.h"
+#include "FileRollover.h"
 #include <Windows.h>
-#include <fstream>
-#include <cerrno>
-
-#define BYTES_PER_GB 1073741824
-#define WRITE_CHUNK_SIZE 1048576
-#define MAX_PATH 512
-
-
-enum FileStreamType
-{
-	FSTREAM_TYPE_TIF = 1,
-	FSTREAM_TYPE_NPY = 2,
-	FSTREAM_TYPE_MAT = 3,
-	FSTREAM_TYPE_RAW = 4
-};
-
-DEFINE_ENUM_FLAG_OPERATORS(FileStreamType);
-
-
-class Writer
-{
-public:
-	Writer() {}
-	Writer(const Writer&) = default;
-	virtual bool is_open() { return false; }
-	virtual void open(const char* name) {}
-	virtual void writeFrame(void* f, long frame_size) {}
-	virtual void close() {}
-};
-
-
-class RawWriter : public Writer
-{
-private:
-	std::ofstream fout;
-
-public:
-
-	long long total_bytes_written;
-
-	void open(const char* name) override
-	{
-		fout.open(name, std::ios::out | std::ios::binary);
-		if (!fout) {
-			std::cout << "Failed to open file: " << strerror(errno) << '\n';
-		}
-		total_bytes_written = 0;
-	}
-
-	bool is_open() override
-	{
-		return fout.is_open();
-	}
-
-	void writeFrame(void* f, long frame_size) override
-	{
-		LARGE_INTEGER frequency;
-		LARGE_INTEGER start;
-		LARGE_INTEGER end;
-		double interval;
-
-		QueryPerformanceFrequency(&frequency);
-		QueryPerformanceCounter(&start);  // Time the frame processing to make sure we should be able to keep up
-
-		long to_be_written = frame_size;
-		long written = 0;
-		while (to_be_written > 0)
-		{
-			long n;
-			if (to_be_written >= (long)WRITE_CHUNK_SIZE)
-			{
-				n = (long)WRITE_CHUNK_SIZE;
-			}
-			else
-			{
-				n = to_be_written;
-			}
-			fout.write((char*)f + written, n);
-			written += n;
-			to_be_written -= n;
-		}
-		if (!fout) {
-			std::cout << "Failed to write to file: " << strerror(errno) << '\n';
-		}
-
-		QueryPerformanceCounter(&end);
-		interval = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
-
-		printf("fastnisdoct/FileStreamWorker: Wrote %li bytes to disk elapsed %f, %f GB/s, \n", frame_size, interval, ((double)frame_size / (double)BYTES_PER_GB) / (double)interval);
-		total_bytes_written += written;  // Increment file object's counter
-	}
-
-	void close() override
-	{
-		fout.flush();
-		fout.close();
-	}
-
-};
+#include <deque>
 
 
 // Asynchronously stream frames from a CircAcqBuffer to disk
@@ -122,7 +35,7 @@ class FileStreamWorker
 		std::atomic_bool _running = ATOMIC_VAR_INIT(false);
 		std::atomic_bool _finished = ATOMIC_VAR_INIT(true);
 		CircAcqBuffer<T>* _buffer;
-		int _init_buffer_index;
+		int64_t _init_buffer_index;
 
 		char _file_name[512];
 		int _max_frames_per_file;
@@ -135,25 +48,136 @@ class FileStreamWorker
 		int _n_to_stream;
 		long _frame_size_bytes;
 
+		PipelineStats* _timing = NULL;
+		CodecStats _codec_stats;  // Bytes in and out of the compressed writer
+
+		char _spill_path[MAX_PATH];
+		int _spill_frames = 0;  // Frames of spill to map when streaming begins, 0 to stream from the ring alone
+		std::unique_ptr<SpillTier<T>> _spill;
+		std::atomic<int64_t> _last_frame;  // Count of the last frame to write once the stream is finishing
+		std::atomic<int64_t> _next_frame;  // Count of the next frame the writer will borrow
+
+		std::vector<std::string> _stripe_directories;  // Stripe frames across files in these directories if there are more than one
+		int64_t _frame_shape[3] = { 0, 0, 0 };  // [z, x, y] of each frame, for writers of formats which describe it
+		int _mat_deflate_level = 0;
+		bool _packed12 = false;  // Frames are 12-bit packed spectra, which are written raw
+		int _tiff_bits = 32;  // Bits per sample of TIFF pages
+		float _tiff_db_range[2] = { 0.0f, 100.0f };  // dB spanned by integer TIFF pages of complex frames
+		std::vector<std::pair<std::string, double>> _parameters;  // Stored in formats which have attributes
+
+		inline int64_t _borrow(int64_t n, CircAcqBorrow<T>* borrowed, int timeout_ms)
+		{
+			return (_spill != NULL) ? _spill->borrow(n, borrowed, timeout_ms) : _buffer->borrow(n, borrowed, timeout_ms);
+		}
+
+		inline void _release(CircAcqBorrow<T>* borrowed)
+		{
+			if (_spill != NULL)
+			{
+				_spill->release(borrowed);
+			}
+			else
+			{
+				_buffer->release(borrowed);
+			}
+		}
+
+		// A new writer of _file_type for a part of the stream. Sets suffix to the suffix of its files
+		Writer* _make_writer(const char** suffix)
+		{
+			if (_file_type == FSTREAM_TYPE_FNZ)
+			{
+				Writer* compressed = make_compressed_writer((T*)NULL, _frame_size_bytes / sizeof(T), _frame_shape[0], &_codec_stats);  // NULL unless T is raw spectra
+				if (compressed != NULL)
+				{
+					*suffix = ".fnz";
+					return compressed;
+				}
+			}
+			if (_file_type == FSTREAM_TYPE_NPY)
+			{
+				*suffix = ".npy";
+				return new NpyWriter(npy_descr((T*)NULL), _frame_shape[0], _frame_shape[1], _frame_shape[2]);
+			}
+			if (_file_type == FSTREAM_TYPE_TIF)
+			{
+				*suffix = ".tif";
+				return new TiffWriter<T>(_frame_shape[0], _frame_shape[1], _frame_shape[2], _tiff_bits, _tiff_db_range[0], _tiff_db_range[1]);
+			}
+#ifdef FASTNISDOCT_HDF5
+			if (_file_type == FSTREAM_TYPE_MAT)
+			{
+				*suffix = ".mat";
+				return new MatWriter((T*)NULL, _frame_shape[0], _frame_shape[1], _frame_shape[2], _mat_deflate_level, _parameters);
+			}
+#endif
+			*suffix = _packed12 ? ".b12" : ".bin";
+			if (_stripe_directories.size() > 1)
+			{
+				return new StripedWriter(_stripe_directories);
+			}
+			return new UnbufferedWriter();
+		}
+
+		// Name of the part file of the stream: the file name for the first, with _000n for the n-th
+		void _part_name(char* fname, int part, const char* suffix)
+		{
+			if (part == 0)
+			{
+				sprintf_s(fname, MAX_PATH, "%s%s", _file_name, suffix);
+			}
+			else
+			{
+				sprintf_s(fname, MAX_PATH, "%s_%04d%s", _file_name, part, suffix);
+			}
+		}
+
 		void _fstream()
 		{
+			TRACE_THREAD_NAME("writer");
 			int max_frames_per_file = (long long)((float)_file_max_gb * (float)BYTES_PER_GB) / _frame_size_bytes;
 			if (max_frames_per_file < 1)
 			{
 				max_frames_per_file = 1;
 			}
-			int n_got;  // Index of locked out buffer
-			T* frame;  // Pointer to locked out buffer
+			int64_t n_got;  // Count of the borrowed element
+			CircAcqBorrow<T> borrowed;  // Handle to the borrowed element
+
+			int64_t part_bytes = (int64_t)max_frames_per_file * _frame_size_bytes;  // Preallocated to each part
+			const char* suffix;
+			std::unique_ptr<Writer> first(_make_writer(&suffix));
+			uint32_t stripes = (dynamic_cast<StripedWriter*>(first.get()) != NULL) ? (uint32_t)_stripe_directories.size() : 0;
+			char fname[MAX_PATH];
+			_part_name(fname, 0, suffix);
+			FileRollover rollover;  // Opens each part ahead of time and closes it behind
+			rollover.start();
+			rollover.open_ahead(std::move(first), fname, part_bytes);
+			if (_file_type == FSTREAM_TYPE_MAT && strcmp(suffix, ".mat") != 0)
+			{
+				async_printf("fastnisdoct: Built without FASTNISDOCT_HDF5. Writing raw frames instead of .mat\n");
+			}
+			else if (_file_type == FSTREAM_TYPE_FNZ && strcmp(suffix, ".fnz") != 0)
+			{
+				async_printf("fastnisdoct: Only raw spectra can be compressed. Writing raw frames instead of .fnz%s\n", (stripes > 0) ? ", striped across the stripe directories" : "");
+			}
+			else if (_file_type == FSTREAM_TYPE_FNZ && _stripe_directories.size() > 1)
+			{
+				async_printf("fastnisdoct: Compressed recordings are not striped. Writing .fnz to %s only\n", _file_name);
+			}
+			std::unique_ptr<Writer> writer;  // Of the current part, NULL between parts
+			std::deque<CircAcqBorrow<T>> in_flight;  // Frames the writer is still reading from, oldest first
 
-			// TODO various types
-			std::unique_ptr<Writer> writer = std::make_unique<RawWriter>();
-			const char* suffix = ".bin";
+			FrameIndex index;  // Of every frame written, across all parts
+			char index_name[MAX_PATH];
+			sprintf_s(index_name, "%s.idx", _file_name);
+			uint32_t index_flags = (_packed12 ? FRAME_INDEX_FLAG_PACKED12 : 0) | ((stripes > 0) ? FRAME_INDEX_FLAG_STRIPED : 0);
+			index.open(index_name, _frame_size_bytes, _file_type, index_flags, _frame_shape, stripes);
 
 			int frames_in_current_file = 0;
 			int file_name_inc = 0;
 			int n_streamed = 0;
 
-			int latest_frame_n;
+			int64_t latest_frame_n;
 			// Get ahead of buffer to let galvos settle
 			if (_init_buffer_index == -1)
 			{
@@ -163,13 +187,18 @@ class FileStreamWorker
 			{
 				latest_frame_n = _init_buffer_index;
 			}
-			printf("Attempting to write frames %i through %i to disk.\n", latest_frame_n, _n_to_stream);
+			async_printf("Attempting to write frames %lli through %i to disk.\n", latest_frame_n, _n_to_stream);
+			if (_spill != NULL)
+			{
+				_spill->start(latest_frame_n);
+			}
 
 			// Stream continuously to various files or until _n_to_stream is reached
-			while ( _running.load() && ( (_n_to_stream > n_streamed) || (_n_to_stream == -1) ) )
+			while ( _running.load() && ( (_n_to_stream > n_streamed) || (_n_to_stream == -1) ) && latest_frame_n <= _last_frame.load() )
 			{
-				// printf("FSTREAM RUNNING %i\n", _running.load());
-				n_got = _buffer->lock_out(latest_frame_n, &frame, 1000);
+				_next_frame.store(latest_frame_n);
+				// async_printf("FSTREAM RUNNING %i\n", _running.load());
+				n_got = _borrow(latest_frame_n, &borrowed, 1000);
 				if (n_got == -1)
 				{
 					Sleep(IDLE_SLEEP_MS);
@@ -179,61 +208,78 @@ class FileStreamWorker
 				{
 					latest_frame_n += 1;
 
-					if (!writer->is_open())
+					if (writer == NULL)
 					{
-						// Open file
-						char fname[MAX_PATH];
-						if (file_name_inc == 0)
+						// Take the part opened ahead and open the one after it if the stream may need it
+						writer = rollover.take_opened();
+						if (writer == NULL)  // Not opened ahead
 						{
-							sprintf_s(fname, "%s%s", _file_name, suffix);
+							writer.reset(_make_writer(&suffix));
+							_part_name(fname, file_name_inc, suffix);
+							writer->open(fname);
 						}
-						else
+						frames_in_current_file = 0;
+						if (_n_to_stream == -1 || _n_to_stream > (int64_t)(file_name_inc + 1) * max_frames_per_file)
 						{
-							sprintf_s(fname, "%s_%04d%s", _file_name, file_name_inc, suffix);
+							_part_name(fname, file_name_inc + 1, suffix);
+							rollover.open_ahead(std::unique_ptr<Writer>(_make_writer(&suffix)), fname, part_bytes);
 						}
-						writer->open(fname);
-						frames_in_current_file = 0;
 					}
-					else  // If file is open
+
+					// Append to file
+					index.append(n_got, file_name_inc, writer->next_offset());
+					int64_t t0 = PipelineStats::now();
+					writer->writeFrame(borrowed.arr, _frame_size_bytes);
+					if (_timing != NULL)
 					{
-						if ((_n_to_stream == -1) || (frames_in_current_file < _n_to_stream))  // Indefinite stream
-						{
-							// Append to file
-							writer->writeFrame(frame, _frame_size_bytes);
-							frames_in_current_file += 1;
-							n_streamed += 1;
-						}
-						else
-						{
-							// Close file, stop streaming
-							printf("fastnisdoct/FileStreamWorker: Closing file %s_%i%s after saving %i frames\n", _file_name, file_name_inc, suffix, frames_in_current_file);
-							writer->close();
-						}
-						if (frames_in_current_file == max_frames_per_file)  // If this file cannot get larger, need to start a new one
-						{
-							file_name_inc += 1;
-							if (writer->is_open())
-							{
-								printf("fastnisdoct/FileStreamWorker: Closing file %s_%i%s after saving %i frames\n", _file_name, file_name_inc, suffix, frames_in_current_file);
-								writer->close();
-							}
-						}
+						_timing->record(PIPELINE_DISK_WRITE, t0, n_got);
+					}
+					frames_in_current_file += 1;
+					n_streamed += 1;
+					in_flight.push_back(borrowed);
 
+					if (frames_in_current_file == max_frames_per_file)  // If this file cannot get larger, need to start a new one
+					{
+						async_printf("fastnisdoct/FileStreamWorker: Rolling over from file %s_%i%s after saving %i frames\n", _file_name, file_name_inc, suffix, frames_in_current_file);
+						// The part is closed in the background once the frames it reads from are written and returned here.
+						// This waits for no more than the writes already in flight
+						writer->wait_pending(0);
+						rollover.close_behind(std::move(writer));
+						file_name_inc += 1;
+					}
+
+					// Return the frames which have been written
+					while (in_flight.size() > (size_t)((writer != NULL) ? writer->pending() : 0))
+					{
+						_release(&in_flight.front());
+						in_flight.pop_front();
 					}
 				}
 				else  // Dropped frame, since we have fallen behind, get the latest next time
 				{
-					printf("fastnisdoct/FileStreamWorker: Writer can't keep up with acquisition rate! Dropped frame %i, got %i instead\n", latest_frame_n, n_got);
-					latest_frame_n = _buffer->get_count() + 1;
+					async_printf_every(LOG_PERIOD_MS, "fastnisdoct/FileStreamWorker: Writer can't keep up with acquisition rate! Dropped frame %lli, got %lli instead\n", latest_frame_n, n_got);
+					latest_frame_n = (_spill != NULL) ? n_got : _buffer->get_count() + 1;  // The frames after n_got may have been spilled
+					_release(&borrowed);
 				}
-				_buffer->release();
 			}
-			if (writer->is_open())  // The stream has been stopped
+			if (writer != NULL)  // The stream has been stopped
 			{
 				// Close file
-				printf("fastnisdoct/FileStreamWorker: Stream ended. Closing file %s after saving %i frames\n", _file_name, frames_in_current_file);
+				async_printf("fastnisdoct/FileStreamWorker: Stream ended. Closing file %s after saving %i frames\n", _file_name, frames_in_current_file);
 				writer->close();
 			}
+			while (!in_flight.empty())
+			{
+				_release(&in_flight.front());
+				in_flight.pop_front();
+			}
+			if (_spill != NULL)
+			{
+				_spill->stop();
+				async_printf("fastnisdoct/FileStreamWorker: %lli frames were spilled to disk, %lli were lost.\n", _spill->get_spilled(), _spill->get_lost());
+			}
+			index.close();
+			rollover.stop();  // Once the parts behind are closed
 			_finished = true;
 		}
 
@@ -243,7 +289,7 @@ class FileStreamWorker
 			float max_gb,
 			FileStreamType ftype,
 			CircAcqBuffer<T>* buffer,
-			int buffer_head,
+			int64_t buffer_head,
 			long frame_size,
 			int n_to_stream
 		)
@@ -261,17 +307,117 @@ class FileStreamWorker
 			memcpy(_file_name, fname, strlen(fname) * sizeof(char) + 1);  // Copy string to module-managed buffer
 			_file_max_gb = max_gb;
 			_file_type = ftype;
+			if (_packed12 && _file_type != FSTREAM_TYPE_RAW)
+			{
+				async_printf("fastnisdoct: Packed spectra can only be written raw. Writing .b12 files\n");
+				_file_type = FSTREAM_TYPE_RAW;
+			}
 			_buffer = buffer;
 			_init_buffer_index = buffer_head;
 			_frame_size_bytes = frame_size * sizeof(T);
 			_n_to_stream = n_to_stream;
-			printf("fastnisdoct: Starting FileStreamWorker: writing %i frames to %s, < %f GB/file\n", _n_to_stream, _file_name, _file_max_gb);
+			_codec_stats.reset();
+			_last_frame.store(INT64_MAX);
+			_next_frame.store(buffer_head);
+			_spill.reset();  // Kept after the previous stream ended in case it was being finished
+			if (_spill_frames > 0)
+			{
+				_spill = std::make_unique<SpillTier<T>>(_spill_path, _spill_frames, buffer, frame_size);
+				if (!_spill->is_open())
+				{
+					_spill.reset();
+				}
+			}
+			async_printf("fastnisdoct: Starting FileStreamWorker: writing %i frames to %s, < %f GB/file\n", _n_to_stream, _file_name, _file_max_gb);
 			_thread = std::thread(&FileStreamWorker::_fstream, this);  // Start the thread
 			return 0;
 		}
 
 	public:
 
+		// Time each frame written into the PIPELINE_DISK_WRITE stage of timing
+		void set_pipeline_stats(PipelineStats* timing)
+		{
+			_timing = timing;
+		}
+
+		// Spill up to n_frames frames to a file created at path when the writer falls behind. 0 to disable. Takes effect when streaming next begins
+		void set_spill(const char* path, int n_frames)
+		{
+			strcpy_s(_spill_path, MAX_PATH, path);
+			_spill_frames = n_frames;
+		}
+
+		// Frames are spectra packed to 12 bits, which are written raw with the suffix .b12. Takes effect when streaming next begins
+		void set_packed12(bool packed)
+		{
+			_packed12 = packed;
+		}
+
+		// Raw bytes per byte written by the compressed writer since streaming last began. 0 if nothing has been compressed
+		double get_compression_ratio()
+		{
+			return _codec_stats.ratio();
+		}
+
+		// Shape [z, x, y] of the frames in FORTRAN order, for formats which describe it
+		void set_frame_shape(int64_t z, int64_t x, int64_t y)
+		{
+			_frame_shape[0] = z;
+			_frame_shape[1] = x;
+			_frame_shape[2] = y;
+		}
+
+		// Deflate level 1-9 of the frames of .mat files, 0 to write them uncompressed. Takes effect when streaming next begins
+		void set_mat_compression(int deflate_level)
+		{
+			_mat_deflate_level = (deflate_level < 0) ? 0 : ((deflate_level > 9) ? 9 : deflate_level);
+		}
+
+		// Write TIFF pages of 8 or 16 bit unsigned integers or 32 bit floats. Complex frames are written in dB, scaled from
+		// db_min to db_max if written as integers. Takes effect when streaming next begins
+		void set_tiff_format(int bits_per_sample, float db_min, float db_max)
+		{
+			_tiff_bits = bits_per_sample;
+			_tiff_db_range[0] = db_min;
+			_tiff_db_range[1] = db_max;
+		}
+
+		// Named acquisition parameters stored alongside the frames by formats which support it, such as .mat
+		void set_parameters(const std::vector<std::pair<std::string, double>>& parameters)
+		{
+			_parameters = parameters;
+		}
+
+		// Stripe frames round-robin across files in each of directories, separated by semicolons. Fewer than two directories
+		// disables striping. Takes effect when streaming next begins
+		void set_stripes(const char* directories)
+		{
+			_stripe_directories.clear();
+			const char* p = directories;
+			while (*p != '\0')
+			{
+				const char* end = strchr(p, ';');
+				size_t n = (end != NULL) ? end - p : strlen(p);
+				if (n > 0)
+				{
+					_stripe_directories.emplace_back(p, n);
+				}
+				p += n;
+				if (*p == ';')
+				{
+					p++;
+				}
+			}
+		}
+
+		// Count of the next frame to be written. A producer which must not drop frames keeps no more than the size of the
+		// ring ahead of it
+		int64_t next_frame()
+		{
+			return _next_frame.load();
+		}
+
 		bool is_streaming()
 		{
 			return _running.load() && !_finished.load();
@@ -308,7 +454,7 @@ class FileStreamWorker
 			float max_gb,
 			FileStreamType ftype,
 			CircAcqBuffer<T>* buffer,
-			int buf_head,
+			int64_t buf_head,
 			long frame_size,
 			int n_to_stream
 		)
@@ -316,6 +462,21 @@ class FileStreamWorker
 			return _start(fname, max_gb, ftype, buffer, buf_head, frame_size, n_to_stream);
 		}
 
+		// Stop after writing the frames which have been buffered so far, including any which have been spilled. Returns
+		// at once. Without a spill, the frames still in the ring are not worth waiting for and the stream stops now.
+		void finish()
+		{
+			if (_spill == NULL || !is_streaming())
+			{
+				stop();
+				return;
+			}
+			int64_t last = _buffer->get_count();
+			_spill->set_last(last);
+			_last_frame.store(last);
+			async_printf("fastnisdoct/FileStreamWorker: Draining frames through %lli\n", last);
+		}
+
 		void stop()
 		{
 			if (_running.load())
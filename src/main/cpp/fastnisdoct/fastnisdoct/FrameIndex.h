@@ -0,0 +1,155 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <Windows.h>
+#include "AsyncLogger.h"
+#include "Writer.h"
+
+/*
+Binary index of the frames of a recording, written alongside its part files with the suffix .idx, so that a reader
+can find frame k of the recording in O(1) and account for frames which were dropped.
+
+The file begins with a FRAME_INDEX_HEADER_SIZE byte header: the magic "FNSDIDX1", the uint32 version and record
+size, the uint64 size of each frame in bytes as it was acquired, the uint32 FileStreamType and flags, the int64
+frame shape [z, x, y], then the uint32 number of stripes, 0 unless frames are striped by a StripedWriter, in which case
+the offset of a frame is in the file of stripe j % stripes of its part, where j is the frame's place in the part.
+A FrameIndexRecord follows for each frame written, in order, so the number of frames written
+is (file size - FRAME_INDEX_HEADER_SIZE) / FRAME_INDEX_RECORD_SIZE.
+
+Records are buffered and written every FRAME_INDEX_FLUSH_FRAMES frames or FRAME_INDEX_FLUSH_MS, whichever is first,
+so that the index of an aborted acquisition is complete up to the last flush.
+*/
+
+#define FRAME_INDEX_HEADER_SIZE 64
+#define FRAME_INDEX_RECORD_SIZE 32
+#define FRAME_INDEX_VERSION 1
+#define FRAME_INDEX_FLUSH_FRAMES 64
+#define FRAME_INDEX_FLUSH_MS 500
+
+#define FRAME_INDEX_FLAG_PACKED12 0x1  // Frames are 12-bit packed spectra
+#define FRAME_INDEX_FLAG_STRIPED 0x2  // Frames are striped across the files listed in each part's .stripes
+
+
+struct FrameIndexRecord
+{
+	int64_t count;  // Acquisition count of the frame in the export ring
+	int64_t timestamp;  // When the frame was handed to the writer, in 100 ns intervals since 1601 (FILETIME)
+	int64_t offset;  // Byte offset of the frame in its part file, -1 if the format does not store frames whole
+	int32_t part;  // Part file: 0 for the first, n for the file with the suffix _000n
+	uint32_t dropped_before;  // Frames dropped between the previous frame written and this one
+};
+
+static_assert(sizeof(FrameIndexRecord) == FRAME_INDEX_RECORD_SIZE, "FrameIndexRecord must be packed");
+
+
+class FrameIndex
+{
+private:
+
+	HANDLE file;
+	char name[MAX_PATH];
+	std::vector<FrameIndexRecord> buffered;
+	ULONGLONG last_flush;
+	int64_t previous;  // Count of the last frame recorded, -1 if none
+
+	void flush()
+	{
+		if (!buffered.empty())
+		{
+			DWORD n = (DWORD)(buffered.size() * sizeof(FrameIndexRecord));
+			DWORD written = 0;
+			if (!WriteFile(file, buffered.data(), n, &written, NULL) || written != n)
+			{
+				async_printf_every(LOG_PERIOD_MS, "fastnisdoct/FrameIndex: Failed to write to %s: error %lu\n", name, GetLastError());
+			}
+			buffered.clear();
+		}
+		last_flush = GetTickCount64();
+	}
+
+public:
+
+	FrameIndex()
+	{
+		file = INVALID_HANDLE_VALUE;
+		previous = -1;
+		buffered.reserve(FRAME_INDEX_FLUSH_FRAMES);
+	}
+
+	~FrameIndex()
+	{
+		close();
+	}
+
+	// Create the index of a recording of frames of frame_bytes bytes and shape [z, x, y], striped across stripes files
+	void open(const char* fname, uint64_t frame_bytes, FileStreamType type, uint32_t flags, const int64_t* shape, uint32_t stripes = 0)
+	{
+		strcpy_s(name, MAX_PATH, fname);
+		file = CreateFileA(fname, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			async_printf("fastnisdoct/FrameIndex: Failed to create %s: error %lu\n", fname, GetLastError());
+			return;
+		}
+		char header[FRAME_INDEX_HEADER_SIZE];
+		memset(header, 0, FRAME_INDEX_HEADER_SIZE);
+		uint32_t version = FRAME_INDEX_VERSION;
+		uint32_t record_size = FRAME_INDEX_RECORD_SIZE;
+		uint32_t file_type = type;
+		memcpy(header, "FNSDIDX1", 8);
+		memcpy(header + 8, &version, 4);
+		memcpy(header + 12, &record_size, 4);
+		memcpy(header + 16, &frame_bytes, 8);
+		memcpy(header + 24, &file_type, 4);
+		memcpy(header + 28, &flags, 4);
+		memcpy(header + 32, shape, 3 * sizeof(int64_t));
+		memcpy(header + 56, &stripes, 4);
+		DWORD written = 0;
+		WriteFile(file, header, FRAME_INDEX_HEADER_SIZE, &written, NULL);
+		previous = -1;
+		last_flush = GetTickCount64();
+	}
+
+	bool is_open()
+	{
+		return file != INVALID_HANDLE_VALUE;
+	}
+
+	// Record the frame of acquisition count which is about to be written to part at offset
+	void append(int64_t count, int32_t part, int64_t offset)
+	{
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			return;
+		}
+		FrameIndexRecord r;
+		FILETIME t;
+		GetSystemTimePreciseAsFileTime(&t);
+		r.count = count;
+		r.timestamp = ((int64_t)t.dwHighDateTime << 32) | t.dwLowDateTime;
+		r.offset = offset;
+		r.part = part;
+		int64_t dropped = (previous > -1 && count > previous + 1) ? count - previous - 1 : 0;
+		r.dropped_before = (dropped > UINT32_MAX) ? UINT32_MAX : (uint32_t)dropped;
+		buffered.push_back(r);
+		previous = count;
+		if (buffered.size() >= FRAME_INDEX_FLUSH_FRAMES || GetTickCount64() - last_flush >= FRAME_INDEX_FLUSH_MS)
+		{
+			flush();
+		}
+	}
+
+	void close()
+	{
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			return;
+		}
+		flush();
+		CloseHandle(file);
+		file = INVALID_HANDLE_VALUE;
+	}
+
+};
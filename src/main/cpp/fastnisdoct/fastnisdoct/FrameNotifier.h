@@ -0,0 +1,114 @@
+#pragma once
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <Windows.h>
+
+/*
+Notifies clients that a new frame is ready for display, so that they do not have to poll for it.
+
+Clients can either block in wait(), wait on the Win32 event handle themselves, or register a callback which is
+called with the frame number by the notifying thread. Callbacks run on the acquisition thread and must return
+quickly.
+
+wait() blocks with WaitOnAddress on a count of changes, so any number of threads can wait at once and each is woken
+by every frame and by interrupt(). The auto-reset event is only set for the one external client which waits on the
+handle, so that it and the waiters in wait() do not take each other's wakeups.
+*/
+
+typedef void (*FrameCallback)(int frame_number);
+
+class FrameNotifier
+{
+private:
+
+	HANDLE event;  // Auto-reset event set each time a frame is ready, for the external client only
+	std::atomic<int64_t> latest;  // Number of the latest ready frame
+	std::atomic_int interrupts;  // Incremented to wake waiters without a new frame
+	std::atomic<int64_t> changes;  // Incremented by each frame and interrupt, waited on by wait()
+
+	void wake()
+	{
+		changes.fetch_add(1);
+		WakeByAddressAll((void*)&changes);
+		SetEvent(event);
+	}
+	std::atomic<FrameCallback> callback;
+
+public:
+
+	FrameNotifier()
+	{
+		event = CreateEvent(NULL, FALSE, FALSE, NULL);
+		latest.store(-1);
+		interrupts.store(0);
+		changes.store(0);
+		callback.store(NULL);
+	}
+
+	~FrameNotifier()
+	{
+		CloseHandle(event);
+	}
+
+	void notify(int64_t n)
+	{
+		latest.store(n);
+		wake();
+		FrameCallback cb = callback.load();
+		if (cb != NULL)
+		{
+			cb((int)n);
+		}
+	}
+
+	// Wake all waiters, i.e. because frames will stop arriving
+	void interrupt()
+	{
+		interrupts.fetch_add(1);
+		wake();
+	}
+
+	// Block until a frame newer than last_seen is ready. Returns its number or -1 if timed out or interrupted.
+	int64_t wait(int64_t last_seen, int timeout_ms)
+	{
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+		int interrupts_on_entry = interrupts.load();
+		while (true)
+		{
+			int64_t seen = changes.load();
+			int64_t n = latest.load();
+			if (n > last_seen)
+			{
+				return n;
+			}
+			if (interrupts.load() != interrupts_on_entry)
+			{
+				return -1;
+			}
+			auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+			if (remaining <= 0)
+			{
+				return -1;
+			}
+			WaitOnAddress((volatile void*)&changes, &seen, sizeof(int64_t), (DWORD)remaining);  // Returns at once if changes != seen
+		}
+	}
+
+	void set_callback(FrameCallback cb)
+	{
+		callback.store(cb);
+	}
+
+	HANDLE handle()
+	{
+		return event;
+	}
+
+	// Frame numbers restart when scanning does
+	void reset()
+	{
+		latest.store(-1);
+	}
+
+};
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <cstdint>
+#include <Windows.h>
+#include "AsyncLogger.h"
+
+/*
+Page-locked memory for rings and acquisition buffers, allocated once at configure time so that the first pass
+over a ring does not page fault and a long acquisition does not thrash the TLB.
+
+The arena is backed by large pages (2 MiB on x64) if the process can be granted SeLockMemoryPrivilege, which
+must first be assigned to the user under Local Security Policy > User Rights Assignment > Lock pages in memory.
+Large pages are never paged out and are committed when they are allocated. Otherwise the arena falls back to
+regular pages, which are touched to fault them in and then locked into the working set with VirtualLock.
+
+carve() divides the arena into blocks aligned to ARENA_ALIGNMENT, which is also the sector size required for
+unbuffered file I/O. page_size() reports the page size which was achieved.
+*/
+
+#define ARENA_ALIGNMENT 4096
+
+inline size_t arena_round_up(size_t n, size_t alignment)
+{
+	return ((n + alignment - 1) / alignment) * alignment;
+}
+
+
+class LargePageArena
+{
+private:
+
+	char* base;
+	size_t size;
+	size_t used;
+	size_t page;
+	bool locked;
+	size_t working_set_increase;
+
+	// Attempt to enable SeLockMemoryPrivilege for the process once
+	static bool large_pages_available()
+	{
+		static int available = -1;
+		if (available == -1)
+		{
+			available = 0;
+			HANDLE token;
+			if (GetLargePageMinimum() > 0 && OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+			{
+				TOKEN_PRIVILEGES tp;
+				tp.PrivilegeCount = 1;
+				tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+				if (LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &tp.Privileges[0].Luid))
+				{
+					// AdjustTokenPrivileges succeeds even if the privilege has not been assigned to the user
+					if (AdjustTokenPrivileges(token, FALSE, &tp, 0, NULL, NULL) && GetLastError() == ERROR_SUCCESS)
+					{
+						available = 1;
+					}
+				}
+				CloseHandle(token);
+			}
+			if (!available)
+			{
+				async_printf("fastnisdoct: Large pages are unavailable. Grant 'Lock pages in memory' to the user to enable them.\n");
+			}
+		}
+		return available == 1;
+	}
+
+	void allocate_large()
+	{
+		size_t large = GetLargePageMinimum();
+		size_t n = arena_round_up(size, large);
+		base = (char*)VirtualAlloc(NULL, n, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		if (base != NULL)
+		{
+			size = n;
+			page = large;
+			locked = true;  // Large pages are not pageable
+		}
+	}
+
+	void allocate_regular()
+	{
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		page = info.dwPageSize;
+		size = arena_round_up(size, page);
+		base = (char*)VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		if (base == NULL)
+		{
+			return;
+		}
+		for (size_t i = 0; i < size; i += page)
+		{
+			((volatile char*)base)[i] = 0;  // Fault the page in
+		}
+		// VirtualLock cannot lock more than the minimum working set
+		SIZE_T min_ws, max_ws;
+		if (GetProcessWorkingSetSize(GetCurrentProcess(), &min_ws, &max_ws) && SetProcessWorkingSetSize(GetCurrentProcess(), min_ws + size, max_ws + size))
+		{
+			working_set_increase = size;
+		}
+		locked = VirtualLock(base, size) != 0;
+		if (!locked)
+		{
+			async_printf("fastnisdoct: Failed to lock %llu bytes into memory. It may be paged out.\n", (unsigned long long)size);
+		}
+	}
+
+public:
+
+	LargePageArena(size_t bytes)
+	{
+		base = NULL;
+		size = (bytes > 0) ? bytes : 1;
+		used = 0;
+		page = 0;
+		locked = false;
+		working_set_increase = 0;
+		if (large_pages_available())
+		{
+			allocate_large();
+		}
+		if (base == NULL)
+		{
+			allocate_regular();
+		}
+		if (base == NULL)
+		{
+			async_printf("fastnisdoct: Failed to allocate %llu bytes!\n", (unsigned long long)size);
+		}
+	}
+
+	LargePageArena(const LargePageArena&) = delete;
+	LargePageArena& operator=(const LargePageArena&) = delete;
+
+	// Take the next n bytes of the arena. Returns NULL if the arena is exhausted.
+	void* carve(size_t n)
+	{
+		size_t offset = arena_round_up(used, ARENA_ALIGNMENT);
+		if (base == NULL || offset + n > size)
+		{
+			return NULL;
+		}
+		used = offset + n;
+		return base + offset;
+	}
+
+	size_t page_size()
+	{
+		return page;
+	}
+
+	bool is_locked()
+	{
+		return locked;
+	}
+
+	~LargePageArena()
+	{
+		if (base == NULL)
+		{
+			return;
+		}
+		if (locked && page != GetLargePageMinimum())
+		{
+			VirtualUnlock(base, size);
+		}
+		VirtualFree(base, 0, MEM_RELEASE);
+		if (working_set_increase > 0)
+		{
+			SIZE_T min_ws, max_ws;
+			if (GetProcessWorkingSetSize(GetCurrentProcess(), &min_ws, &max_ws))
+			{
+				SetProcessWorkingSetSize(GetCurrentProcess(), min_ws - working_set_increase, max_ws - working_set_increase);
+			}
+		}
+	}
+
+};
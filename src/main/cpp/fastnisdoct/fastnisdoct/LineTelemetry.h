@@ -0,0 +1,227 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <cmath>
+#include <Windows.h>
+#include "LogHistogram.h"
+
+/*
+In-line analysis of the A-line stamps which the camera writes into the first pixel of each A-line.
+
+The stamps are assumed to be a free running line counter which advances by stamp_increment each line
+and wraps at stamp_modulus. A stamp which advances by a multiple of the increment is a gap, and the lines
+skipped are counted as dropped. A stamp which advances by anything else is counted as a discontinuity
+and the count resynchronizes to it.
+
+Timing is taken with the performance counter when the acquisition thread examines each IMAQ buffer,
+which is the earliest the host sees the stamps. The line period jitter is the deviation of each buffer's
+per-line arrival interval from its running mean. The latency from the first stamp of a frame to the frame
+being processed and to the frame being handed to the client are recorded too. All timings are in ns.
+
+Only the acquisition thread calls analyse_buffer(), frame_acquired() and frame_processed(). Clients may call
+frame_displayed() and read the telemetry from any thread.
+*/
+
+#define LINE_TELEMETRY_COUNTERS 6  // [lines, dropped lines, gaps, discontinuities, frames processed, frames displayed]
+#define LINE_TELEMETRY_HISTOGRAMS 3  // [line period jitter, stamp to processed, stamp to display]
+#define LINE_TELEMETRY_FRAME_SLOTS 16  // Frames which may be in flight between acquisition and display
+#define LINE_TELEMETRY_MEAN_WEIGHT 0.015625  // Weight of each new buffer interval in the running mean
+
+
+class LineTelemetry
+{
+private:
+
+	struct FrameStampTime
+	{
+		std::atomic<int64_t> frame;  // Written after time, so time is valid if frame is read before and after it
+		std::atomic<int64_t> time;
+	};
+
+	FrameStampTime frame_times[LINE_TELEMETRY_FRAME_SLOTS];
+
+	std::atomic<int64_t> lines;
+	std::atomic<int64_t> dropped_lines;
+	std::atomic<int64_t> gaps;
+	std::atomic<int64_t> discontinuities;
+	std::atomic<int64_t> frames_processed;
+	std::atomic<int64_t> frames_displayed;
+	std::atomic<int64_t> last_displayed;  // Frames are counted as displayed once
+
+	std::atomic_int stamp_increment;
+	std::atomic_int stamp_modulus;
+
+	// Acquisition thread only
+	int64_t previous_stamp;  // -1 if there is no previous stamp
+	int64_t previous_buffer_time;  // 0 if there is no previous buffer
+	double mean_buffer_interval;
+
+	double ns_per_tick;
+
+	inline uint64_t ticks_to_ns(int64_t ticks)
+	{
+		return (ticks > 0) ? (uint64_t)(ticks * ns_per_tick) : 0;
+	}
+
+	inline int64_t lookup(int64_t frame)
+	{
+		FrameStampTime* slot = &frame_times[frame % LINE_TELEMETRY_FRAME_SLOTS];
+		if (slot->frame.load() != frame)
+		{
+			return 0;
+		}
+		int64_t t = slot->time.load();
+		return (slot->frame.load() == frame) ? t : 0;
+	}
+
+public:
+
+	LogHistogram line_period_jitter;
+	LogHistogram stamp_to_processed;
+	LogHistogram stamp_to_display;
+
+	LineTelemetry()
+	{
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		ns_per_tick = 1.0e9 / frequency.QuadPart;
+		stamp_increment.store(1);
+		stamp_modulus.store(65536);
+		reset();
+		restart();
+	}
+
+	static inline int64_t now()
+	{
+		LARGE_INTEGER t;
+		QueryPerformanceCounter(&t);
+		return t.QuadPart;
+	}
+
+	void configure(int stamp_increment, int stamp_modulus)
+	{
+		this->stamp_increment.store((stamp_increment > 0) ? stamp_increment : 1);
+		this->stamp_modulus.store((stamp_modulus > 1) ? stamp_modulus : 65536);
+	}
+
+	// Forget the previous stamp and frames in flight, i.e. because scanning has started again
+	void restart()
+	{
+		previous_stamp = -1;
+		previous_buffer_time = 0;
+		mean_buffer_interval = 0.0;
+		for (int i = 0; i < LINE_TELEMETRY_FRAME_SLOTS; i++)
+		{
+			frame_times[i].frame.store(-1);
+		}
+		last_displayed.store(-1);
+	}
+
+	// Zero the counters and histograms
+	void reset()
+	{
+		lines.store(0);
+		dropped_lines.store(0);
+		gaps.store(0);
+		discontinuities.store(0);
+		frames_processed.store(0);
+		frames_displayed.store(0);
+		line_period_jitter.reset();
+		stamp_to_processed.reset();
+		stamp_to_display.reset();
+	}
+
+	// Analyse the stamps of an IMAQ buffer examined at time t. Returns the number of lines dropped before and within it.
+	int64_t analyse_buffer(const uint16_t* stamps, int n, int64_t t)
+	{
+		int64_t increment = stamp_increment.load();
+		int64_t modulus = stamp_modulus.load();
+		int64_t dropped = 0;
+		for (int i = 0; i < n; i++)
+		{
+			int64_t stamp = stamps[i] % modulus;
+			if (previous_stamp > -1)
+			{
+				int64_t delta = (stamp - previous_stamp + modulus) % modulus;
+				if (delta != increment)
+				{
+					if (delta > 0 && delta % increment == 0)
+					{
+						dropped += delta / increment - 1;
+						gaps.fetch_add(1);
+					}
+					else
+					{
+						discontinuities.fetch_add(1);
+					}
+				}
+			}
+			previous_stamp = stamp;
+		}
+		lines.fetch_add(n);
+		if (dropped > 0)
+		{
+			dropped_lines.fetch_add(dropped);
+		}
+
+		if (previous_buffer_time > 0 && n > 0)
+		{
+			double interval = (double)(t - previous_buffer_time);
+			mean_buffer_interval = (mean_buffer_interval == 0.0) ? interval : mean_buffer_interval + LINE_TELEMETRY_MEAN_WEIGHT * (interval - mean_buffer_interval);
+			line_period_jitter.record(ticks_to_ns((int64_t)(fabs(interval - mean_buffer_interval) / n)));
+		}
+		previous_buffer_time = t;
+		return dropped;
+	}
+
+	// The first buffer of frame was examined at time t
+	void frame_acquired(int64_t frame, int64_t t)
+	{
+		FrameStampTime* slot = &frame_times[frame % LINE_TELEMETRY_FRAME_SLOTS];
+		slot->frame.store(-1);
+		slot->time.store(t);
+		slot->frame.store(frame);
+	}
+
+	void frame_processed(int64_t frame, int64_t t)
+	{
+		int64_t t0 = lookup(frame);
+		if (t0 > 0)
+		{
+			stamp_to_processed.record(ticks_to_ns(t - t0));
+		}
+		frames_processed.fetch_add(1);
+	}
+
+	// Called by the client thread when frame is handed to it
+	void frame_displayed(int64_t frame, int64_t t)
+	{
+		int64_t last = last_displayed.load();
+		if (frame <= last || !last_displayed.compare_exchange_strong(last, frame))
+		{
+			return;
+		}
+		int64_t t0 = lookup(frame);
+		if (t0 > 0)
+		{
+			stamp_to_display.record(ticks_to_ns(t - t0));
+		}
+		frames_displayed.fetch_add(1);
+	}
+
+	// Copy LINE_TELEMETRY_COUNTERS counters and LINE_TELEMETRY_HISTOGRAMS histogram snapshots
+	void snapshot(int64_t* counters, uint64_t* histograms)
+	{
+		counters[0] = lines.load();
+		counters[1] = dropped_lines.load();
+		counters[2] = gaps.load();
+		counters[3] = discontinuities.load();
+		counters[4] = frames_processed.load();
+		counters[5] = frames_displayed.load();
+		line_period_jitter.snapshot(histograms);
+		stamp_to_processed.snapshot(histograms + LOG_HISTOGRAM_SNAPSHOT_SIZE);
+		stamp_to_display.snapshot(histograms + 2 * LOG_HISTOGRAM_SNAPSHOT_SIZE);
+	}
+
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+
+/*
+Lock-free histogram with power-of-two buckets, for recording durations and counts from real-time threads
+without locks or allocation. Bucket 0 counts zeros and bucket i counts values in [2^(i-1), 2^i).
+
+Any number of threads may record() concurrently while another takes a snapshot(). The snapshot is not
+atomic as a whole, so its count may disagree with the sum of its buckets by the few values recorded
+while it was taken.
+*/
+
+#define LOG_HISTOGRAM_BUCKETS 64
+#define LOG_HISTOGRAM_SNAPSHOT_SIZE (LOG_HISTOGRAM_BUCKETS + 3)  // [count, sum, max, buckets...]
+
+
+class LogHistogram
+{
+private:
+
+	std::atomic<uint64_t> buckets[LOG_HISTOGRAM_BUCKETS];
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> sum;
+	std::atomic<uint64_t> maximum;
+
+public:
+
+	LogHistogram()
+	{
+		reset();
+	}
+
+	static inline int bucket(uint64_t value)
+	{
+		int b = 0;
+		while (value > 0 && b < LOG_HISTOGRAM_BUCKETS - 1)
+		{
+			value >>= 1;
+			b++;
+		}
+		return b;
+	}
+
+	// Upper bound of the values counted by bucket b
+	static inline uint64_t bucket_limit(int b)
+	{
+		return (b == 0) ? 0 : ((uint64_t)1 << b) - 1;
+	}
+
+	inline void record(uint64_t value)
+	{
+		buckets[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+		count.fetch_add(1, std::memory_order_relaxed);
+		sum.fetch_add(value, std::memory_order_relaxed);
+		uint64_t m = maximum.load(std::memory_order_relaxed);
+		while (value > m && !maximum.compare_exchange_weak(m, value, std::memory_order_relaxed)) {}
+	}
+
+	// Copy LOG_HISTOGRAM_SNAPSHOT_SIZE values to dst
+	void snapshot(uint64_t* dst)
+	{
+		dst[0] = count.load(std::memory_order_relaxed);
+		dst[1] = sum.load(std::memory_order_relaxed);
+		dst[2] = maximum.load(std::memory_order_relaxed);
+		for (int i = 0; i < LOG_HISTOGRAM_BUCKETS; i++)
+		{
+			dst[3 + i] = buckets[i].load(std::memory_order_relaxed);
+		}
+	}
+
+	// Upper bound of the bucket containing the pth percentile, p in [0, 100]
+	uint64_t percentile(double p)
+	{
+		uint64_t n = count.load(std::memory_order_relaxed);
+		uint64_t target = (uint64_t)(n * p / 100.0);
+		uint64_t cumulative = 0;
+		for (int i = 0; i < LOG_HISTOGRAM_BUCKETS; i++)
+		{
+			cumulative += buckets[i].load(std::memory_order_relaxed);
+			if (cumulative > target)
+			{
+				return bucket_limit(i);
+			}
+		}
+		return maximum.load(std::memory_order_relaxed);
+	}
+
+	uint64_t mean()
+	{
+		uint64_t n = count.load(std::memory_order_relaxed);
+		return (n > 0) ? sum.load(std::memory_order_relaxed) / n : 0;
+	}
+
+	void reset()
+	{
+		for (int i = 0; i < LOG_HISTOGRAM_BUCKETS; i++)
+		{
+			buckets[i].store(0);
+		}
+		count.store(0);
+		sum.store(0);
+		maximum.store(0);
+	}
+
+};
@@ -0,0 +1,333 @@
+#pragma once
+
+#ifdef FASTNISDOCT_HDF5
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <utility>
+#include <Windows.h>
+#include "hdf5.h"
+#include "zlib.h"
+#include "fftw3.h"
+#include "AsyncLogger.h"
+#include "Writer.h"
+#include "CompressionQueue.h"
+
+/*
+Writer of MATLAB v7.3 .mat files, which are HDF5 files with a 512 byte MATLAB header in the user block [1].
+
+Frames are in FORTRAN order [z, x, y]. MATLAB reverses the dimensions of HDF5 datasets, so the frames are stored
+in a dataset "frames" of C order shape (t, y, x, z), which MATLAB loads as [z, x, y, t]. Each frame is one chunk,
+written with H5Dwrite_chunk so that it does not pass through the HDF5 chunk cache. Complex frames are stored as
+MATLAB does, as a compound of "real" and "imag".
+
+If compression is enabled, the dataset is created with the shuffle and deflate filters and each frame is shuffled
+and deflated by one of MAT_COMPRESSION_THREADS threads of a CompressionQueue before it is written. Frames which
+deflate would not make smaller are written as they are, with the filters skipped in the chunk's filter mask. Without compression, frames
+are written from where they are without a copy, so like the UnbufferedWriter, a frame's memory must remain valid
+until it is no longer pending(). A frame is pending until it has been written, so that no more than MAT_QUEUE_DEPTH
+frames are held from the ring. The HDF5 calls of every MatWriter are made by one thread at a time, as a part
+being closed may overlap with the next.
+
+Acquisition parameters are stored as a struct "parameters" of scalar doubles.
+
+Requires HDF5 1.10.2 or later and zlib, which the project links statically from C:\lib\hdf5. Without
+FASTNISDOCT_HDF5 defined, the writer is not built and .mat streams are written raw.
+
+[1] https://www.mathworks.com/help/matlab/import_export/mat-file-versions.html
+*/
+
+#define MAT_USERBLOCK_SIZE 512
+#define MAT_QUEUE_DEPTH UNBUFFERED_QUEUE_DEPTH  // Frames in flight at once, no more than the ring has spares for
+#define MAT_COMPRESSION_THREADS 4
+#define MAT_EXTEND_BY 64  // Frames by which the dataset is extended at a time
+#define MAT_FILTER_SKIP_ALL 0x3  // Chunk filter mask which skips shuffle and deflate
+
+typedef std::vector<std::pair<std::string, double>> MatParameters;
+
+
+// Held for HDF5 calls, as HDF5 is not thread-safe unless it is built to be
+inline std::mutex& mat_hdf5_lock()
+{
+	static std::mutex lock;
+	return lock;
+}
+
+
+inline const char* matlab_class(uint16_t*)
+{
+	return "uint16";
+}
+
+inline const char* matlab_class(fftwf_complex*)
+{
+	return "single";
+}
+
+
+class MatWriter : public Writer
+{
+private:
+
+	char name[MAX_PATH];
+	const char* cls;
+	bool complex;
+	size_t element_size;
+	hsize_t frame_dims[3];  // C order (y, x, z)
+	size_t frame_bytes;
+	int level;  // Deflate level, 0 for no compression
+	MatParameters parameters;
+
+	hid_t file;
+	hid_t dataset;
+	hid_t type;
+	hsize_t extent;  // Frames the dataset has been extended to
+
+	std::unique_ptr<CompressionQueue> queue;  // Of chunks. Slots' buffers are for the shuffled and the deflated frame
+	int64_t frames_submitted;
+
+	static void set_matlab_class(hid_t obj, const char* cls)
+	{
+		hid_t str = H5Tcopy(H5T_C_S1);
+		H5Tset_size(str, strlen(cls));
+		hid_t space = H5Screate(H5S_SCALAR);
+		hid_t attr = H5Acreate2(obj, "MATLAB_class", str, space, H5P_DEFAULT, H5P_DEFAULT);
+		H5Awrite(attr, str, cls);
+		H5Aclose(attr);
+		H5Sclose(space);
+		H5Tclose(str);
+	}
+
+	void write_parameters()
+	{
+		hid_t group = H5Gcreate2(file, "parameters", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+		set_matlab_class(group, "struct");
+		hsize_t dims[2] = { 1, 1 };
+		hid_t space = H5Screate_simple(2, dims, NULL);
+		for (auto& p : parameters)
+		{
+			hid_t d = H5Dcreate2(group, p.first.c_str(), H5T_IEEE_F64LE, space, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+			H5Dwrite(d, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, &p.second);
+			set_matlab_class(d, "double");
+			H5Dclose(d);
+		}
+		H5Sclose(space);
+		H5Gclose(group);
+	}
+
+	// The MATLAB header in the user block, written once HDF5 has closed the file
+	void write_header()
+	{
+		char header[128];
+		memset(header, ' ', 116);
+		time_t now = time(NULL);
+		char date[32];
+		strftime(date, sizeof(date), "%a %b %d %H:%M:%S %Y", localtime(&now));
+		int n = snprintf(header, 116, "MATLAB 7.3 MAT-file, Platform: PCWIN64, Created on: %s HDF5 schema 1.00 .", date);
+		if (n > 0 && n < 116)
+		{
+			header[n] = ' ';
+		}
+		memset(header + 116, 0, 8);  // Subsystem data offset
+		header[124] = 0x00;  // Version 0x0200, little-endian
+		header[125] = 0x02;
+		header[126] = 'I';  // Endian indicator
+		header[127] = 'M';
+		FILE* f = fopen(name, "r+b");
+		if (f == NULL)
+		{
+			async_printf("fastnisdoct/MatWriter: Failed to write the MATLAB header of %s\n", name);
+			return;
+		}
+		fwrite(header, 1, 128, f);
+		fclose(f);
+	}
+
+	// Shuffle the bytes of the elements so that bytes of equal significance are adjacent, then deflate them
+	void _compress(CompressionSlot* slot)
+	{
+		const char* src = (const char*)slot->frame;
+		char* shuffled = slot->buffers[0].get();
+		size_t n = frame_bytes / element_size;
+		for (size_t b = 0; b < element_size; b++)
+		{
+			char* dst = shuffled + b * n;
+			for (size_t e = 0; e < n; e++)
+			{
+				dst[e] = src[e * element_size + b];
+			}
+		}
+		uLongf compressed_size = (uLongf)compressBound((uLong)frame_bytes);
+		if (compress2((Bytef*)slot->buffers[1].get(), &compressed_size, (const Bytef*)shuffled, (uLong)frame_bytes, level) == Z_OK && compressed_size < frame_bytes)
+		{
+			slot->out = slot->buffers[1].get();
+			slot->out_size = compressed_size;
+			slot->flags = 0;
+		}
+		else
+		{
+			slot->out = slot->frame;
+			slot->out_size = frame_bytes;
+			slot->flags = MAT_FILTER_SKIP_ALL;
+		}
+	}
+
+	void _write(CompressionSlot* slot)
+	{
+		size_t chunk_size = (level > 0) ? slot->out_size : frame_bytes;
+		std::lock_guard<std::mutex> hdf5(mat_hdf5_lock());
+		if ((hsize_t)slot->n >= extent)
+		{
+			extent += MAT_EXTEND_BY;
+			hsize_t dims[4] = { extent, frame_dims[0], frame_dims[1], frame_dims[2] };
+			H5Dset_extent(dataset, dims);
+		}
+		hsize_t offset[4] = { (hsize_t)slot->n, 0, 0, 0 };
+		if (H5Dwrite_chunk(dataset, H5P_DEFAULT, slot->flags, offset, chunk_size, slot->out) < 0)
+		{
+			async_printf_every(LOG_PERIOD_MS, "fastnisdoct/MatWriter: Failed to write frame %lli to %s\n", slot->n, name);
+		}
+	}
+
+public:
+
+	// Frames of shape [z, x, y] of elements of T. Compressed with deflate level if it is greater than 0.
+	template <class T>
+	MatWriter(T* element_type, int64_t z, int64_t x, int64_t y, int level, const MatParameters& parameters)
+	{
+		cls = matlab_class(element_type);
+		element_size = sizeof(T);
+		complex = element_size == 2 * sizeof(float);
+		frame_dims[0] = y;
+		frame_dims[1] = x;
+		frame_dims[2] = z;
+		frame_bytes = element_size * z * x * y;
+		this->level = level;
+		this->parameters = parameters;
+		file = -1;
+		dataset = -1;
+		std::unique_lock<std::mutex> hdf5(mat_hdf5_lock());
+		if (complex)
+		{
+			type = H5Tcreate(H5T_COMPOUND, 2 * sizeof(float));
+			H5Tinsert(type, "real", 0, H5T_IEEE_F32LE);
+			H5Tinsert(type, "imag", sizeof(float), H5T_IEEE_F32LE);
+		}
+		else
+		{
+			type = H5Tcopy(H5T_STD_U16LE);
+		}
+		hdf5.unlock();
+		std::function<void(CompressionSlot*)> compress;  // None without compression, so frames are written from where they are
+		if (level > 0)
+		{
+			compress = [this](CompressionSlot* slot) { _compress(slot); };
+		}
+		queue = std::make_unique<CompressionQueue>(MAT_QUEUE_DEPTH, MAT_COMPRESSION_THREADS, compress, [this](CompressionSlot* slot) { _write(slot); });
+		if (level > 0)
+		{
+			for (int i = 0; i < MAT_QUEUE_DEPTH; i++)
+			{
+				queue->slot(i)->buffers[0] = std::make_unique<char[]>(frame_bytes);
+				queue->slot(i)->buffers[1] = std::make_unique<char[]>(compressBound((uLong)frame_bytes));
+			}
+		}
+		frames_submitted = 0;
+	}
+
+	~MatWriter()
+	{
+		close();
+		queue.reset();
+		std::lock_guard<std::mutex> hdf5(mat_hdf5_lock());
+		H5Tclose(type);
+	}
+
+	void open(const char* fname) override
+	{
+		strcpy_s(name, MAX_PATH, fname);
+		queue->reset();
+		frames_submitted = 0;
+		std::lock_guard<std::mutex> hdf5(mat_hdf5_lock());
+		hid_t fcpl = H5Pcreate(H5P_FILE_CREATE);
+		H5Pset_userblock(fcpl, MAT_USERBLOCK_SIZE);
+		hid_t fapl = H5Pcreate(H5P_FILE_ACCESS);
+		H5Pset_alignment(fapl, ARENA_ALIGNMENT, ARENA_ALIGNMENT);
+		file = H5Fcreate(fname, H5F_ACC_TRUNC, fcpl, fapl);
+		H5Pclose(fcpl);
+		H5Pclose(fapl);
+		if (file < 0)
+		{
+			async_printf("fastnisdoct/MatWriter: Failed to create %s\n", fname);
+			return;
+		}
+		hsize_t dims[4] = { 0, frame_dims[0], frame_dims[1], frame_dims[2] };
+		hsize_t max_dims[4] = { H5S_UNLIMITED, frame_dims[0], frame_dims[1], frame_dims[2] };
+		hsize_t chunk[4] = { 1, frame_dims[0], frame_dims[1], frame_dims[2] };
+		hid_t space = H5Screate_simple(4, dims, max_dims);
+		hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+		H5Pset_chunk(dcpl, 4, chunk);
+		if (level > 0)
+		{
+			H5Pset_shuffle(dcpl);
+			H5Pset_deflate(dcpl, level);
+		}
+		hid_t dapl = H5Pcreate(H5P_DATASET_ACCESS);
+		H5Pset_chunk_cache(dapl, 0, 0, 1.0);  // Chunks are written directly
+		dataset = H5Dcreate2(file, "frames", type, space, H5P_DEFAULT, dcpl, dapl);
+		H5Pclose(dapl);
+		H5Pclose(dcpl);
+		H5Sclose(space);
+		set_matlab_class(dataset, cls);
+		write_parameters();
+		extent = 0;
+	}
+
+	bool is_open() override
+	{
+		return file >= 0;
+	}
+
+	void writeFrame(void* f, long frame_size) override
+	{
+		queue->submit(f);  // Waits for the frame written MAT_QUEUE_DEPTH frames ago
+		frames_submitted++;
+	}
+
+	int pending() override
+	{
+		return queue->unwritten();
+	}
+
+	void wait_pending(int n) override
+	{
+		queue->wait_unwritten(n);
+	}
+
+	void close() override
+	{
+		if (file < 0)
+		{
+			return;
+		}
+		queue->wait_unwritten(0);
+		std::unique_lock<std::mutex> hdf5(mat_hdf5_lock());
+		hsize_t dims[4] = { (hsize_t)frames_submitted, frame_dims[0], frame_dims[1], frame_dims[2] };
+		H5Dset_extent(dataset, dims);
+		H5Dclose(dataset);
+		H5Fclose(file);
+		hdf5.unlock();
+		dataset = -1;
+		file = -1;
+		write_header();
+	}
+
+};
+
+#endif
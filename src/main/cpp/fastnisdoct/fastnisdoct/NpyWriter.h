@@ -0,0 +1,154 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <Windows.h>
+#include "fftw3.h"
+#include "AsyncLogger.h"
+#include "Writer.h"
+
+/*
+Writer of NumPy .npy files [1] which can be loaded with np.load(mmap_mode='r') without a copy.
+
+Frames are in FORTRAN order [z, x, y], so they are stacked along a fourth axis t and the file is described as a
+FORTRAN order array of shape (z, x, y, t). The header is padded to NPY_HEADER_SIZE so that the frames which follow
+are sector-aligned and are streamed by an UnbufferedWriter. The number of frames is unknown until the file is
+closed, when the header is rewritten in place with the final shape.
+
+[1] https://numpy.org/doc/stable/reference/generated/numpy.lib.format.html
+*/
+
+#define NPY_HEADER_SIZE ARENA_ALIGNMENT
+
+
+inline const char* npy_descr(uint16_t*)
+{
+	return "<u2";
+}
+
+inline const char* npy_descr(fftwf_complex*)
+{
+	return "<c8";
+}
+
+inline const char* npy_descr(float*)
+{
+	return "<f4";
+}
+
+
+class NpyWriter : public Writer
+{
+private:
+
+	UnbufferedWriter writer;
+	char name[MAX_PATH];
+	const char* descr;
+	int64_t shape[3];
+	int64_t frames;
+	char* header;  // Sector-aligned, as it is written in place
+
+	// Format the header for n_frames frames. Returns false if it does not fit.
+	bool format_header(int64_t n_frames)
+	{
+		char dict[NPY_HEADER_SIZE];
+		int n = snprintf(dict, NPY_HEADER_SIZE, "{'descr': '%s', 'fortran_order': True, 'shape': (%lli, %lli, %lli, %lli), }",
+			descr, shape[0], shape[1], shape[2], n_frames);
+		int dict_size = NPY_HEADER_SIZE - 10;  // Magic, version and header length precede the dict
+		if (n < 0 || n >= dict_size)
+		{
+			return false;
+		}
+		memcpy(header, "\x93NUMPY\x01\x00", 8);
+		header[8] = (char)(dict_size & 0xFF);
+		header[9] = (char)(dict_size >> 8);
+		memcpy(header + 10, dict, n);
+		memset(header + 10 + n, ' ', dict_size - n - 1);
+		header[NPY_HEADER_SIZE - 1] = '\n';
+		return true;
+	}
+
+public:
+
+	// Frames of shape [z, x, y] of elements described by descr, such as returned by npy_descr()
+	NpyWriter(const char* descr, int64_t z, int64_t x, int64_t y)
+	{
+		this->descr = descr;
+		shape[0] = z;
+		shape[1] = x;
+		shape[2] = y;
+		frames = 0;
+		header = (char*)VirtualAlloc(NULL, NPY_HEADER_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	}
+
+	~NpyWriter()
+	{
+		close();
+		VirtualFree(header, 0, MEM_RELEASE);
+	}
+
+	void open(const char* fname) override
+	{
+		strcpy_s(name, MAX_PATH, fname);
+		frames = 0;
+		writer.open(fname);
+		if (writer.is_open())
+		{
+			format_header(0);
+			writer.writeFrame(header, NPY_HEADER_SIZE);
+		}
+	}
+
+	bool is_open() override
+	{
+		return writer.is_open();
+	}
+
+	void writeFrame(void* f, long frame_size) override
+	{
+		writer.writeFrame(f, frame_size);
+		frames++;
+	}
+
+	int pending() override
+	{
+		return writer.pending();
+	}
+
+	void wait_pending(int n) override
+	{
+		writer.wait_pending(n);
+	}
+
+	int64_t next_offset() override
+	{
+		return writer.next_offset();
+	}
+
+	void preallocate(int64_t bytes) override
+	{
+		writer.preallocate(NPY_HEADER_SIZE + bytes);
+	}
+
+	void close() override
+	{
+		if (!writer.is_open())
+		{
+			return;
+		}
+		writer.close();
+		// Rewrite the header with the number of frames
+		HANDLE h = CreateFileA(name, GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		DWORD written = 0;
+		if (h == INVALID_HANDLE_VALUE || !format_header(frames) || !WriteFile(h, header, NPY_HEADER_SIZE, &written, NULL))
+		{
+			async_printf("fastnisdoct/NpyWriter: Failed to write the shape of %s. It contains %lli frames\n", name, frames);
+		}
+		if (h != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(h);
+		}
+	}
+
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <tmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/*
+Packing of 12-bit samples held in uint16 into 3 bytes per 2 samples, so that raw spectra take 75% of the memory and
+disk bandwidth. Sample a and the sample b which follows it are packed little-endian as the 24 bits a | b << 12. The
+upper 4 bits of each sample are discarded, so packing is lossless only for samples less than 4096.
+
+8 samples at a time are packed and unpacked with SSSE3 if the CPU supports it, and the rest one pair at a time.
+*/
+
+#ifdef _MSC_VER
+#define PACKED12_TARGET
+#else
+#define PACKED12_TARGET __attribute__((target("ssse3")))
+#endif
+
+
+// Bytes n packed samples occupy
+inline size_t packed12_bytes(size_t n)
+{
+	return (n * 3 + 1) / 2;
+}
+
+// uint16 elements n packed samples occupy, i.e. the element size of a ring of packed frames
+inline size_t packed12_elements(size_t n)
+{
+	return (packed12_bytes(n) + 1) / 2;
+}
+
+
+inline bool packed12_ssse3()
+{
+	static int supported = -1;
+	if (supported == -1)
+	{
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 1);
+		supported = (info[2] >> 9) & 1;
+#else
+		supported = __builtin_cpu_supports("ssse3") ? 1 : 0;
+#endif
+	}
+	return supported == 1;
+}
+
+
+inline void pack12_scalar(const uint16_t* in, size_t n, uint8_t* out)
+{
+	size_t i = 0;
+	for (; i + 1 < n; i += 2)
+	{
+		uint32_t v = (in[i] & 0xFFF) | ((uint32_t)(in[i + 1] & 0xFFF) << 12);
+		out[0] = (uint8_t)v;
+		out[1] = (uint8_t)(v >> 8);
+		out[2] = (uint8_t)(v >> 16);
+		out += 3;
+	}
+	if (i < n)  // Odd sample takes 2 bytes
+	{
+		out[0] = (uint8_t)in[i];
+		out[1] = (uint8_t)((in[i] >> 8) & 0xF);
+	}
+}
+
+inline void unpack12_scalar(const uint8_t* in, size_t n, uint16_t* out)
+{
+	size_t i = 0;
+	for (; i + 1 < n; i += 2)
+	{
+		uint32_t v = in[0] | ((uint32_t)in[1] << 8) | ((uint32_t)in[2] << 16);
+		out[i] = (uint16_t)(v & 0xFFF);
+		out[i + 1] = (uint16_t)(v >> 12);
+		in += 3;
+	}
+	if (i < n)
+	{
+		out[i] = (uint16_t)(in[0] | ((in[1] & 0xF) << 8));
+	}
+}
+
+
+// Pack 8 samples at a time. Returns the number of samples packed
+PACKED12_TARGET inline size_t pack12_ssse3(const uint16_t* in, size_t n, uint8_t* out)
+{
+	const __m128i mask = _mm_set1_epi16(0xFFF);
+	const __m128i shift = _mm_set1_epi32(0x10000001);  // a * 1 + b * 4096 in each 32-bit lane
+	const __m128i gather = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(in + i)), mask);
+		v = _mm_shuffle_epi8(_mm_madd_epi16(v, shift), gather);
+		_mm_storel_epi64((__m128i*)out, v);
+		int tail = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+		memcpy(out + 8, &tail, 4);
+		out += 12;
+	}
+	return i;
+}
+
+// Unpack 8 samples at a time, reading no further than in + n_bytes. Returns the number of samples unpacked
+PACKED12_TARGET inline size_t unpack12_ssse3(const uint8_t* in, size_t n, size_t n_bytes, uint16_t* out)
+{
+	const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	const __m128i low = _mm_set1_epi32(0xFFF);
+	size_t i = 0;
+	for (; i + 8 <= n && (i / 2) * 3 + 16 <= n_bytes; i += 8)  // Loads 16 bytes to use 12
+	{
+		__m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + (i / 2) * 3)), spread);
+		__m128i a = _mm_and_si128(v, low);
+		__m128i b = _mm_slli_epi32(_mm_srli_epi32(v, 12), 16);
+		_mm_storeu_si128((__m128i*)(out + i), _mm_or_si128(a, b));
+	}
+	return i;
+}
+
+
+// Pack the n 12-bit samples of in into packed12_bytes(n) bytes of out
+inline void pack12(const uint16_t* in, size_t n, void* out)
+{
+	uint8_t* dst = (uint8_t*)out;
+	size_t i = packed12_ssse3() ? pack12_ssse3(in, n, dst) : 0;
+	pack12_scalar(in + i, n - i, dst + (i / 2) * 3);
+}
+
+// Unpack n 12-bit samples from the packed12_bytes(n) bytes of in into out
+inline void unpack12(const void* in, size_t n, uint16_t* out)
+{
+	const uint8_t* src = (const uint8_t*)in;
+	size_t i = packed12_ssse3() ? unpack12_ssse3(src, n, packed12_bytes(n), out) : 0;
+	unpack12_scalar(src + (i / 2) * 3, n - i, out + i);
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <Windows.h>
+#include "LogHistogram.h"
+#include "TraceRecorder.h"
+
+/*
+Timing of each stage of the acquisition and processing pipeline, kept in lock-free LogHistograms of ns.
+
+Each stage is timed by the single thread which carries it out, except for worker compute, which each
+worker records into its own histogram so that workers never contend for a cache line. The worker
+histograms are merged when a snapshot is taken.
+
+If the TraceRecorder is enabled, each stage is also recorded as a trace event.
+*/
+
+#define PIPELINE_MAX_WORKERS 64
+
+
+enum PipelineStage
+{
+	PIPELINE_BUFFER_WAIT = 0,  // Waiting for IMAQ to fill the next buffer
+	PIPELINE_COPY = 1,  // Copying the buffer's A-line stamps and image A-lines into the frame
+	PIPELINE_SUBMIT = 2,  // Submitting the frame to the processing pool
+	PIPELINE_WORKER_COMPUTE = 3,  // Each worker's share of the frame
+	PIPELINE_JOIN_WAIT = 4,  // Waiting for the workers after acquiring the next frame
+	PIPELINE_REPEAT_PROCESSING = 5,  // A-line and B-line repeat processing
+	PIPELINE_RING_PUSH = 6,  // Copying the frame into the export ring, or locking out the head of the spectral ring to assemble it in
+	PIPELINE_DISK_WRITE = 7,  // Writing a frame to disk
+	PIPELINE_FRAME = 8,  // The whole frame, from submission to hand off to the client
+	PIPELINE_STAGE_COUNT = 9
+};
+
+
+static const char* PIPELINE_STAGE_NAMES[PIPELINE_STAGE_COUNT] = {
+	"buffer wait",
+	"copy",
+	"submit",
+	"worker compute",
+	"join wait",
+	"repeat processing",
+	"ring push",
+	"disk write",
+	"frame"
+};
+
+
+class PipelineStats
+{
+private:
+
+	LogHistogram stages[PIPELINE_STAGE_COUNT];  // PIPELINE_WORKER_COMPUTE is unused
+	LogHistogram worker_compute[PIPELINE_MAX_WORKERS];
+	double ns_per_tick;
+
+public:
+
+	PipelineStats()
+	{
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		ns_per_tick = 1.0e9 / frequency.QuadPart;
+	}
+
+	static inline int64_t now()
+	{
+		LARGE_INTEGER t;
+		QueryPerformanceCounter(&t);
+		return t.QuadPart;
+	}
+
+	// Record the time elapsed since t0 and return the time now, so that consecutive stages can be chained.
+	// arg, i.e. a frame or buffer number, is only used by the trace.
+	inline int64_t record(PipelineStage stage, int64_t t0, int64_t arg = 0)
+	{
+		int64_t t = now();
+		stages[stage].record((uint64_t)((t - t0) * ns_per_tick));
+		if (trace_recorder().is_enabled())
+		{
+			trace_recorder().record(PIPELINE_STAGE_NAMES[stage], t0, t, arg);
+		}
+		return t;
+	}
+
+	inline int64_t record_worker(int worker, int64_t t0, int64_t arg = 0)
+	{
+		int64_t t = now();
+		worker_compute[worker % PIPELINE_MAX_WORKERS].record((uint64_t)((t - t0) * ns_per_tick));
+		if (trace_recorder().is_enabled())
+		{
+			trace_recorder().record(PIPELINE_STAGE_NAMES[PIPELINE_WORKER_COMPUTE], t0, t, arg);
+		}
+		return t;
+	}
+
+	// Copy PIPELINE_STAGE_COUNT snapshots of LOG_HISTOGRAM_SNAPSHOT_SIZE to dst
+	void snapshot(uint64_t* dst)
+	{
+		for (int s = 0; s < PIPELINE_STAGE_COUNT; s++)
+		{
+			stages[s].snapshot(dst + s * LOG_HISTOGRAM_SNAPSHOT_SIZE);
+		}
+		uint64_t* merged = dst + PIPELINE_WORKER_COMPUTE * LOG_HISTOGRAM_SNAPSHOT_SIZE;
+		uint64_t worker[LOG_HISTOGRAM_SNAPSHOT_SIZE];
+		memset(merged, 0, LOG_HISTOGRAM_SNAPSHOT_SIZE * sizeof(uint64_t));
+		for (int w = 0; w < PIPELINE_MAX_WORKERS; w++)
+		{
+			worker_compute[w].snapshot(worker);
+			merged[0] += worker[0];
+			merged[1] += worker[1];
+			merged[2] = (worker[2] > merged[2]) ? worker[2] : merged[2];
+			for (int i = 3; i < LOG_HISTOGRAM_SNAPSHOT_SIZE; i++)
+			{
+				merged[i] += worker[i];
+			}
+		}
+	}
+
+	void reset()
+	{
+		for (int s = 0; s < PIPELINE_STAGE_COUNT; s++)
+		{
+			stages[s].reset();
+		}
+		for (int w = 0; w < PIPELINE_MAX_WORKERS; w++)
+		{
+			worker_compute[w].reset();
+		}
+	}
+
+};
@@ -0,0 +1,367 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <Windows.h>
+#include "AsyncLogger.h"
+#include "Writer.h"
+#include "FrameIndex.h"
+#include "Packed12.h"
+
+/*
+Reader of recordings made by the FileStreamWorker, which memory-maps the recording's index and all of its part files
+so that any frame is read in place without a copy.
+
+A recording is opened by the file name it was recorded to, without a suffix. Its .idx gives the shape and size of
+the frames, the type of the part files and the part and offset of each frame. Raw (.bin and .b12) and .npy
+recordings can be read, as they store frames whole. Frames are in FORTRAN order [z, x, y] of uint16 spectra,
+complex64 processed voxels or 12-bit packed spectra, which can be unpacked with unpack12().
+
+The frames of a striped recording are in the stripe files listed in the .stripes of each part, where the j-th frame
+of a part is at its offset in the file of stripe j % stripes.
+
+Writers share their files for reading, so a recording can be opened while it is being recorded. It reads the frames
+which were indexed when it was opened, and a part it has mapped can't be trimmed to its length when it is closed.
+
+Pages of a mapped frame are read from disk when they are first touched. prefetch() asks the memory manager to read a
+range of frames ahead of time, so that a sequential scan of a recording proceeds at the speed of the disk.
+*/
+
+enum RecordingDtype
+{
+	RECORDING_DTYPE_UNKNOWN = 0,
+	RECORDING_DTYPE_UINT16 = 1,
+	RECORDING_DTYPE_COMPLEX64 = 2,
+	RECORDING_DTYPE_PACKED12 = 3
+};
+
+
+struct MappedFile
+{
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+	const char* view = NULL;
+	uint64_t size = 0;
+
+	bool map(const char* name)
+	{
+		file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			return false;
+		}
+		LARGE_INTEGER n;
+		if (!GetFileSizeEx(file, &n) || n.QuadPart == 0)
+		{
+			return false;
+		}
+		size = n.QuadPart;
+		mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping != NULL)
+		{
+			view = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		}
+		return view != NULL;
+	}
+
+	void unmap()
+	{
+		if (view != NULL)
+		{
+			UnmapViewOfFile(view);
+		}
+		if (mapping != NULL)
+		{
+			CloseHandle(mapping);
+		}
+		if (file != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(file);
+		}
+		view = NULL;
+		mapping = NULL;
+		file = INVALID_HANDLE_VALUE;
+		size = 0;
+	}
+};
+
+
+class RecordingReader
+{
+private:
+
+	MappedFile index;
+	std::vector<MappedFile> parts;  // Of each part, or of each stripe of each part if striped
+	std::vector<int64_t> part_first;  // Frame which begins each part
+	const FrameIndexRecord* records;
+	int64_t n_frames;
+	uint64_t frame_size;
+	FileStreamType file_type;
+	uint32_t flags;
+	uint32_t stripes;  // 0 unless striped
+	int64_t frame_shape[3];
+
+	bool read_header()
+	{
+		const char* h = index.view;
+		uint32_t version, record_size, type;
+		if (index.size < FRAME_INDEX_HEADER_SIZE || memcmp(h, "FNSDIDX1", 8) != 0)
+		{
+			return false;
+		}
+		memcpy(&version, h + 8, 4);
+		memcpy(&record_size, h + 12, 4);
+		memcpy(&frame_size, h + 16, 8);
+		memcpy(&type, h + 24, 4);
+		memcpy(&flags, h + 28, 4);
+		memcpy(frame_shape, h + 32, 3 * sizeof(int64_t));
+		memcpy(&stripes, h + 56, 4);
+		stripes = (flags & FRAME_INDEX_FLAG_STRIPED) ? stripes : 0;
+		file_type = (FileStreamType)type;
+		records = (const FrameIndexRecord*)(h + FRAME_INDEX_HEADER_SIZE);
+		n_frames = (index.size - FRAME_INDEX_HEADER_SIZE) / FRAME_INDEX_RECORD_SIZE;  // Records still being written are ignored
+		return version == FRAME_INDEX_VERSION && record_size == FRAME_INDEX_RECORD_SIZE;
+	}
+
+	const char* suffix()
+	{
+		if (file_type == FSTREAM_TYPE_NPY)
+		{
+			return ".npy";
+		}
+		return (flags & FRAME_INDEX_FLAG_PACKED12) ? ".b12" : ".bin";
+	}
+
+	// Map the stripe files listed in the .stripes of the part named part_name to parts[first] onwards
+	void map_stripes(const char* part_name, size_t first)
+	{
+		char name[MAX_PATH];
+		sprintf_s(name, "%s.stripes", part_name);
+		FILE* f = fopen(name, "r");
+		if (f == NULL)
+		{
+			async_printf("fastnisdoct/RecordingReader: Failed to open %s. The frames of the part can't be read\n", name);
+			return;
+		}
+		char line[MAX_PATH + 32];
+		while (fgets(line, sizeof(line), f) != NULL)
+		{
+			int s = -1;
+			int n = 0;
+			if (sscanf(line, "stripe %i %n", &s, &n) == 1 && n > 0 && s >= 0 && s < (int)stripes)
+			{
+				line[strcspn(line, "\r\n")] = '\0';
+				if (!parts[first + s].map(line + n))
+				{
+					async_printf("fastnisdoct/RecordingReader: Failed to map stripe %s. Its frames can't be read\n", line + n);
+				}
+			}
+		}
+		fclose(f);
+	}
+
+public:
+
+	RecordingReader()
+	{
+		records = NULL;
+		n_frames = 0;
+		frame_size = 0;
+		file_type = FSTREAM_TYPE_RAW;
+		flags = 0;
+		stripes = 0;
+		memset(frame_shape, 0, sizeof(frame_shape));
+	}
+
+	RecordingReader(const RecordingReader&) = delete;
+	RecordingReader& operator=(const RecordingReader&) = delete;
+
+	~RecordingReader()
+	{
+		close();
+	}
+
+	// Map the recording made to file_name. Returns false if it cannot be read
+	bool open(const char* file_name)
+	{
+		close();
+		char name[MAX_PATH];
+		sprintf_s(name, "%s.idx", file_name);
+		if (!index.map(name) || !read_header())
+		{
+			async_printf("fastnisdoct/RecordingReader: %s is not the index of a recording\n", name);
+			close();
+			return false;
+		}
+		if (file_type != FSTREAM_TYPE_RAW && file_type != FSTREAM_TYPE_NPY)
+		{
+			async_printf("fastnisdoct/RecordingReader: Recordings of type %i can't be mapped\n", (int)file_type);
+			close();
+			return false;
+		}
+		int32_t last_part = (n_frames > 0) ? records[n_frames - 1].part : 0;
+		parts.resize((size_t)(last_part + 1) * ((stripes > 0) ? stripes : 1));
+		part_first.assign(last_part + 1, 0);
+		for (int64_t k = n_frames - 1; k >= 0; k--)
+		{
+			if (records[k].part >= 0 && records[k].part <= last_part)
+			{
+				part_first[records[k].part] = k;
+			}
+		}
+		for (int32_t p = 0; p <= last_part; p++)
+		{
+			if (p == 0)
+			{
+				sprintf_s(name, "%s%s", file_name, suffix());
+			}
+			else
+			{
+				sprintf_s(name, "%s_%04d%s", file_name, p, suffix());
+			}
+			if (stripes > 0)
+			{
+				map_stripes(name, (size_t)p * stripes);
+			}
+			else if (!parts[p].map(name))
+			{
+				async_printf("fastnisdoct/RecordingReader: Failed to map part %s. Its frames can't be read\n", name);
+			}
+		}
+		return true;
+	}
+
+	bool is_open()
+	{
+		return index.view != NULL;
+	}
+
+	int64_t frames()
+	{
+		return n_frames;
+	}
+
+	// Size of each frame in bytes
+	uint64_t frame_bytes()
+	{
+		return frame_size;
+	}
+
+	// Shape [z, x, y] of each frame in FORTRAN order
+	const int64_t* shape()
+	{
+		return frame_shape;
+	}
+
+	RecordingDtype dtype()
+	{
+		int64_t n = frame_shape[0] * frame_shape[1] * frame_shape[2];
+		if (n <= 0)
+		{
+			return RECORDING_DTYPE_UNKNOWN;
+		}
+		if (flags & FRAME_INDEX_FLAG_PACKED12)
+		{
+			return RECORDING_DTYPE_PACKED12;
+		}
+		if (frame_size == n * sizeof(uint16_t))
+		{
+			return RECORDING_DTYPE_UINT16;
+		}
+		if (frame_size == n * 2 * sizeof(float))
+		{
+			return RECORDING_DTYPE_COMPLEX64;
+		}
+		return RECORDING_DTYPE_UNKNOWN;
+	}
+
+	// The index record of the k-th frame written, or NULL
+	const FrameIndexRecord* record(int64_t k)
+	{
+		return (k >= 0 && k < n_frames) ? &records[k] : NULL;
+	}
+
+	// The k-th frame written, in place. NULL if it is not in the part files
+	const void* frame(int64_t k)
+	{
+		const FrameIndexRecord* r = record(k);
+		if (r == NULL || r->part < 0 || r->part >= (int32_t)part_first.size())
+		{
+			return NULL;
+		}
+		if (r->offset < 0)
+		{
+			async_printf_every(LOG_PERIOD_MS, "fastnisdoct/RecordingReader: Frame %lli was indexed without an offset in its part file and can't be read\n", (long long)k);
+			return NULL;
+		}
+		MappedFile* part = (stripes > 0) ? &parts[(size_t)r->part * stripes + (k - part_first[r->part]) % stripes] : &parts[r->part];
+		if (part->view == NULL || r->offset + frame_size > part->size)
+		{
+			return NULL;
+		}
+		return part->view + r->offset;
+	}
+
+	// Frames k through k + n - 1 in place, if they are contiguous in one part file. Otherwise NULL
+	const void* slab(int64_t k, int64_t n)
+	{
+		const char* first = (const char*)frame(k);
+		if (first == NULL || n < 1)
+		{
+			return NULL;
+		}
+		for (int64_t i = 1; i < n; i++)
+		{
+			if ((const char*)frame(k + i) != first + i * frame_size)
+			{
+				return NULL;
+			}
+		}
+		return first;
+	}
+
+	// Read frames k through k + n - 1 into memory in the background, ahead of their use
+	void prefetch(int64_t k, int64_t n)
+	{
+		std::vector<WIN32_MEMORY_RANGE_ENTRY> ranges;
+		for (int64_t i = k; i < k + n; i++)
+		{
+			const char* f = (const char*)frame(i);
+			if (f == NULL)
+			{
+				continue;
+			}
+			if (!ranges.empty() && (const char*)ranges.back().VirtualAddress + ranges.back().NumberOfBytes == f)
+			{
+				ranges.back().NumberOfBytes += frame_size;  // Coalesce contiguous frames
+			}
+			else
+			{
+				WIN32_MEMORY_RANGE_ENTRY range;
+				range.VirtualAddress = (void*)f;
+				range.NumberOfBytes = frame_size;
+				ranges.push_back(range);
+			}
+		}
+		if (!ranges.empty())
+		{
+			PrefetchVirtualMemory(GetCurrentProcess(), (ULONG)ranges.size(), ranges.data(), 0);
+		}
+	}
+
+	void close()
+	{
+		for (auto& part : parts)
+		{
+			part.unmap();
+		}
+		parts.clear();
+		part_first.clear();
+		index.unmap();
+		records = NULL;
+		n_frames = 0;
+	}
+
+};
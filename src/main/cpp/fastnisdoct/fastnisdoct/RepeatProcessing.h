@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <Windows.h>
+#include "fftw3.h"
+
+/*
+Processing of repeated A-lines and B-lines in a frame of processed A-lines, which is carried out after the
+AlineProcessingPool has finished with the frame, both live and when recordings are reprocessed offline.
+
+Repeats are combined in place, so the frame shrinks to the front of the buffer: A-line repeats are averaged first,
+then B-line repeats are averaged or differenced.
+*/
+
+
+enum RepeatProcessingType
+{
+	REPEAT_PROCESSING_NONE = 0,
+	REPEAT_PROCESSING_MEAN = 1,
+	REPEAT_PROCESSING_DIFF = 2
+};
+DEFINE_ENUM_FLAG_OPERATORS(RepeatProcessingType);
+
+
+// Combine the repeats of the frame of alines_in_image A-lines of roi_size voxels at processed_alines_addr in place
+inline void process_repeats(
+	fftwf_complex* processed_alines_addr,
+	int roi_size,
+	int alines_in_image,
+	int alines_per_bline,
+	int n_aline_repeat,
+	int n_bline_repeat,
+	RepeatProcessingType a_rpt_proc_flag,
+	RepeatProcessingType b_rpt_proc_flag
+)
+{
+	fftwf_complex r;
+	int alines_per_bline_now;  // A-lines per B-line following A-line repeat processing
+	if (a_rpt_proc_flag == REPEAT_PROCESSING_MEAN && n_aline_repeat > 1)  // A-line averaging
+	{
+		alines_per_bline_now = alines_per_bline / n_aline_repeat;
+		for (int b = 0; b < alines_in_image / alines_per_bline; b++)  // For each B-line in the preprocessed frames
+		{
+			for (int x = 0; x < alines_per_bline_now; x++)  // For each A-line in the reduced B-line
+			{
+				for (int z = 0; z < roi_size; z++)
+				{
+					r[0] = 0;
+					r[1] = 0;
+					for (int k = 0; k < n_aline_repeat; k++)
+					{
+						r[0] += processed_alines_addr[(b * alines_per_bline + x * n_aline_repeat + k) * roi_size + z][0];
+						r[1] += processed_alines_addr[(b * alines_per_bline + x * n_aline_repeat + k) * roi_size + z][1];
+					}
+					processed_alines_addr[(b * alines_per_bline_now + x) * roi_size + z][0] = r[0] / n_aline_repeat;
+					processed_alines_addr[(b * alines_per_bline_now + x) * roi_size + z][1] = r[1] / n_aline_repeat;
+				}
+			}
+		}
+	}
+	else
+	{
+		// If A-line repeats are left in the frame for B-line processing
+		alines_per_bline_now = alines_per_bline;
+	}
+
+	if (b_rpt_proc_flag > REPEAT_PROCESSING_NONE && n_bline_repeat > 1)
+	{
+		for (int b = 0; b < alines_in_image / alines_per_bline; b++)  // For each B-line in the (potentially A-line averaged) preprocessed frames
+		{
+			for (int x = 0; x < alines_per_bline_now / n_bline_repeat; x++)  // For each element of each B-line (minus repeats)
+			{
+
+				if (b_rpt_proc_flag == REPEAT_PROCESSING_DIFF && n_bline_repeat == 2)
+				{
+					for (int z = 0; z < roi_size; z++)
+					{
+						processed_alines_addr[(b * alines_per_bline_now / 2 + x) * roi_size + z][0] = std::abs(processed_alines_addr[(b * alines_per_bline_now + x) * roi_size + z][0] - processed_alines_addr[(b * alines_per_bline_now + x + alines_per_bline_now / 2) * roi_size + z][0]);
+						processed_alines_addr[(b * alines_per_bline_now / 2 + x) * roi_size + z][1] = std::abs(processed_alines_addr[(b * alines_per_bline_now + x) * roi_size + z][1] - processed_alines_addr[(b * alines_per_bline_now + x + alines_per_bline_now / 2) * roi_size + z][1]);
+					}
+				}
+				else  // REPEAT_PROCESSING_AVERAGING
+				{
+					float norm = 1.0 / n_bline_repeat;
+					for (int z = 0; z < roi_size; z++)
+					{
+						r[0] = 0.0;
+						r[1] = 0.0;
+						for (int k = 0; k < n_bline_repeat; k++)
+						{
+							r[0] += processed_alines_addr[(b * alines_per_bline_now + x + (alines_per_bline_now / n_bline_repeat) * k) * roi_size + z][0];
+							r[1] += processed_alines_addr[(b * alines_per_bline_now + x + (alines_per_bline_now / n_bline_repeat) * k) * roi_size + z][1];
+						}
+						processed_alines_addr[(b * (alines_per_bline_now / n_bline_repeat) + x) * roi_size + z][0] = r[0] * norm;
+						processed_alines_addr[(b * (alines_per_bline_now / n_bline_repeat) + x) * roi_size + z][1] = r[1] * norm;
+					}
+				}
+			}
+		}
+	}
+}
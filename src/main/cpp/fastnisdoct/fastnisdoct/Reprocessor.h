@@ -0,0 +1,278 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <Windows.h>
+#include "fftw3.h"
+#include "AsyncLogger.h"
+#include "AlineProcessingPool.h"
+#include "RepeatProcessing.h"
+#include "CircAcqBuffer.h"
+#include "FileStreamWorker.h"
+#include "RecordingReader.h"
+#include "Packed12.h"
+
+/*
+Offline reprocessing of recorded raw spectra through the live pipeline, without hardware.
+
+Frames of a raw recording (.bin or .b12, see RecordingReader) are processed by an AlineProcessingPool with all cores
+and then by process_repeats(), exactly as they are while scanning, but with the processing parameters given here.
+Each processed frame is written in place into the head of a CircAcqBuffer which a FileStreamWorker streams to disk,
+so that any of the formats and options of a live acquisition can be written.
+
+While the pool processes frame k, the next frame is unpacked if necessary and its background spectrum is taken, and
+the frames after it are prefetched from disk. Unlike during acquisition, no frame is dropped: the producer waits for
+the writer if it is a ring ahead of it.
+*/
+
+#define REPROCESS_RING_FRAMES 16
+#define REPROCESS_PREFETCH_FRAMES 16
+
+
+struct ReprocessingConfig
+{
+	int roi_offset;
+	int roi_size;  // -1 for the rest of the spatial A-line from roi_offset
+	bool subtract_background;  // Subtract the mean spectrum of each frame from its spectra
+	bool interp;
+	double interpdk;
+	const float* apod_window;  // One sample per spectral bin, NULL for none
+	int n_aline_repeat;
+	int n_bline_repeat;
+	RepeatProcessingType a_rpt_proc_flag;
+	RepeatProcessingType b_rpt_proc_flag;
+};
+
+
+class Reprocessor
+{
+private:
+
+	RecordingReader reader;
+	FileStreamWorker<fftwf_complex> streamer;
+	std::unique_ptr<CircAcqBuffer<fftwf_complex>> ring;
+	std::unique_ptr<AlineProcessingPool> pool;
+	std::atomic<int64_t> frames_done;
+
+	int aline_size;
+	int alines_in_image;
+	int64_t preprocessed_alines_size;
+
+	std::unique_ptr<uint16_t[]> unpacked[2];  // Frames unpacked from 12 bits, double buffered
+	uint16_t* src[2];
+	std::vector<float> background[2];
+
+	// Get the k-th frame of the recording and its background spectrum ready for the pool
+	void prepare(int64_t k, int i, bool subtract_background)
+	{
+		const void* frame = reader.frame(k);
+		if (reader.dtype() == RECORDING_DTYPE_PACKED12)
+		{
+			unpack12(frame, preprocessed_alines_size, unpacked[i].get());
+			src[i] = unpacked[i].get();
+		}
+		else
+		{
+			src[i] = (uint16_t*)frame;  // The pool only reads from the source
+		}
+		std::fill(background[i].begin(), background[i].end(), 0.0f);
+		if (subtract_background)
+		{
+			for (int a = 0; a < alines_in_image; a++)
+			{
+				for (int j = 0; j < aline_size; j++)
+				{
+					background[i][j] += src[i][aline_size * a + j];
+				}
+			}
+			float norm = 1.0 / alines_in_image;
+			for (int j = 0; j < aline_size; j++)
+			{
+				background[i][j] *= norm;
+			}
+		}
+		if (k % REPROCESS_PREFETCH_FRAMES == 0)
+		{
+			reader.prefetch(k + REPROCESS_PREFETCH_FRAMES, REPROCESS_PREFETCH_FRAMES);
+		}
+	}
+
+public:
+
+	Reprocessor()
+	{
+		frames_done.store(0);
+		aline_size = 0;
+		alines_in_image = 0;
+		preprocessed_alines_size = 0;
+		src[0] = NULL;
+		src[1] = NULL;
+	}
+
+	// The writer of the processed frames, to configure its format before run()
+	FileStreamWorker<fftwf_complex>& writer()
+	{
+		return streamer;
+	}
+
+	// Frames processed so far by run()
+	int64_t progress()
+	{
+		return frames_done.load();
+	}
+
+	// Reprocess the recording made to in_file, writing the processed frames to out_file. Blocks until every frame has been
+	// written. Returns the number of frames written or -1 if the recording can't be reprocessed
+	int64_t run(const char* in_file, const char* out_file, FileStreamType file_type, float max_gb, const ReprocessingConfig& config)
+	{
+		frames_done.store(0);
+		if (!reader.open(in_file))
+		{
+			return -1;
+		}
+		RecordingDtype dtype = reader.dtype();
+		if (dtype != RECORDING_DTYPE_UINT16 && dtype != RECORDING_DTYPE_PACKED12)
+		{
+			async_printf("fastnisdoct/Reprocessor: %s is not a recording of raw spectra\n", in_file);
+			reader.close();
+			return -1;
+		}
+		const int64_t* shape = reader.shape();
+		aline_size = (int)shape[0];
+		int alines_per_bline = (int)shape[1];
+		alines_in_image = (int)(shape[1] * shape[2]);
+		preprocessed_alines_size = (int64_t)aline_size * alines_in_image;
+		int roi_size = (config.roi_size < 0) ? aline_size / 2 + 1 - config.roi_offset : config.roi_size;
+		if (roi_size < 1 || config.roi_offset < 0 || config.roi_offset + roi_size > aline_size / 2 + 1)
+		{
+			async_printf("fastnisdoct/Reprocessor: ROI of %i voxels from %i is outside of the A-lines of %i voxels\n", roi_size, config.roi_offset, aline_size / 2 + 1);
+			reader.close();
+			return -1;
+		}
+		int n_aline_repeat = (config.n_aline_repeat > 1) ? config.n_aline_repeat : 1;
+		int n_bline_repeat = (config.n_bline_repeat > 1) ? config.n_bline_repeat : 1;
+		if (alines_per_bline % (n_aline_repeat * n_bline_repeat) != 0)
+		{
+			async_printf("fastnisdoct/Reprocessor: B-lines of %i A-lines can't hold %i A-line and %i B-line repeats\n", alines_per_bline, n_aline_repeat, n_bline_repeat);
+			reader.close();
+			return -1;
+		}
+
+		// Frames which are not in the part files, i.e. of a part which could not be mapped, are skipped
+		std::vector<int64_t> frames;
+		for (int64_t k = 0; k < reader.frames(); k++)
+		{
+			if (reader.frame(k) != NULL)
+			{
+				frames.push_back(k);
+			}
+		}
+		if (frames.size() < (size_t)reader.frames())
+		{
+			async_printf("fastnisdoct/Reprocessor: %lli of %lli frames of %s can't be read and are skipped\n", reader.frames() - (int64_t)frames.size(), reader.frames(), in_file);
+		}
+		if (frames.empty())
+		{
+			reader.close();
+			return 0;
+		}
+
+		std::vector<float> apod_window(aline_size, 1.0f);
+		if (config.apod_window != NULL)
+		{
+			std::copy(config.apod_window, config.apod_window + aline_size, apod_window.begin());
+		}
+		for (int i = 0; i < 2; i++)
+		{
+			if (dtype == RECORDING_DTYPE_PACKED12)
+			{
+				unpacked[i] = std::make_unique<uint16_t[]>(preprocessed_alines_size);
+			}
+			background[i].assign(aline_size, 0.0f);
+		}
+
+		int64_t processed_alines_size = (int64_t)roi_size * alines_in_image;
+		pool = std::make_unique<AlineProcessingPool>(aline_size, alines_in_image, config.roi_offset, roi_size, true);
+		pool->start();
+		ring = std::make_unique<CircAcqBuffer<fftwf_complex>>(REPROCESS_RING_FRAMES, processed_alines_size);
+
+		streamer.set_frame_shape(roi_size, alines_per_bline, shape[2]);
+		streamer.set_parameters({
+			{ "aline_size", (double)aline_size },
+			{ "alines_in_image", (double)alines_in_image },
+			{ "alines_per_bline", (double)alines_per_bline },
+			{ "n_aline_repeat", (double)n_aline_repeat },
+			{ "n_bline_repeat", (double)n_bline_repeat },
+			{ "roi_offset", (double)config.roi_offset },
+			{ "roi_size", (double)roi_size },
+			{ "subtract_background", (double)config.subtract_background },
+			{ "interp", (double)config.interp },
+			{ "interpdk", config.interpdk }
+		});
+		streamer.start(out_file, max_gb, file_type, ring.get(), 0, processed_alines_size, (int)frames.size());
+
+		async_printf("fastnisdoct/Reprocessor: Reprocessing %lli frames of %s to %s\n", (int64_t)frames.size(), in_file, out_file);
+		LARGE_INTEGER frequency;
+		LARGE_INTEGER start;
+		LARGE_INTEGER now;
+		QueryPerformanceFrequency(&frequency);
+		QueryPerformanceCounter(&start);
+
+		reader.prefetch(0, REPROCESS_PREFETCH_FRAMES);
+		prepare(frames[0], 0, config.subtract_background);
+		for (size_t f = 0; f < frames.size(); f++)
+		{
+			int i = f % 2;
+
+			// Frames are never dropped: wait until the writer has borrowed the frame which is about to be overwritten
+			while (streamer.is_streaming() && ring->get_count() + 1 - streamer.next_frame() >= ring->get_size())
+			{
+				Sleep(1);
+			}
+			fftwf_complex* dst = ring->lock_out_head();
+			while (dst == NULL && streamer.is_streaming())
+			{
+				Sleep(1);
+				dst = ring->lock_out_head();
+			}
+			if (dst == NULL)
+			{
+				async_printf("fastnisdoct/Reprocessor: Writer stopped after %lli frames\n", frames_done.load());
+				break;
+			}
+
+			pool->submit(dst, src[i], config.interp, config.interpdk, apod_window.data(), background[i].data());
+			if (f + 1 < frames.size())
+			{
+				prepare(frames[f + 1], 1 - i, config.subtract_background);  // While the pool is busy
+			}
+			pool->join();
+			process_repeats(dst, roi_size, alines_in_image, alines_per_bline, n_aline_repeat, n_bline_repeat, config.a_rpt_proc_flag, config.b_rpt_proc_flag);
+			ring->release_head();
+			frames_done.store(f + 1);
+
+			if ((f + 1) % 256 == 0)
+			{
+				QueryPerformanceCounter(&now);
+				double elapsed = (double)(now.QuadPart - start.QuadPart) / frequency.QuadPart;
+				async_printf("fastnisdoct/Reprocessor: Processed %lli of %lli frames, %f Hz\n", (int64_t)(f + 1), (int64_t)frames.size(), (f + 1) / elapsed);
+			}
+		}
+
+		while (streamer.is_streaming())  // Until the writer has written the last frame
+		{
+			Sleep(IDLE_SLEEP_MS);
+		}
+		streamer.stop();
+		pool->terminate();
+		pool.reset();
+		ring.reset();
+		reader.close();
+		QueryPerformanceCounter(&now);
+		async_printf("fastnisdoct/Reprocessor: Reprocessed %lli frames in %f s\n", frames_done.load(), (double)(now.QuadPart - start.QuadPart) / frequency.QuadPart);
+		return frames_done.load();
+	}
+
+};
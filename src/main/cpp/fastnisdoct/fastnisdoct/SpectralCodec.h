@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+/*
+Lossless codec for frames of raw uint16 spectra.
+
+Each spectrum is delta coded from the sample before it, starting from 0 at the first sample of each A-line, so that
+A-lines can be decoded independently. The smooth spectral shape makes the deltas small. Deltas are taken modulo 2^16
+and zigzag coded so that small negative deltas are small too. The coded samples are then bit packed in blocks of
+CODEC_BLOCK at the fewest bits which hold the largest in the block, which is a byte which precedes the block.
+
+12-bit spectra typically compress 2-3 times. Incompressible data cost 1 byte per block more than the raw samples.
+*/
+
+#define CODEC_BLOCK 64
+
+
+// Largest number of bytes n samples encode to
+inline size_t codec_bound(size_t n)
+{
+	return ((n + CODEC_BLOCK - 1) / CODEC_BLOCK) * (1 + CODEC_BLOCK * sizeof(uint16_t));
+}
+
+
+inline int codec_bit_width(uint16_t v)
+{
+	int b = 0;
+	while (v != 0)
+	{
+		b++;
+		v >>= 1;
+	}
+	return b;
+}
+
+
+// Encode the n samples of in, in A-lines of line samples, into out. Returns the number of bytes written
+inline size_t codec_encode(const uint16_t* in, size_t n, size_t line, uint8_t* out)
+{
+	uint16_t coded[CODEC_BLOCK];
+	uint8_t* p = out;
+	for (size_t b0 = 0; b0 < n; b0 += CODEC_BLOCK)
+	{
+		size_t m = (b0 + CODEC_BLOCK < n) ? CODEC_BLOCK : n - b0;
+		uint16_t any = 0;
+		for (size_t i = 0; i < m; i++)
+		{
+			size_t k = b0 + i;
+			uint16_t prev = (k % line == 0) ? 0 : in[k - 1];
+			int16_t d = (int16_t)(uint16_t)(in[k] - prev);
+			coded[i] = (uint16_t)((uint16_t)d << 1) ^ (uint16_t)(d >> 15);  // Zigzag, without shifting a negative d left
+			any |= coded[i];
+		}
+		int width = codec_bit_width(any);
+		*p++ = (uint8_t)width;
+		uint64_t acc = 0;
+		int bits = 0;
+		for (size_t i = 0; i < m; i++)
+		{
+			acc |= (uint64_t)coded[i] << bits;
+			bits += width;
+			while (bits >= 8)
+			{
+				*p++ = (uint8_t)acc;
+				acc >>= 8;
+				bits -= 8;
+			}
+		}
+		if (bits > 0)
+		{
+			*p++ = (uint8_t)acc;
+		}
+	}
+	return p - out;
+}
+
+
+// Decode n samples in A-lines of line samples from in into out. Returns the number of bytes read
+inline size_t codec_decode(const uint8_t* in, size_t n, size_t line, uint16_t* out)
+{
+	const uint8_t* p = in;
+	for (size_t b0 = 0; b0 < n; b0 += CODEC_BLOCK)
+	{
+		size_t m = (b0 + CODEC_BLOCK < n) ? CODEC_BLOCK : n - b0;
+		int width = *p++;
+		uint64_t mask = (1ull << width) - 1;
+		uint64_t acc = 0;
+		int bits = 0;
+		for (size_t i = 0; i < m; i++)
+		{
+			while (bits < width)
+			{
+				acc |= (uint64_t)(*p++) << bits;
+				bits += 8;
+			}
+			uint16_t z = (uint16_t)(acc & mask);
+			acc >>= width;
+			bits -= width;
+			size_t k = b0 + i;
+			uint16_t prev = (k % line == 0) ? 0 : out[k - 1];
+			out[k] = (uint16_t)(prev + (uint16_t)((z >> 1) ^ (uint16_t)-(int16_t)(z & 1)));
+		}
+		bits = 0;  // The block's padding bits
+		acc = 0;
+	}
+	return p - in;
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <memory>
+#include <cmath>
+#include <cstring>
+#include <cfloat>
+#include "fftw3.h"
+
+/*
+Per-frame spectrometer health metrics: saturated pixels per A-line, the mean and max raw spectrum and an
+estimate of the noise floor and SNR of the processed A-lines.
+
+The raw spectra are accumulated by the A-line processing kernel while it converts them to float, and the
+noise estimate is taken from each worker's processed A-lines while they are still in its cache, so the
+metrics cost no extra pass over the frame. Like DisplayProducts, workers write to per-worker partials which
+are combined by finish().
+
+The noise floor is the mean power of the deepest SPECTROMETER_STATS_NOISE_FRACTION of the axial ROI, where
+there is assumed to be no sample. The SNR is the mean peak power of the A-lines over the noise floor.
+*/
+
+#define SPECTROMETER_STATS_NOISE_FRACTION 0.1
+#define SPECTROMETER_STATS_SUMMARY_SIZE 5  // Number of floats written by summary()
+#define DEFAULT_SATURATION_LEVEL 4095  // 12-bit line camera
+
+
+class SpectrometerStats
+{
+private:
+
+	std::unique_ptr<double[]> sum_partials;  // One A-line sized buffer per worker
+	std::unique_ptr<uint16_t[]> max_partials;  // One A-line sized buffer per worker
+	std::unique_ptr<double[]> noise_partials;  // Sum of noise floor power per worker
+	std::unique_ptr<double[]> peak_partials;  // Sum of peak power per worker
+
+	int noise_offset;  // Start of the noise region in the ROI
+	int noise_size;
+
+public:
+
+	int aline_size;
+	int64_t number_of_alines;
+	int roi_size;
+	int number_of_workers;
+	uint16_t saturation_level;  // Pixels with at least this value are counted as saturated
+
+	int64_t frame_number;  // Number of the frame the metrics were taken from
+	std::unique_ptr<float[]> mean_spectrum;
+	std::unique_ptr<float[]> max_spectrum;
+	std::unique_ptr<int32_t[]> saturated;  // Saturated pixel count of each A-line in the frame
+	int64_t saturated_pixels;
+	int64_t saturated_alines;
+	float noise_floor_db;
+	float peak_db;
+	float snr_db;
+
+	SpectrometerStats(int aline_size, int64_t number_of_alines, int roi_size, int number_of_workers)
+	{
+		this->aline_size = aline_size;
+		this->number_of_alines = number_of_alines;
+		this->roi_size = roi_size;
+		this->number_of_workers = number_of_workers;
+		saturation_level = DEFAULT_SATURATION_LEVEL;
+
+		noise_size = (int)(roi_size * SPECTROMETER_STATS_NOISE_FRACTION);
+		noise_size = (noise_size < 1) ? 1 : noise_size;
+		noise_offset = roi_size - noise_size;
+
+		sum_partials = std::make_unique<double[]>((int64_t)aline_size * number_of_workers);
+		max_partials = std::make_unique<uint16_t[]>((int64_t)aline_size * number_of_workers);
+		noise_partials = std::make_unique<double[]>(number_of_workers);
+		peak_partials = std::make_unique<double[]>(number_of_workers);
+		mean_spectrum = std::make_unique<float[]>(aline_size);
+		max_spectrum = std::make_unique<float[]>(aline_size);
+		saturated = std::make_unique<int32_t[]>(number_of_alines);
+
+		memset(mean_spectrum.get(), 0, aline_size * sizeof(float));
+		memset(max_spectrum.get(), 0, aline_size * sizeof(float));
+		memset(saturated.get(), 0, number_of_alines * sizeof(int32_t));
+		frame_number = -1;
+		saturated_pixels = 0;
+		saturated_alines = 0;
+		noise_floor_db = 0.0;
+		peak_db = 0.0;
+		snr_db = 0.0;
+	}
+
+	// Called before the frame's A-lines are accumulated
+	void begin_frame(uint16_t saturation_level)
+	{
+		this->saturation_level = saturation_level;
+		memset(sum_partials.get(), 0, (int64_t)aline_size * number_of_workers * sizeof(double));
+		memset(max_partials.get(), 0, (int64_t)aline_size * number_of_workers * sizeof(uint16_t));
+		memset(noise_partials.get(), 0, number_of_workers * sizeof(double));
+		memset(peak_partials.get(), 0, number_of_workers * sizeof(double));
+	}
+
+	// Partials written to by the processing kernel as it converts raw spectra
+	inline double* spectrum_sum(int worker)
+	{
+		return sum_partials.get() + (int64_t)aline_size * worker;
+	}
+
+	inline uint16_t* spectrum_max(int worker)
+	{
+		return max_partials.get() + (int64_t)aline_size * worker;
+	}
+
+	// Accumulate the noise floor and peak of n_alines processed A-lines
+	void accumulate_processed(const fftwf_complex* alines, int64_t n_alines, int worker)
+	{
+		double noise = 0.0;
+		double peak = 0.0;
+		for (int64_t i = 0; i < n_alines; i++)
+		{
+			const fftwf_complex* v = alines + i * roi_size;
+			float p_max = 0.0;
+			for (int z = 0; z < roi_size; z++)
+			{
+				float p = v[z][0] * v[z][0] + v[z][1] * v[z][1];
+				p_max = (p > p_max) ? p : p_max;
+			}
+			float p_noise = 0.0;
+			for (int z = noise_offset; z < roi_size; z++)
+			{
+				p_noise += v[z][0] * v[z][0] + v[z][1] * v[z][1];
+			}
+			noise += p_noise / noise_size;
+			peak += p_max;
+		}
+		noise_partials[worker] += noise;
+		peak_partials[worker] += peak;
+	}
+
+	// Combine worker partials. Called once all A-lines of the frame have been accumulated.
+	void finish(int64_t frame_number)
+	{
+		this->frame_number = frame_number;
+		double noise = 0.0;
+		double peak = 0.0;
+		for (int j = 0; j < aline_size; j++)
+		{
+			double s = 0.0;
+			uint16_t m = 0;
+			for (int w = 0; w < number_of_workers; w++)
+			{
+				s += sum_partials[(int64_t)aline_size * w + j];
+				m = (max_partials[(int64_t)aline_size * w + j] > m) ? max_partials[(int64_t)aline_size * w + j] : m;
+			}
+			mean_spectrum[j] = (float)(s / number_of_alines);
+			max_spectrum[j] = m;
+		}
+		for (int w = 0; w < number_of_workers; w++)
+		{
+			noise += noise_partials[w];
+			peak += peak_partials[w];
+		}
+		saturated_pixels = 0;
+		saturated_alines = 0;
+		for (int64_t i = 0; i < number_of_alines; i++)
+		{
+			saturated_pixels += saturated[i];
+			saturated_alines += (saturated[i] > 0);
+		}
+		noise /= number_of_alines;
+		peak /= number_of_alines;
+		noise_floor_db = 10 * log10((noise > DBL_MIN) ? noise : DBL_MIN);
+		peak_db = 10 * log10((peak > DBL_MIN) ? peak : DBL_MIN);
+		snr_db = peak_db - noise_floor_db;
+	}
+
+	// [saturated pixels, fraction of A-lines with saturated pixels, noise floor (dB), mean peak (dB), SNR (dB)]
+	void summary(float* dst)
+	{
+		dst[0] = (float)saturated_pixels;
+		dst[1] = (float)saturated_alines / number_of_alines;
+		dst[2] = noise_floor_db;
+		dst[3] = peak_db;
+		dst[4] = snr_db;
+	}
+
+};
@@ -0,0 +1,275 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <Windows.h>
+#include "AsyncLogger.h"
+#include "CircAcqBuffer.h"
+
+/*
+Second tier of a CircAcqBuffer for a single consumer, backed by a memory-mapped file on a fast local disk, so
+that bursts which outpace the consumer by more than the ring can hold are kept rather than overwritten.
+
+A background thread follows the ring. Once the consumer has fallen more than half the ring behind the
+producer, the thread demotes each frame the consumer has not yet read to a slot of the file mapping, before
+the producer comes around to overwrite it. The consumer borrows frames through the tier, which finds them in
+the file if they have been demoted and in the ring otherwise. Ahead of the consumer, the thread promotes the
+next spilled frames back into memory with PrefetchVirtualMemory.
+
+A spill slot is reused only once the consumer has released the frame in it. If the spill is full, frames are
+overwritten in the ring as they would be without it and are counted as lost.
+
+The file is created with FILE_FLAG_DELETE_ON_CLOSE and is removed when the tier is destroyed.
+*/
+
+#define SPILL_PROMOTE_AHEAD 4  // Frames to prefetch ahead of the consumer
+#define SPILL_IDLE_SLEEP_MS 1
+
+
+template <class T>
+class SpillTier
+{
+private:
+
+	CircAcqBuffer<T>* ram;
+	HANDLE file;
+	HANDLE mapping;
+	char* view;
+	int slots;
+	size_t slot_bytes;
+	size_t element_bytes;
+	std::unique_ptr<std::atomic<int64_t>[]> counts;  // Count of the frame in each slot, -1 if empty or being written
+
+	std::atomic<int64_t> consumed;  // Count of the next frame the consumer wants. Frames before it are no longer needed
+	std::atomic<int64_t> last;  // Demote no frames after this count
+	int64_t demoted;  // Count of the next frame to demote. Background thread only
+	int64_t promoted;  // Count up to which frames have been prefetched. Background thread only
+	std::atomic<int64_t> spilled;
+	std::atomic<int64_t> lost;
+
+	std::thread thread;
+	std::atomic_bool running;
+
+	inline int slot_of(int64_t n)
+	{
+		return (int)(n % slots);
+	}
+
+	inline T* slot_addr(int i)
+	{
+		return (T*)(view + i * slot_bytes);
+	}
+
+	inline bool holds(int64_t n)
+	{
+		return counts[slot_of(n)].load() == n;
+	}
+
+	void promote(int64_t c)
+	{
+		WIN32_MEMORY_RANGE_ENTRY ranges[SPILL_PROMOTE_AHEAD];
+		ULONG n = 0;
+		int64_t first = (promoted > c) ? promoted : c;
+		for (int64_t k = first; k < c + SPILL_PROMOTE_AHEAD && k < demoted; k++)
+		{
+			if (holds(k))
+			{
+				ranges[n].VirtualAddress = slot_addr(slot_of(k));
+				ranges[n].NumberOfBytes = element_bytes;
+				n++;
+			}
+			promoted = k + 1;
+		}
+		if (n > 0)
+		{
+			PrefetchVirtualMemory(GetCurrentProcess(), n, ranges, 0);
+		}
+	}
+
+	void _demote()
+	{
+		TRACE_THREAD_NAME("spill");
+		int threshold = ram->get_size() / 2;
+		CircAcqBorrow<T> borrowed;
+		while (running.load())
+		{
+			int64_t c = consumed.load();
+			promote(c);
+			int64_t next = (demoted > c) ? demoted : c;
+			if (next > last.load() || ram->get_count() - next < threshold)
+			{
+				Sleep(SPILL_IDLE_SLEEP_MS);
+				continue;
+			}
+			int i = slot_of(next);
+			if (counts[i].load() >= c)  // Still holds a frame the consumer has not read
+			{
+				async_printf_every(LOG_PERIOD_MS, "fastnisdoct/SpillTier: Spill is full. Frames will be lost.\n");
+				Sleep(SPILL_IDLE_SLEEP_MS);
+				continue;
+			}
+			int64_t got = ram->borrow(next, &borrowed, 0);
+			if (got == -1)
+			{
+				continue;
+			}
+			if (got == next)
+			{
+				TRACE_SCOPE_N("spill demote", next);
+				counts[i].store(-1);
+				memcpy(slot_addr(i), borrowed.arr, element_bytes);
+				counts[i].store(next);
+				spilled.fetch_add(1);
+				demoted = next + 1;
+			}
+			else  // Overwritten before it could be demoted
+			{
+				lost.fetch_add(got - next);
+				demoted = got;
+			}
+			ram->release(&borrowed);
+		}
+	}
+
+public:
+
+	// Map a spill of n_frames frames of frame_size elements of buffer to a file created at path
+	SpillTier(const char* path, int n_frames, CircAcqBuffer<T>* buffer, uint64_t frame_size)
+	{
+		ram = buffer;
+		slots = n_frames;
+		element_bytes = frame_size * sizeof(T);
+		slot_bytes = arena_round_up(element_bytes, ARENA_ALIGNMENT);
+		view = NULL;
+		mapping = NULL;
+		running.store(false);
+		spilled.store(0);
+		lost.store(0);
+		counts = std::make_unique<std::atomic<int64_t>[]>(slots);
+		for (int i = 0; i < slots; i++)
+		{
+			counts[i].store(-1);
+		}
+		file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			async_printf("fastnisdoct/SpillTier: Failed to create spill file %s\n", path);
+			return;
+		}
+		uint64_t size = (uint64_t)slot_bytes * slots;
+		mapping = CreateFileMapping(file, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)(size & 0xFFFFFFFF), NULL);
+		if (mapping != NULL)
+		{
+			view = (char*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+		}
+		if (view == NULL)
+		{
+			async_printf("fastnisdoct/SpillTier: Failed to map %llu byte spill file %s\n", (unsigned long long)size, path);
+			return;
+		}
+		async_printf("fastnisdoct/SpillTier: Mapped %i frame spill to %s\n", slots, path);
+	}
+
+	bool is_open()
+	{
+		return view != NULL;
+	}
+
+	// Begin demoting frames for a consumer which will read from count first onward
+	void start(int64_t first)
+	{
+		consumed.store(first);
+		last.store(INT64_MAX);
+		demoted = first;
+		promoted = first;
+		running.store(true);
+		thread = std::thread(&SpillTier::_demote, this);
+	}
+
+	// Demote no frames after count n, i.e. once the producer has been stopped
+	void set_last(int64_t n)
+	{
+		last.store(n);
+	}
+
+	void stop()
+	{
+		if (running.load())
+		{
+			running.store(false);
+			thread.join();
+		}
+	}
+
+	// Borrow the n-th frame from the spill or the ring, or the next frame after it which is available. Returns the
+	// count of the borrowed frame or -1 if timed out.
+	int64_t borrow(int64_t n, CircAcqBorrow<T>* borrowed, int timeout_ms)
+	{
+		if (holds(n))
+		{
+			borrowed->arr = slot_addr(slot_of(n));
+			borrowed->count = n;
+			borrowed->element = NULL;
+			return n;
+		}
+		int64_t got = ram->borrow(n, borrowed, timeout_ms);
+		for (int64_t k = n; k < got; k++)  // Overwritten in the ring. Demoted in the meantime?
+		{
+			if (holds(k))
+			{
+				ram->release(borrowed);
+				borrowed->arr = slot_addr(slot_of(k));
+				borrowed->count = k;
+				borrowed->element = NULL;
+				return k;
+			}
+		}
+		return got;
+	}
+
+	// Return a frame to the spill or the ring. The consumer no longer needs frames before it
+	void release(CircAcqBorrow<T>* borrowed)
+	{
+		int64_t c = borrowed->count + 1;
+		if (borrowed->element != NULL)
+		{
+			ram->release(borrowed);
+		}
+		borrowed->arr = NULL;
+		if (c > consumed.load())
+		{
+			consumed.store(c);
+		}
+	}
+
+	int64_t get_spilled()
+	{
+		return spilled.load();
+	}
+
+	int64_t get_lost()
+	{
+		return lost.load();
+	}
+
+	~SpillTier()
+	{
+		stop();
+		if (view != NULL)
+		{
+			UnmapViewOfFile(view);
+		}
+		if (mapping != NULL)
+		{
+			CloseHandle(mapping);
+		}
+		if (file != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(file);
+		}
+	}
+
+};
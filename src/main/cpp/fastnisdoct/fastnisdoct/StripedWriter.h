@@ -0,0 +1,336 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <string>
+#include <vector>
+#include <Windows.h>
+#include "spscqueue.h"
+#include "AsyncLogger.h"
+#include "TraceRecorder.h"
+#include "Writer.h"
+
+/*
+Writer which stripes consecutive frames round-robin across files in several directories, ideally each on its own
+disk, so that recording throughput scales with the number of disks.
+
+Each stripe has its own thread and UnbufferedWriter, fed through an SPSC queue. Frames are dealt to the stripes in
+turn, continuing from one file to the next, so frame i since the writer was constructed is written by stripe i % N
+at next_offset() in the stripe's file. As the FileStreamWorker writes each part with a new writer, frame j of a part
+is written by stripe j % N. The stripe files are named after the file with _s<stripe> before its suffix, and an
+index is written alongside the file, with the suffix .stripes, listing the stripe files followed by the stripe and
+byte offset of each frame.
+
+Like the UnbufferedWriter, frames are written in place, so a frame's memory must remain valid until it is no longer
+pending(). A frame is pending until it and every frame written before it have been written. No more than
+STRIPE_MAX_PENDING frames are pending across all of the stripes, as the ring has no more spares than that.
+*/
+
+#define STRIPE_QUEUE_SIZE 16  // Must be a power of 2
+#define STRIPE_MAX_PENDING UNBUFFERED_QUEUE_DEPTH
+
+
+enum StripeJobType
+{
+	STRIPE_JOB_OPEN = 0,
+	STRIPE_JOB_WRITE = 1,
+	STRIPE_JOB_CLOSE = 2,
+	STRIPE_JOB_PREALLOCATE = 3
+};
+
+
+struct StripeJob
+{
+	StripeJobType type;
+	void* frame;
+	long frame_size;
+	int64_t bytes;  // To preallocate
+};
+
+
+struct Stripe
+{
+	std::string directory;
+	std::unique_ptr<UnbufferedWriter> writer;
+	std::unique_ptr<spsc_bounded_queue_t<StripeJob>> queue;
+	char file_name[MAX_PATH];  // Of the stripe's file, set before a STRIPE_JOB_OPEN is enqueued
+	HANDLE wake;  // Set when a job is enqueued
+	std::thread thread;
+	std::atomic<int64_t> jobs_submitted;
+	std::atomic<int64_t> jobs_done;
+	std::atomic<int64_t> frames_completed;  // Frames the stripe has finished writing
+	uint64_t bytes_written;  // Offset of the next frame in the stripe's file. Producer only
+};
+
+
+class StripedWriter : public Writer
+{
+private:
+
+	std::vector<std::unique_ptr<Stripe>> stripes;
+	std::atomic_bool running;
+	HANDLE progress;  // Set by a stripe when it has done a job or completed a frame
+	int64_t frames_submitted;  // Since the writer was constructed. Frame i is written by stripe i % N
+	int64_t frames_in_file;
+	bool opened;
+	FILE* index;
+	char name[MAX_PATH];
+
+	void _stripe(Stripe* stripe)
+	{
+		TRACE_THREAD_NAME("stripe");
+		int64_t frames_written = 0;  // Frames submitted to the stripe's writer
+		StripeJob job;
+		while (running.load() || stripe->jobs_done.load() < stripe->jobs_submitted.load())
+		{
+			if (stripe->queue->dequeue(job))
+			{
+				if (job.type == STRIPE_JOB_OPEN)
+				{
+					stripe->writer->open(stripe->file_name);
+				}
+				else if (job.type == STRIPE_JOB_WRITE)
+				{
+					TRACE_SCOPE("stripe write");
+					stripe->writer->writeFrame(job.frame, job.frame_size);
+					frames_written++;
+				}
+				else if (job.type == STRIPE_JOB_PREALLOCATE)
+				{
+					stripe->writer->preallocate(job.bytes);
+				}
+				else
+				{
+					stripe->writer->close();
+				}
+				stripe->frames_completed.store(frames_written - stripe->writer->pending());
+				stripe->jobs_done.fetch_add(1);
+				SetEvent(progress);
+			}
+			else
+			{
+				WaitForSingleObject(stripe->wake, 1);  // Poll writes in flight every ms
+				int64_t completed = frames_written - stripe->writer->pending();
+				if (stripe->frames_completed.exchange(completed) != completed)
+				{
+					SetEvent(progress);
+				}
+			}
+		}
+	}
+
+	void submit(Stripe* stripe, StripeJob* job)
+	{
+		while (!stripe->queue->enqueue(*job))  // Until the stripe has done a job
+		{
+			SetEvent(stripe->wake);
+			WaitForSingleObject(progress, INFINITE);
+		}
+		stripe->jobs_submitted.fetch_add(1);
+		SetEvent(stripe->wake);
+	}
+
+	void wait_for_jobs()
+	{
+		for (auto& stripe : stripes)
+		{
+			while (stripe->jobs_done.load() < stripe->jobs_submitted.load())
+			{
+				WaitForSingleObject(progress, INFINITE);
+			}
+		}
+	}
+
+	// Name of the stripe's file: the directory, then the file's name with _s<stripe> before its suffix
+	static void stripe_file_name(char* dst, const std::string& directory, const char* name, int s)
+	{
+		const char* base = name;
+		for (const char* p = name; *p != '\0'; p++)
+		{
+			if (*p == '\\' || *p == '/')
+			{
+				base = p + 1;
+			}
+		}
+		const char* suffix = strrchr(base, '.');
+		int stem_length = (suffix != NULL) ? (int)(suffix - base) : (int)strlen(base);
+		sprintf_s(dst, MAX_PATH, "%s\\%.*s_s%02d%s", directory.c_str(), stem_length, base, s, (suffix != NULL) ? suffix : "");
+	}
+
+public:
+
+	StripedWriter(const std::vector<std::string>& directories)
+	{
+		running.store(true);
+		progress = CreateEvent(NULL, FALSE, FALSE, NULL);
+		frames_submitted = 0;
+		frames_in_file = 0;
+		opened = false;
+		index = NULL;
+		for (auto& directory : directories)
+		{
+			Stripe* stripe = new Stripe;
+			stripe->directory = directory;
+			stripe->writer = std::make_unique<UnbufferedWriter>();
+			stripe->queue = std::make_unique<spsc_bounded_queue_t<StripeJob>>(STRIPE_QUEUE_SIZE);
+			stripe->wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+			stripe->jobs_submitted.store(0);
+			stripe->jobs_done.store(0);
+			stripe->frames_completed.store(0);
+			stripe->bytes_written = 0;
+			stripes.emplace_back(stripe);
+		}
+		for (auto& stripe : stripes)
+		{
+			stripe->thread = std::thread(&StripedWriter::_stripe, this, stripe.get());
+		}
+	}
+
+	~StripedWriter()
+	{
+		close();
+		running.store(false);
+		for (auto& stripe : stripes)
+		{
+			SetEvent(stripe->wake);
+			stripe->thread.join();
+			CloseHandle(stripe->wake);
+		}
+		CloseHandle(progress);
+	}
+
+	void open(const char* name) override
+	{
+		strcpy_s(this->name, MAX_PATH, name);
+		char index_name[MAX_PATH];
+		sprintf_s(index_name, "%s.stripes", name);
+		index = fopen(index_name, "w");
+		if (index == NULL)
+		{
+			async_printf("fastnisdoct/StripedWriter: Failed to open index %s\n", index_name);
+		}
+		else
+		{
+			fprintf(index, "# fastnisdoct striped recording\nstripes %i\n", (int)stripes.size());
+		}
+		StripeJob job;
+		job.type = STRIPE_JOB_OPEN;
+		for (int s = 0; s < stripes.size(); s++)
+		{
+			stripe_file_name(stripes[s]->file_name, stripes[s]->directory, name, s);
+			if (index != NULL)
+			{
+				fprintf(index, "stripe %i %s\n", s, stripes[s]->file_name);
+			}
+			stripes[s]->bytes_written = 0;
+			submit(stripes[s].get(), &job);
+		}
+		if (index != NULL)
+		{
+			fprintf(index, "# frame stripe offset\n");
+		}
+		frames_in_file = 0;
+		opened = true;
+	}
+
+	bool is_open() override
+	{
+		return opened;
+	}
+
+	// Each stripe holds its share of the bytes
+	void preallocate(int64_t bytes) override
+	{
+		StripeJob job;
+		job.type = STRIPE_JOB_PREALLOCATE;
+		job.bytes = bytes / (int64_t)stripes.size() + 1;
+		for (auto& stripe : stripes)
+		{
+			submit(stripe.get(), &job);
+		}
+	}
+
+	void writeFrame(void* f, long frame_size) override
+	{
+		int n = (int)stripes.size();
+		wait_pending(STRIPE_MAX_PENDING - 1);  // Bound the frames held by the stripes
+		int s = (int)(frames_submitted % n);
+		Stripe* stripe = stripes[s].get();
+		if (index != NULL)
+		{
+			fprintf(index, "%lli %i %llu\n", frames_in_file, s, (unsigned long long)stripe->bytes_written);
+		}
+		StripeJob job;
+		job.type = STRIPE_JOB_WRITE;
+		job.frame = f;
+		job.frame_size = frame_size;
+		submit(stripe, &job);
+		stripe->bytes_written += frame_size;
+		frames_submitted++;
+		frames_in_file++;
+	}
+
+	// Offset of the next frame in the file of the stripe which will write it
+	int64_t next_offset() override
+	{
+		return (int64_t)stripes[frames_submitted % stripes.size()]->bytes_written;
+	}
+
+	int pending() override
+	{
+		// The oldest frame which has not been written is the first of those each stripe has yet to complete
+		int n = (int)stripes.size();
+		int64_t oldest = frames_submitted;
+		for (int s = 0; s < n; s++)
+		{
+			int64_t first_incomplete = stripes[s]->frames_completed.load() * n + s;
+			oldest = (first_incomplete < oldest) ? first_incomplete : oldest;
+		}
+		return (int)(frames_submitted - oldest);
+	}
+
+	void wait_pending(int n) override
+	{
+		while (pending() > n)
+		{
+			WaitForSingleObject(progress, INFINITE);  // Set when a stripe completes a frame
+		}
+	}
+
+	void close() override
+	{
+		if (!opened)
+		{
+			return;
+		}
+		StripeJob job;
+		job.type = STRIPE_JOB_CLOSE;
+		for (auto& stripe : stripes)
+		{
+			submit(stripe.get(), &job);
+		}
+		wait_for_jobs();
+		if (index != NULL)
+		{
+			fclose(index);
+			index = NULL;
+		}
+		if (frames_in_file == 0)  // i.e. a part opened ahead which was not needed
+		{
+			char file_name[MAX_PATH];
+			for (int s = 0; s < stripes.size(); s++)
+			{
+				stripe_file_name(file_name, stripes[s]->directory, name, s);
+				DeleteFileA(file_name);
+			}
+			sprintf_s(file_name, "%s.stripes", name);
+			DeleteFileA(file_name);
+		}
+		opened = false;
+	}
+
+};
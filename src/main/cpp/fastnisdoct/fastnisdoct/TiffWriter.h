@@ -0,0 +1,339 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <memory>
+#include <Windows.h>
+#include "fftw3.h"
+#include "AsyncLogger.h"
+#include "TraceRecorder.h"
+#include "LargePageArena.h"
+#include "Writer.h"
+
+/*
+Writer of BigTIFF files [1] with each B-scan of a frame as a page, which Fiji and other readers open as a stack
+without loading the whole file.
+
+Frames are in FORTRAN order [z, x, y], so each B-scan is transposed into a page of width x and height z, with depth
+down the page, and converted to the sample format as it is transposed, in one pass. Complex frames are log-scaled to
+dB: float32 pages hold the dB values and uint8 and uint16 pages span a configured range of dB. Spectral frames are
+written as uint16 or are converted to the other formats directly, with uint8 pages spanning the TIFF_SPECTRUM_BITS
+significant bits of the spectra.
+
+The pages are uncompressed single strips of equal size, so the location of every page is known in advance. The IFDs
+of TIFF_IFD_BLOCK_PAGES pages at a time, rounded up to whole frames, are written in one block ahead of the pages they
+describe, already chained to one another and to the block which will follow. When the file is closed, the IFD of the
+last page written is patched to end the chain, so a file closed after an aborted acquisition is valid.
+
+Pages are written in place through an UnbufferedWriter from a ring of buffers, so frames are not pending once they
+have been transposed. The header, each block of IFDs and the pages of each frame are padded to ARENA_ALIGNMENT, so
+that every write begins on a sector and none is copied again to be staged.
+
+[1] https://www.awaresystems.be/imaging/tiff/bigtiff.html
+*/
+
+#define TIFF_IFD_BLOCK_PAGES 256
+#define TIFF_TAGS 10
+#define TIFF_HEADER_SIZE ARENA_ALIGNMENT  // 16 bytes, padded so that the first IFD block begins on a sector
+#define TIFF_IFD_SIZE (8 + TIFF_TAGS * 20 + 8)  // Count, tags, next IFD offset
+#define TIFF_RING_SIZE (UNBUFFERED_QUEUE_DEPTH + 1)  // A buffer is reused once its write cannot be in flight
+#define TIFF_TRANSPOSE_TILE 32
+#define TIFF_SPECTRUM_BITS 12  // Significant bits of the spectra of the line camera
+
+
+enum TiffFieldType
+{
+	TIFF_SHORT = 3,
+	TIFF_LONG = 4,
+	TIFF_LONG8 = 16
+};
+
+
+// Range of dB spanned by integer pages of log-scaled complex frames, and bits of spectra spanned by uint8 pages
+struct TiffScale
+{
+	float db_min;
+	float db_max;
+	int spectrum_shift;  // Significant bits of the spectra less 8
+};
+
+
+inline void tiff_convert(const uint16_t& in, uint16_t* out, const TiffScale& scale)
+{
+	*out = in;
+}
+
+inline void tiff_convert(const uint16_t& in, uint8_t* out, const TiffScale& scale)
+{
+	uint16_t v = in >> scale.spectrum_shift;
+	*out = (uint8_t)((v > 255) ? 255 : v);  // Saturate samples beyond the significant bits
+}
+
+inline void tiff_convert(const uint16_t& in, float* out, const TiffScale& scale)
+{
+	*out = (float)in;
+}
+
+inline void tiff_convert(const fftwf_complex& in, float* out, const TiffScale& scale)
+{
+	*out = 10.0f * log10f(in[0] * in[0] + in[1] * in[1]);
+}
+
+template <class U>
+inline void tiff_convert(const fftwf_complex& in, U* out, const TiffScale& scale)
+{
+	const float top = (float)(U)~(U)0;
+	float db = 10.0f * log10f(in[0] * in[0] + in[1] * in[1]);
+	float v = (db - scale.db_min) / (scale.db_max - scale.db_min) * top;
+	*out = (U)((v < 0.0f) ? 0.0f : ((v > top) ? top : v + 0.5f));
+}
+
+
+// Transpose each B-scan of the FORTRAN order [z, x, y] frame in into a row-major page of height z and width x
+template <class T, class U>
+void tiff_transpose(const T* in, U* out, int64_t z, int64_t x, int64_t y, const TiffScale& scale)
+{
+	for (int64_t k = 0; k < y; k++)
+	{
+		const T* src = in + k * z * x;
+		U* dst = out + k * z * x;
+		for (int64_t x0 = 0; x0 < x; x0 += TIFF_TRANSPOSE_TILE)
+		{
+			int64_t x1 = (x0 + TIFF_TRANSPOSE_TILE < x) ? x0 + TIFF_TRANSPOSE_TILE : x;
+			for (int64_t z0 = 0; z0 < z; z0 += TIFF_TRANSPOSE_TILE)
+			{
+				int64_t z1 = (z0 + TIFF_TRANSPOSE_TILE < z) ? z0 + TIFF_TRANSPOSE_TILE : z;
+				for (int64_t i = x0; i < x1; i++)
+				{
+					for (int64_t j = z0; j < z1; j++)
+					{
+						tiff_convert(src[i * z + j], &dst[j * x + i], scale);
+					}
+				}
+			}
+		}
+	}
+}
+
+
+template <class T>
+class TiffWriter : public Writer
+{
+private:
+
+	UnbufferedWriter writer;
+	char name[MAX_PATH];
+	int64_t shape[3];  // [z, x, y]
+	int bits;  // Bits per sample of the pages: 8, 16 or 32 (float)
+	TiffScale scale;
+
+	uint64_t page_bytes;
+	uint64_t frame_bytes;  // Pages of a frame, padded to ARENA_ALIGNMENT
+	int64_t frames_per_block;
+	uint64_t block_bytes;  // IFDs of a block, padded to ARENA_ALIGNMENT
+
+	std::unique_ptr<LargePageArena> arena;
+	char* pages[TIFF_RING_SIZE];
+	char* ifds[TIFF_RING_SIZE];
+	int64_t frames;  // Frames written to the file
+	uint64_t offset;  // File offset of the next write
+	uint64_t last_ifd;  // File offset of the IFD of the last page written
+
+	static char* put_entry(char* p, uint16_t tag, uint16_t type, uint64_t value)
+	{
+		uint64_t count = 1;
+		memcpy(p, &tag, 2);
+		memcpy(p + 2, &type, 2);
+		memcpy(p + 4, &count, 8);
+		memset(p + 12, 0, 8);
+		if (type == TIFF_SHORT)
+		{
+			uint16_t v = (uint16_t)value;
+			memcpy(p + 12, &v, 2);
+		}
+		else if (type == TIFF_LONG)
+		{
+			uint32_t v = (uint32_t)value;
+			memcpy(p + 12, &v, 4);
+		}
+		else
+		{
+			memcpy(p + 12, &value, 8);
+		}
+		return p + 20;
+	}
+
+	// Format the IFDs of the block beginning at file offset start into dst
+	void format_block(char* dst, uint64_t start)
+	{
+		int64_t n = frames_per_block * shape[2];
+		uint64_t data = start + block_bytes;
+		uint64_t next_block = data + frames_per_block * frame_bytes;
+		for (int64_t i = 0; i < n; i++)
+		{
+			uint64_t page_offset = data + (i / shape[2]) * frame_bytes + (i % shape[2]) * page_bytes;
+			char* p = dst + i * TIFF_IFD_SIZE;
+			uint64_t tags = TIFF_TAGS;
+			memcpy(p, &tags, 8);
+			p += 8;
+			p = put_entry(p, 256, TIFF_LONG, shape[1]);  // ImageWidth
+			p = put_entry(p, 257, TIFF_LONG, shape[0]);  // ImageLength
+			p = put_entry(p, 258, TIFF_SHORT, bits);  // BitsPerSample
+			p = put_entry(p, 259, TIFF_SHORT, 1);  // Compression: none
+			p = put_entry(p, 262, TIFF_SHORT, 1);  // PhotometricInterpretation: BlackIsZero
+			p = put_entry(p, 273, TIFF_LONG8, page_offset);  // StripOffsets
+			p = put_entry(p, 277, TIFF_SHORT, 1);  // SamplesPerPixel
+			p = put_entry(p, 278, TIFF_LONG, shape[0]);  // RowsPerStrip
+			p = put_entry(p, 279, TIFF_LONG8, page_bytes);  // StripByteCounts
+			p = put_entry(p, 339, TIFF_SHORT, (bits == 32) ? 3 : 1);  // SampleFormat: IEEE float or unsigned
+			uint64_t next = (i + 1 < n) ? start + (i + 1) * TIFF_IFD_SIZE : next_block;
+			memcpy(p, &next, 8);
+		}
+	}
+
+	void transpose(const T* f, char* dst)
+	{
+		if (bits == 8)
+		{
+			tiff_transpose(f, (uint8_t*)dst, shape[0], shape[1], shape[2], scale);
+		}
+		else if (bits == 16)
+		{
+			tiff_transpose(f, (uint16_t*)dst, shape[0], shape[1], shape[2], scale);
+		}
+		else
+		{
+			tiff_transpose(f, (float*)dst, shape[0], shape[1], shape[2], scale);
+		}
+	}
+
+public:
+
+	// Frames of shape [z, x, y] written as y pages of bits_per_sample 8, 16 or 32 (float). Complex frames written as
+	// integers are scaled from db_min to db_max, and spectra written as uint8 from their spectrum_bits significant bits.
+	TiffWriter(int64_t z, int64_t x, int64_t y, int bits_per_sample, float db_min, float db_max, int spectrum_bits = TIFF_SPECTRUM_BITS)
+	{
+		shape[0] = z;
+		shape[1] = x;
+		shape[2] = y;
+		bits = (bits_per_sample == 8 || bits_per_sample == 16) ? bits_per_sample : 32;
+		scale.db_min = db_min;
+		scale.db_max = (db_max > db_min) ? db_max : db_min + 1.0f;
+		scale.spectrum_shift = (spectrum_bits > 8 && spectrum_bits <= 16) ? spectrum_bits - 8 : 0;
+		page_bytes = z * x * (bits / 8);
+		frame_bytes = arena_round_up(page_bytes * y, ARENA_ALIGNMENT);
+		frames_per_block = (TIFF_IFD_BLOCK_PAGES + y - 1) / y;
+		block_bytes = arena_round_up(frames_per_block * y * TIFF_IFD_SIZE, ARENA_ALIGNMENT);
+		arena = std::make_unique<LargePageArena>(TIFF_RING_SIZE * (frame_bytes + block_bytes));  // Zeroed, so the padding is too
+		for (int i = 0; i < TIFF_RING_SIZE; i++)
+		{
+			pages[i] = (char*)arena->carve(frame_bytes);
+			ifds[i] = (char*)arena->carve(block_bytes);
+		}
+		frames = 0;
+		offset = 0;
+		last_ifd = 0;
+	}
+
+	~TiffWriter()
+	{
+		close();
+	}
+
+	void open(const char* fname) override
+	{
+		strcpy_s(name, MAX_PATH, fname);
+		frames = 0;
+		writer.open(fname);
+		if (writer.is_open() && ifds[0] != NULL)
+		{
+			// Header. The first IFD follows it
+			char* header = ifds[0];
+			memset(header, 0, TIFF_HEADER_SIZE);  // The block_bytes of ifds[0] are at least TIFF_HEADER_SIZE
+			memcpy(header, "II\x2B\x00\x08\x00\x00\x00", 8);
+			uint64_t first = TIFF_HEADER_SIZE;
+			memcpy(header + 8, &first, 8);
+			writer.writeFrame(header, TIFF_HEADER_SIZE);
+			offset = TIFF_HEADER_SIZE;
+		}
+	}
+
+	bool is_open() override
+	{
+		return writer.is_open();
+	}
+
+	void writeFrame(void* f, long frame_size) override
+	{
+		if (pages[0] == NULL)
+		{
+			return;
+		}
+		int slot = (int)((frames + 1) % TIFF_RING_SIZE);  // The header was written from slot 0
+		if (frames % frames_per_block == 0)
+		{
+			format_block(ifds[slot], offset);
+			writer.writeFrame(ifds[slot], (long)block_bytes);
+			offset += block_bytes;
+		}
+		{
+			TRACE_SCOPE("tiff transpose");
+			transpose((const T*)f, pages[slot]);
+		}
+		writer.writeFrame(pages[slot], (long)frame_bytes);
+		// The IFD of the frame's last page
+		uint64_t block_start = offset - (frames % frames_per_block) * frame_bytes - block_bytes;
+		last_ifd = block_start + ((frames % frames_per_block + 1) * shape[2] - 1) * TIFF_IFD_SIZE;
+		offset += frame_bytes;
+		frames++;
+	}
+
+	int pending() override
+	{
+		return 0;  // Frames are transposed into the writer's own buffers
+	}
+
+	// Offset of the first page of the next frame
+	int64_t next_offset() override
+	{
+		return (frames % frames_per_block == 0) ? offset + block_bytes : offset;
+	}
+
+	// Bytes of frames of the source type, i.e. as acquired. Pages and IFDs are reserved for as many frames as they fill
+	void preallocate(int64_t bytes) override
+	{
+		int64_t n = bytes / (shape[0] * shape[1] * shape[2] * (int64_t)sizeof(T));
+		writer.preallocate(TIFF_HEADER_SIZE + n * frame_bytes + (n / frames_per_block + 1) * block_bytes);
+	}
+
+	void close() override
+	{
+		if (!writer.is_open())
+		{
+			return;
+		}
+		writer.close();
+		if (frames == 0)
+		{
+			DeleteFileA(name);  // A TIFF must have a page
+			return;
+		}
+		// End the chain of IFDs at the last page written
+		HANDLE h = CreateFileA(name, GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		LARGE_INTEGER at;
+		at.QuadPart = last_ifd + 8 + TIFF_TAGS * 20;
+		uint64_t end = 0;
+		DWORD written = 0;
+		if (h == INVALID_HANDLE_VALUE || !SetFilePointerEx(h, at, NULL, FILE_BEGIN) || !WriteFile(h, &end, 8, &written, NULL))
+		{
+			async_printf("fastnisdoct/TiffWriter: Failed to end the IFD chain of %s. It contains %lli frames\n", name, frames);
+		}
+		if (h != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(h);
+		}
+	}
+
+};
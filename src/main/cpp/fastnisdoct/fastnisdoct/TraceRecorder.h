@@ -0,0 +1,331 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <Windows.h>
+#include "AsyncLogger.h"
+
+/*
+Optional recorder of pipeline events which can be dumped as Chrome trace JSON, viewable in chrome://tracing
+or ui.perfetto.dev.
+
+TRACE_SCOPE(name) stamps the begin and end of the enclosing scope with the performance counter and, if the
+recorder is enabled, records it into a ring owned by the calling thread, so threads never contend. Each
+thread's ring holds its latest TRACE_RING_SIZE events. start() allocates rings until TRACE_SPARE_RINGS are free,
+so a thread only claims a free ring, without locking or allocating, the first time it records. A thread's ring is
+freed when it exits but keeps its events until another thread claims it, and rings which have never been claimed
+are claimed first, so that the events of workers which have been terminated can still be dumped. The events of a
+thread which finds no free ring are dropped and counted. When disabled, a scope costs one relaxed load.
+
+dump() disables the recorder and waits for the records already in progress before it reads the rings, and only
+dumps events which began after start(), so that start() never has to touch a ring another thread may be recording
+into. Event names must be string literals.
+
+Define FASTNISDOCT_NO_TRACE to compile the scopes out entirely.
+*/
+
+#define TRACE_RING_SIZE 65536  // Events per thread
+#define TRACE_MAX_THREADS 128
+#define TRACE_SPARE_RINGS 16  // Free rings kept by start()
+#define TRACE_THREAD_NAME_SIZE 32
+
+
+struct TraceEvent
+{
+	const char* name;
+	int64_t begin;
+	int64_t end;
+	int64_t arg;
+};
+
+
+struct TraceRing
+{
+	std::unique_ptr<TraceEvent[]> events;
+	std::atomic<uint64_t> head;  // Number of events recorded
+	std::atomic<uint64_t> first;  // Head when the ring was claimed. Earlier events are those of its previous owner
+	std::atomic_bool owned;  // By a running thread
+	std::atomic_int writing;  // Nonzero while its owner is recording, so that dump() can wait for it
+	DWORD thread_id;
+	char thread_name[TRACE_THREAD_NAME_SIZE];
+};
+
+
+// Frees the calling thread's ring when it exits
+struct TraceRingClaim
+{
+	TraceRing* ring = NULL;
+	bool labelled = false;  // The ring's thread and first event have been set by this thread
+
+	~TraceRingClaim()
+	{
+		if (ring != NULL)
+		{
+			ring->owned.store(false, std::memory_order_release);
+			ring = NULL;
+			labelled = false;
+		}
+	}
+};
+
+
+class TraceRecorder
+{
+private:
+
+	std::mutex rings_mutex;  // Taken by start() and dump(), never by a recording thread
+	std::unique_ptr<TraceRing> rings[TRACE_MAX_THREADS];
+	std::atomic_int n_rings;  // Rings allocated, published in order
+	std::atomic<int64_t> dropped;  // Events of threads which found no free ring
+	std::atomic_bool enabled;
+	int64_t start_ticks;
+	double us_per_tick;
+
+	static TraceRingClaim& this_thread_claim()
+	{
+		thread_local TraceRingClaim claim;
+		return claim;
+	}
+
+	static const char*& this_thread_name()
+	{
+		thread_local const char* name = NULL;
+		return name;
+	}
+
+	// Claim a free ring for the calling thread, preferring one with no events of an exited thread. NULL if there is none
+	TraceRing* claim_ring()
+	{
+		int n = n_rings.load(std::memory_order_acquire);
+		for (int i = 0; i < 2 * n; i++)
+		{
+			TraceRing* ring = rings[i % n].get();
+			bool owned = false;
+			bool unused = ring->head.load(std::memory_order_relaxed) == 0;
+			if ((unused || i >= n) && !ring->owned.load(std::memory_order_relaxed) && ring->owned.compare_exchange_strong(owned, true, std::memory_order_acquire))
+			{
+				return ring;
+			}
+		}
+		return NULL;
+	}
+
+	// Called while recording into the ring, so that dump() does not read it meanwhile
+	static void label_ring(TraceRing* ring)
+	{
+		ring->first.store(ring->head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		ring->thread_id = GetCurrentThreadId();
+		const char* name = this_thread_name();
+		snprintf(ring->thread_name, TRACE_THREAD_NAME_SIZE, "%s", (name != NULL) ? name : "thread");
+	}
+
+public:
+
+	TraceRecorder()
+	{
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		us_per_tick = 1.0e6 / frequency.QuadPart;
+		start_ticks = 0;
+		n_rings.store(0);
+		dropped.store(0);
+		enabled.store(false);
+	}
+
+	static inline int64_t now()
+	{
+		LARGE_INTEGER t;
+		QueryPerformanceCounter(&t);
+		return t.QuadPart;
+	}
+
+	inline bool is_enabled()
+	{
+		return enabled.load(std::memory_order_relaxed);
+	}
+
+	// Discard recorded events and begin recording. Allocates the rings, so must not be called from a real-time thread
+	void start()
+	{
+		std::unique_lock<std::mutex> lock(rings_mutex);
+		int n = n_rings.load();
+		int free_rings = 0;
+		for (int i = 0; i < n; i++)
+		{
+			free_rings += rings[i]->owned.load() ? 0 : 1;
+		}
+		for (; free_rings < TRACE_SPARE_RINGS && n < TRACE_MAX_THREADS; free_rings++, n++)
+		{
+			TraceRing* ring = new TraceRing;
+			ring->events = std::make_unique<TraceEvent[]>(TRACE_RING_SIZE);  // Zeroed, so faulted in here
+			ring->head.store(0);
+			ring->first.store(0);
+			ring->owned.store(false);
+			ring->writing.store(0);
+			ring->thread_id = 0;
+			ring->thread_name[0] = '\0';
+			rings[n].reset(ring);
+			n_rings.store(n + 1, std::memory_order_release);
+		}
+		dropped.store(0);
+		start_ticks = now();  // Events recorded before now are not dumped
+		enabled.store(true);
+	}
+
+	void stop()
+	{
+		enabled.store(false);
+	}
+
+	// Name the calling thread in the trace. Takes effect for rings allocated after the call.
+	static void set_thread_name(const char* name)
+	{
+		this_thread_name() = name;
+	}
+
+	inline void record(const char* name, int64_t begin, int64_t end, int64_t arg)
+	{
+		if (!is_enabled())
+		{
+			return;  // Stopped since the scope began
+		}
+		TraceRingClaim& claim = this_thread_claim();
+		if (claim.ring == NULL)
+		{
+			claim.ring = claim_ring();
+			if (claim.ring == NULL)
+			{
+				dropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+		}
+		TraceRing* ring = claim.ring;
+		ring->writing.fetch_add(1);
+		if (!enabled.load())  // Either dump() sees this record in progress or it is dropped here
+		{
+			ring->writing.fetch_sub(1, std::memory_order_release);
+			return;
+		}
+		if (!claim.labelled)
+		{
+			label_ring(ring);
+			claim.labelled = true;
+		}
+		uint64_t h = ring->head.load(std::memory_order_relaxed);
+		TraceEvent* e = &ring->events[h % TRACE_RING_SIZE];
+		e->name = name;
+		e->begin = begin;
+		e->end = end;
+		e->arg = arg;
+		ring->head.store(h + 1, std::memory_order_release);
+		ring->writing.fetch_sub(1, std::memory_order_release);
+	}
+
+	// Stop recording and write the events as Chrome trace JSON. Returns the number of events written or -1 on failure.
+	int64_t dump(const char* path)
+	{
+		stop();
+		std::unique_lock<std::mutex> lock(rings_mutex);
+		for (int r = 0; r < n_rings.load(std::memory_order_acquire); r++)
+		{
+			while (rings[r]->writing.load(std::memory_order_acquire) != 0)  // Records which began before stop()
+			{
+				Sleep(0);
+			}
+		}
+		FILE* f = fopen(path, "w");
+		if (f == NULL)
+		{
+			return -1;
+		}
+		fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+		int64_t n = 0;
+		bool first = true;
+		for (int r = 0; r < n_rings.load(std::memory_order_acquire); r++)
+		{
+			TraceRing* ring = rings[r].get();
+			uint64_t h = ring->head.load(std::memory_order_acquire);
+			uint64_t first_event = ring->first.load(std::memory_order_relaxed);
+			if (h == first_event)
+			{
+				continue;  // Never claimed, or nothing recorded by its owner
+			}
+			fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %lu, \"args\": {\"name\": \"%s\"}}", first ? "" : ",\n", (unsigned long)ring->thread_id, ring->thread_name);
+			first = false;
+			uint64_t oldest = (h - first_event > TRACE_RING_SIZE) ? h - TRACE_RING_SIZE : first_event;
+			for (uint64_t i = oldest; i < h; i++)
+			{
+				TraceEvent* e = &ring->events[i % TRACE_RING_SIZE];
+				if (e->begin < start_ticks)
+				{
+					continue;  // Began before the trace was started
+				}
+				fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %lu, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"n\": %lld}}",
+					e->name, (unsigned long)ring->thread_id, (e->begin - start_ticks) * us_per_tick, (e->end - e->begin) * us_per_tick, (long long)e->arg);
+				n++;
+			}
+		}
+		fprintf(f, "\n]}\n");
+		fclose(f);
+		if (dropped.load() > 0)
+		{
+			async_printf("fastnisdoct/TraceRecorder: %lli events were dropped by threads beyond the %i rings. Start the trace again to allocate more\n", (long long)dropped.load(), n_rings.load());
+		}
+		return n;
+	}
+
+};
+
+
+inline TraceRecorder& trace_recorder()
+{
+	static TraceRecorder recorder;
+	return recorder;
+}
+
+
+// Records the lifetime of the scope it is declared in
+class TraceScope
+{
+private:
+
+	const char* name;
+	int64_t arg;
+	int64_t begin;
+
+public:
+
+	TraceScope(const char* name, int64_t arg = 0)
+	{
+		this->name = name;
+		this->arg = arg;
+		begin = trace_recorder().is_enabled() ? TraceRecorder::now() : 0;
+	}
+
+	~TraceScope()
+	{
+		if (begin != 0)
+		{
+			trace_recorder().record(name, begin, TraceRecorder::now(), arg);
+		}
+	}
+
+};
+
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+#ifdef FASTNISDOCT_NO_TRACE
+#define TRACE_SCOPE(name)
+#define TRACE_SCOPE_N(name, n)
+#define TRACE_THREAD_NAME(name)
+#else
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(_trace_scope_, __LINE__)(name)
+#define TRACE_SCOPE_N(name, n) TraceScope TRACE_CONCAT(_trace_scope_, __LINE__)(name, n)  // With an integer argument such as a frame number
+#define TRACE_THREAD_NAME(name) TraceRecorder::set_thread_name(name)
+#endif
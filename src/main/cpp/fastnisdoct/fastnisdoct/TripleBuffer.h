@@ -0,0 +1,128 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <memory>
+
+/*
+Lock-free triple buffer which hands the latest frame from a single producer to a single consumer.
+
+The producer always owns the back buffer and the consumer always owns the front buffer. The third buffer is
+exchanged between them atomically: publish() swaps the back buffer into the middle and borrow() swaps the
+middle into the front if it holds a newer frame. Neither side ever waits for the other and neither side ever
+copies: the producer writes frames in place and the consumer reads them in place until it borrows again.
+
+If the consumer is slower than the producer, intermediate frames are overwritten in the middle buffer and
+only the latest is seen.
+
+The buffers can only be resized while the consumer is locked out, which lock_out() does only if it holds no
+buffer and is not in the middle of a borrow.
+*/
+
+#define TRIPLE_BUFFER_INDEX_MASK 0x3
+#define TRIPLE_BUFFER_DIRTY 0x4  // Set if the middle buffer holds a frame the consumer has not seen
+
+#define TRIPLE_BUFFER_FREE 0
+#define TRIPLE_BUFFER_BORROWED 1  // The consumer holds the front buffer or is borrowing it
+#define TRIPLE_BUFFER_LOCKED 2  // The consumer may not borrow, i.e. while the buffers are resized
+
+template <class T>
+class TripleBuffer
+{
+protected:
+
+	std::unique_ptr<T[]> buffers[3];
+	int64_t frame_number[3];  // Number of the frame held by each buffer, written only by the buffer's owner
+	int back;  // Owned by producer
+	int front;  // Owned by consumer
+	std::atomic_int middle;  // Index of the exchanged buffer | TRIPLE_BUFFER_DIRTY
+	std::atomic_int consumer;  // TRIPLE_BUFFER_FREE, TRIPLE_BUFFER_BORROWED or TRIPLE_BUFFER_LOCKED
+
+public:
+
+	uint64_t element_size;
+
+	TripleBuffer(uint64_t element_size)
+	{
+		consumer.store(TRIPLE_BUFFER_FREE);
+		resize(element_size);
+	}
+
+	// Reallocate the buffers and forget their frames. The consumer must be locked out
+	void resize(uint64_t element_size)
+	{
+		this->element_size = element_size;
+		for (int i = 0; i < 3; i++)
+		{
+			buffers[i] = std::make_unique<T[]>(element_size);
+			memset(buffers[i].get(), 0, element_size * sizeof(T));
+			frame_number[i] = -1;
+		}
+		back = 0;
+		middle.store(1);
+		front = 2;
+	}
+
+	// The buffer the producer is free to write the next frame into
+	T* get_back()
+	{
+		return buffers[back].get();
+	}
+
+	// Make the back buffer available to the consumer and receive a new back buffer
+	void publish(int64_t n)
+	{
+		frame_number[back] = n;
+		back = middle.exchange(back | TRIPLE_BUFFER_DIRTY) & TRIPLE_BUFFER_INDEX_MASK;
+	}
+
+	// If a frame has been published since the last borrow, swap it to the front and return its number.
+	// Otherwise return -1. The front buffer is never written by the producer, so *buffer is valid until the next borrow.
+	int64_t borrow(T** buffer)
+	{
+		int previous = consumer.load();
+		if (previous == TRIPLE_BUFFER_FREE && !consumer.compare_exchange_strong(previous, TRIPLE_BUFFER_BORROWED))
+		{
+			return -1;  // Locked out since it was loaded
+		}
+		if (previous == TRIPLE_BUFFER_LOCKED)
+		{
+			return -1;
+		}
+		if (!(middle.load() & TRIPLE_BUFFER_DIRTY))
+		{
+			if (previous == TRIPLE_BUFFER_FREE)
+			{
+				consumer.store(TRIPLE_BUFFER_FREE);
+			}
+			return -1;
+		}
+		front = middle.exchange(front) & TRIPLE_BUFFER_INDEX_MASK;
+		*buffer = buffers[front].get();
+		return frame_number[front];
+	}
+
+	void release()
+	{
+		int borrowed = TRIPLE_BUFFER_BORROWED;
+		consumer.compare_exchange_strong(borrowed, TRIPLE_BUFFER_FREE);  // Not if locked out, i.e. by a release without a borrow
+	}
+
+	bool is_borrowed()
+	{
+		return consumer.load() == TRIPLE_BUFFER_BORROWED;
+	}
+
+	// Keep the consumer from borrowing. Returns false if it holds a buffer or is borrowing one
+	bool lock_out()
+	{
+		int free = TRIPLE_BUFFER_FREE;
+		return consumer.compare_exchange_strong(free, TRIPLE_BUFFER_LOCKED);
+	}
+
+	void unlock()
+	{
+		consumer.store(TRIPLE_BUFFER_FREE);
+	}
+
+};
@@ -0,0 +1,307 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <Windows.h>
+#include "AsyncLogger.h"
+#include "LargePageArena.h"
+
+#define BYTES_PER_GB 1073741824
+#define MAX_PATH 512
+#define UNBUFFERED_QUEUE_DEPTH 4  // Frames in flight at once
+
+
+enum FileStreamType
+{
+	FSTREAM_TYPE_TIF = 1,
+	FSTREAM_TYPE_NPY = 2,
+	FSTREAM_TYPE_MAT = 3,
+	FSTREAM_TYPE_RAW = 4,
+	FSTREAM_TYPE_FNZ = 5  // Raw spectra compressed with the SpectralCodec
+};
+
+DEFINE_ENUM_FLAG_OPERATORS(FileStreamType);
+
+
+// Allocate bytes of disk to the file without changing its length, so that the file system does not allocate extents
+// as it grows. Allocation beyond the end of the file is given back when it is closed.
+inline void preallocate_file(HANDLE file, const char* name, int64_t bytes)
+{
+	FILE_ALLOCATION_INFO info;
+	info.AllocationSize.QuadPart = bytes;
+	if (!SetFileInformationByHandle(file, FileAllocationInfo, &info, sizeof(info)))
+	{
+		async_printf("fastnisdoct: Failed to preallocate %lli bytes to %s: error %lu\n", bytes, name, GetLastError());
+	}
+}
+
+
+class Writer
+{
+public:
+	Writer() {}
+	Writer(const Writer&) = default;
+	virtual bool is_open() { return false; }
+	virtual void open(const char* name) {}
+	virtual void writeFrame(void* f, long frame_size) {}
+	virtual int pending() { return 0; }  // Number of the latest frames written which are still being read from
+	virtual void wait_pending(int n) {}  // Block until no more than n frames are pending()
+	virtual int64_t next_offset() { return -1; }  // Byte offset in the file of the next frame, -1 if frames are not stored whole
+	virtual void preallocate(int64_t bytes) {}  // Reserve about bytes of disk for the file opened, if the format can
+	virtual void close() {}
+};
+
+
+// Writes frames with unbuffered, overlapped I/O, bypassing the file cache. Up to UNBUFFERED_QUEUE_DEPTH frames are
+// in flight at once. Writes must be whole sectors from sector-aligned memory, so a frame which follows on from a
+// sector boundary and is itself aligned, such as a CircAcqBuffer element, is written from where it is without a
+// copy and only the tail which does not fill a sector is carried over to the next. Otherwise the frame is copied
+// into an aligned staging buffer. The frame's memory must remain valid until it is no longer pending().
+class UnbufferedWriter : public Writer
+{
+private:
+
+	HANDLE file;
+	char name[MAX_PATH];
+
+	OVERLAPPED ops[UNBUFFERED_QUEUE_DEPTH];  // Ring of writes in submission order
+	bool in_flight[UNBUFFERED_QUEUE_DEPTH];
+	int oldest;  // Oldest write in flight
+	int n_in_flight;
+
+	std::unique_ptr<LargePageArena> staging_arena;
+	char* staging[UNBUFFERED_QUEUE_DEPTH];  // One per write so that a staged frame stays valid while in flight
+	size_t staging_size;
+	char* carry;  // Tail of the previous frame which did not fill a sector
+	size_t n_carry;
+
+	uint64_t offset;  // File offset of the next write, always a multiple of ARENA_ALIGNMENT
+
+	inline int newest()
+	{
+		return (oldest + n_in_flight) % UNBUFFERED_QUEUE_DEPTH;
+	}
+
+	// Wait for the oldest write in flight. Returns false if it failed.
+	bool reap(bool wait)
+	{
+		OVERLAPPED* op = &ops[oldest];
+		if (!wait && !HasOverlappedIoCompleted(op))
+		{
+			return true;
+		}
+		DWORD written;
+		bool ok = GetOverlappedResult(file, op, &written, TRUE) != 0;
+		if (!ok)
+		{
+			async_printf_every(LOG_PERIOD_MS, "fastnisdoct/UnbufferedWriter: Failed to write to %s: error %lu\n", name, GetLastError());
+		}
+		in_flight[oldest] = false;
+		oldest = (oldest + 1) % UNBUFFERED_QUEUE_DEPTH;
+		n_in_flight--;
+		return ok;
+	}
+
+	void reap_completed()
+	{
+		while (n_in_flight > 0 && HasOverlappedIoCompleted(&ops[oldest]))
+		{
+			reap(false);
+		}
+	}
+
+	void wait_all()
+	{
+		while (n_in_flight > 0)
+		{
+			reap(true);
+		}
+	}
+
+	// Stage the next write in the op slot which will be used for it
+	char* staging_for_next_write(size_t n)
+	{
+		if (n > staging_size)
+		{
+			wait_all();  // Staging buffers may be in flight
+			staging_size = arena_round_up(n, ARENA_ALIGNMENT);
+			staging_arena = std::make_unique<LargePageArena>(staging_size * UNBUFFERED_QUEUE_DEPTH);
+			for (int i = 0; i < UNBUFFERED_QUEUE_DEPTH; i++)
+			{
+				staging[i] = (char*)staging_arena->carve(staging_size);
+			}
+		}
+		if (n_in_flight == UNBUFFERED_QUEUE_DEPTH)
+		{
+			reap(true);
+		}
+		return staging[newest()];
+	}
+
+	void submit(const char* src, size_t n)
+	{
+		if (n == 0)
+		{
+			return;
+		}
+		if (n_in_flight == UNBUFFERED_QUEUE_DEPTH)
+		{
+			reap(true);
+		}
+		int i = newest();
+		OVERLAPPED* op = &ops[i];
+		HANDLE event = op->hEvent;
+		memset(op, 0, sizeof(OVERLAPPED));
+		op->hEvent = event;
+		op->Offset = (DWORD)(offset & 0xFFFFFFFF);
+		op->OffsetHigh = (DWORD)(offset >> 32);
+		if (!WriteFile(file, src, (DWORD)n, NULL, op) && GetLastError() != ERROR_IO_PENDING)
+		{
+			async_printf_every(LOG_PERIOD_MS, "fastnisdoct/UnbufferedWriter: Failed to write to %s: error %lu\n", name, GetLastError());
+			return;
+		}
+		in_flight[i] = true;
+		n_in_flight++;
+		offset += n;
+	}
+
+public:
+
+	long long total_bytes_written;
+
+	UnbufferedWriter()
+	{
+		file = INVALID_HANDLE_VALUE;
+		for (int i = 0; i < UNBUFFERED_QUEUE_DEPTH; i++)
+		{
+			ops[i].hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+			in_flight[i] = false;
+			staging[i] = NULL;
+		}
+		oldest = 0;
+		n_in_flight = 0;
+		staging_size = 0;
+		carry = (char*)VirtualAlloc(NULL, ARENA_ALIGNMENT, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		n_carry = 0;
+		offset = 0;
+		total_bytes_written = 0;
+	}
+
+	~UnbufferedWriter()
+	{
+		close();
+		for (int i = 0; i < UNBUFFERED_QUEUE_DEPTH; i++)
+		{
+			CloseHandle(ops[i].hEvent);
+		}
+		VirtualFree(carry, 0, MEM_RELEASE);
+	}
+
+	void open(const char* fname) override
+	{
+		strcpy_s(name, MAX_PATH, fname);
+		file = CreateFileA(fname, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			async_printf("fastnisdoct/UnbufferedWriter: Failed to open file: %s, error %lu\n", fname, GetLastError());
+		}
+		n_carry = 0;
+		offset = 0;
+		total_bytes_written = 0;
+	}
+
+	bool is_open() override
+	{
+		return file != INVALID_HANDLE_VALUE;
+	}
+
+	void writeFrame(void* f, long frame_size) override
+	{
+		if (!is_open())
+		{
+			return;
+		}
+		reap_completed();
+		const char* src = (const char*)f;
+		size_t total = n_carry + frame_size;
+		size_t whole = (total / ARENA_ALIGNMENT) * ARENA_ALIGNMENT;
+		if (n_carry == 0 && ((uintptr_t)src % ARENA_ALIGNMENT) == 0)
+		{
+			submit(src, whole);  // In place
+			memcpy(carry, src + whole, total - whole);
+		}
+		else
+		{
+			char* stage = staging_for_next_write(total);
+			memcpy(stage, carry, n_carry);
+			memcpy(stage + n_carry, src, frame_size);
+			submit(stage, whole);
+			memcpy(carry, stage + whole, total - whole);
+		}
+		n_carry = total - whole;
+		if (whole == 0)
+		{
+			wait_all();  // Nothing of the frame is in flight, but older frames may be. Keep pending() in order
+		}
+		total_bytes_written += frame_size;
+	}
+
+	int pending() override
+	{
+		reap_completed();
+		return n_in_flight;
+	}
+
+	void wait_pending(int n) override
+	{
+		while (n_in_flight > n)
+		{
+			reap(true);
+		}
+	}
+
+	int64_t next_offset() override
+	{
+		return total_bytes_written;
+	}
+
+	void preallocate(int64_t bytes) override
+	{
+		if (file != INVALID_HANDLE_VALUE)
+		{
+			preallocate_file(file, name, bytes);
+		}
+	}
+
+	void close() override
+	{
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			return;
+		}
+		wait_all();
+		if (n_carry > 0)  // Write the last partial sector padded, then truncate the file to its length
+		{
+			memset(carry + n_carry, 0, ARENA_ALIGNMENT - n_carry);
+			submit(carry, ARENA_ALIGNMENT);
+			wait_all();
+		}
+		CloseHandle(file);
+		file = INVALID_HANDLE_VALUE;
+		if (n_carry > 0)
+		{
+			HANDLE h = CreateFileA(name, GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (h != INVALID_HANDLE_VALUE)
+			{
+				LARGE_INTEGER end;
+				end.QuadPart = total_bytes_written;
+				SetFilePointerEx(h, end, NULL, FILE_BEGIN);
+				SetEndOfFile(h);
+				CloseHandle(h);
+			}
+		}
+		n_carry = 0;
+	}
+
+};
@@ -18,12 +18,25 @@
 #include <complex>
 
 #include "spscqueue.h"
+#include "AsyncLogger.h"
 #include "AlineProcessingPool.h"
+#include "RepeatProcessing.h"
 #include "CircAcqBuffer.h"
 #include "FileStreamWorker.h"
+#include "DisplayProducts.h"
+#include "SpectrometerStats.h"
+#include "TripleBuffer.h"
+#include "FrameNotifier.h"
+#include "LineTelemetry.h"
+#include "PipelineStats.h"
+#include "TraceRecorder.h"
+#include "Packed12.h"
+#include "RecordingReader.h"
+#include "Reprocessor.h"
 #include "ni.h"
 
 #define IDLE_SLEEP_MS 10
+#define DISPLAY_LOCK_OUT_TIMEOUT_MS 1000  // Time the client has to return a borrowed frame before the display buffer can be resized
 
 
 enum OCTState
@@ -40,15 +53,6 @@ enum OCTState
 DEFINE_ENUM_FLAG_OPERATORS(OCTState);
 
 
-enum RepeatProcessingType
-{
-	REPEAT_PROCESSING_NONE = 0,
-	REPEAT_PROCESSING_MEAN = 1,
-	REPEAT_PROCESSING_DIFF = 2
-};
-DEFINE_ENUM_FLAG_OPERATORS(RepeatProcessingType);
-
-
 // msgs are passed into the main thread
 #define MSG_CONFIGURE_IMAGE		  static_cast<int>( 1 << 0 )
 #define MSG_CONFIGURE_PROCESSING  static_cast<int>( 1 << 1 )
@@ -56,6 +60,13 @@ DEFINE_ENUM_FLAG_OPERATORS(RepeatProcessingType);
 #define MSG_STOP_SCAN             static_cast<int>( 1 << 3 )
 #define MSG_START_ACQUISITION     static_cast<int>( 1 << 4 )
 #define MSG_STOP_ACQUISITION      static_cast<int>( 1 << 5 )
+#define MSG_CONFIGURE_DISPLAY     static_cast<int>( 1 << 6 )
+#define MSG_CONFIGURE_SPILL       static_cast<int>( 1 << 7 )
+#define MSG_CONFIGURE_PRETRIGGER  static_cast<int>( 1 << 8 )
+#define MSG_CONFIGURE_STRIPING    static_cast<int>( 1 << 9 )
+#define MSG_CONFIGURE_MAT         static_cast<int>( 1 << 10 )
+#define MSG_CONFIGURE_TIFF        static_cast<int>( 1 << 11 )
+#define MSG_CONFIGURE_PACKING     static_cast<int>( 1 << 12 )
 
 struct StateMsg {
 	
@@ -90,6 +101,13 @@ struct StateMsg {
 	float max_gb;
 	int n_frames_to_acquire;
 	bool save_processed;
+	int spill_frames;
+	int pretrigger_frames;
+	int deflate_level;
+	int tiff_bits;
+	float tiff_db_range[2];
+	bool pack_spectra;
+	DisplayConfig display_config;
 };
 
 spsc_bounded_queue_t<StateMsg> msg_queue(32);
@@ -115,19 +133,38 @@ int32_t buffers_per_frame;  // If > 0, IMAQ buffers will be copied into the proc
 int32_t alines_per_bline; // Number of A-lines which make up a B-line of the image. Used to divide processing labor.
 
 std::unique_ptr<CircAcqBuffer<uint16_t>> spectral_image_buffer;  // Spectral frames are copied to this buffer for export.
+bool pack_spectra;  // Spectra are packed to 12 bits in spectral_image_buffer and written to disk packed
+int64_t spectral_ring_frame_size;  // Number of uint16 elements of each frame of spectral_image_buffer
 std::unique_ptr<CircAcqBuffer<fftwf_complex>> processed_image_buffer;  // Spatial frames are written into this buffer for export.
+std::atomic<int64_t> page_sizes[3];  // Size of the pages backing the IMAQ buffers, the spectral ring and the processed ring
 int frames_to_buffer;  // Amount of buffer memory to allocate per the size of a frame
 
-// Main loop should only spend time copying to the display buffers if the client is ready 
-std::atomic_bool image_display_buffer_refresh;  // If True, grab returns -1 but main loop copies new frame in and flips the bit
-std::unique_ptr<fftwf_complex[]> image_display_buffer;
+// Workers process each frame into the back buffer in place. The client borrows the latest frame from the front without a copy
+std::unique_ptr<TripleBuffer<fftwf_complex>> processed_frame_display;
+
+FrameNotifier frame_notifier;  // Wakes clients when the display buffers are refreshed
 
+// Main loop should only spend time copying to the display buffers if the client is ready 
 std::atomic_bool spectrum_display_buffer_refresh;
 std::unique_ptr<float[]> spectrum_display_buffer;
 
+// Small 2D display images are reduced from the processed frame by the workers if the client is ready for them
+std::atomic_bool display_products_refresh;
+std::atomic_int display_products_client;  // TRIPLE_BUFFER_BORROWED while the client copies the display products, LOCKED while they are replaced
+std::unique_ptr<DisplayProducts> display_products;
+DisplayConfig display_config;
+
+// Saturation, mean and max spectrum and SNR are accumulated by the workers if the client is ready for them
+std::atomic_bool spectrometer_stats_refresh;
+std::atomic_int spectrometer_stats_client;  // TRIPLE_BUFFER_BORROWED while the client copies the stats, LOCKED while they are replaced
+std::unique_ptr<SpectrometerStats> spectrometer_stats;
+std::atomic_int saturation_level;
+
 // I do not trust std containers for the large arrays
 std::unique_ptr<uint16_t[]> raw_frame_roi;  // Frame which the contents of IMAQ buffers are copied into prior to processing if buffers_per_frame > 1
 std::unique_ptr<uint16_t[]> raw_frame_roi_new;
+uint16_t* raw_frame_to_process;  // Frame submitted to the processing pool: raw_frame_roi or a slot of spectral_image_buffer
+CircAcqBorrow<uint16_t> raw_frame_slot;  // Borrow of the spectral_image_buffer slot raw_frame_to_process points to. element is NULL if there is none
 std::vector<bool> discard_mask;  // Bitmask which reduces number_of_alines_buffered to number_of_alines. Intended to remove unwanted A-lines exposed during flyback, etc.
 
 std::vector<std::vector<std::tuple<int, int>>> roi_cpy_map; // Variable number of (offset, start) for each buffer. Predetermined and used to optimize copying the ROI.
@@ -138,6 +175,7 @@ std::vector<float> background_spectrum_new;
 std::vector<float> apodization_window;  // Multiplied by each spectrum.
 
 std::vector<uint16_t> aline_stamp_buffer; // A-line stamps are copied here. For debugging and latency monitoring
+LineTelemetry line_telemetry;  // Dropped lines, jitter and latency measured from the A-line stamps
 
 int32_t cumulative_buffer_number;  // Number of buffers acquired by IMAQ
 int32_t cumulative_frame_number;  // Number of frames acquired by main
@@ -157,8 +195,11 @@ bool interp;  // If true, first order linear interpolation is used to approximat
 double interpdk;  // Coefficient of first order linear-in-wavelength approximation.
 
 float frame_processing_period;  // Time taken to process latest frame
+PipelineStats pipeline_stats;  // Time spent in each stage of the pipeline
 
 bool saving_processed;
+int pretrigger_frames;  // Number of frames kept in an export ring while scanning, to be written first when acquisition starts
+bool pretrigger_processed;  // Keep processed frames rather than spectra
 FileStreamWorker<uint16_t> spectral_frame_streamer;
 FileStreamWorker<fftwf_complex> processed_frame_streamer;
 
@@ -172,13 +213,22 @@ inline void init_fastnisdoct()
 	std::atomic_init(&scan_interrupt_, false);
 	std::atomic_init(&state, STATE_UNOPENED);
 
-	std::atomic_init(&image_display_buffer_refresh, true);
 	std::atomic_init(&spectrum_display_buffer_refresh, true);
+	std::atomic_init(&display_products_refresh, true);
+	std::atomic_init(&display_products_client, TRIPLE_BUFFER_FREE);
+	display_config = default_display_config();
+	std::atomic_init(&spectrometer_stats_refresh, true);
+	std::atomic_init(&spectrometer_stats_client, TRIPLE_BUFFER_FREE);
+	std::atomic_init(&saturation_level, DEFAULT_SATURATION_LEVEL);
 
 	alines_in_scan = 0;
 	alines_in_image = 0;
 
 	preprocessed_alines_size = 0;
+	pack_spectra = false;
+	spectral_ring_frame_size = 0;
+	raw_frame_to_process = NULL;
+	raw_frame_slot.element = NULL;
 	processed_alines_size = 0;
 	processed_frame_size = 0;
 
@@ -187,10 +237,17 @@ inline void init_fastnisdoct()
 	alines_per_bline = 0;
 
 	frames_to_buffer = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		page_sizes[i].store(0);
+	}
 
 	cumulative_buffer_number = 0;
 	cumulative_frame_number = 0;
 
+	pretrigger_frames = 0;
+	pretrigger_processed = true;
+
 	aline_size = 0;
 	roi_offset = 0;
 	roi_size = 0;
@@ -206,6 +263,8 @@ inline void init_fastnisdoct()
 	interpdk = 0.0;
 
 	frame_processing_period = 0.0;
+	spectral_frame_streamer.set_pipeline_stats(&pipeline_stats);
+	processed_frame_streamer.set_pipeline_stats(&pipeline_stats);
 }
 
 
@@ -213,37 +272,102 @@ inline void stop_acquisition()
 {
 	if (state.load() == STATE_ACQUIRING)
 	{
-		printf("fastnisdoct: Stopping acquisition.\n");
+		async_printf("fastnisdoct: Stopping acquisition.\n");
 		if (saving_processed)
 		{
-			processed_frame_streamer.stop();
+			processed_frame_streamer.finish();
 		}
 		else
 		{
-			spectral_frame_streamer.stop();
+			spectral_frame_streamer.finish();
 		}
 		ni::drive_start_trigger_low();
 		state.store(STATE_SCANNING);
 	}
 	else
 	{
-		printf("fastnisdoct: Can't stop acquisition: not acquiring!");
+		async_printf("fastnisdoct: Can't stop acquisition: not acquiring!");
+	}
+}
+
+
+// Prepare an export ring for a new acquisition. If it has been kept while scanning, the pre-trigger frames it holds are
+// written first. Returns the count of the first frame to write and the number of pre-trigger frames in history.
+template <class T>
+inline int64_t begin_export(CircAcqBuffer<T>* ring, bool processed, int64_t* history)
+{
+	int64_t latest = ring->get_count();
+	if (pretrigger_frames > 0 && pretrigger_processed == processed && latest > -1)
+	{
+		int64_t n = pretrigger_frames;
+		if (n > ring->get_size() - 1)
+		{
+			n = ring->get_size() - 1;  // Leave a slot for the producer
+		}
+		int64_t first = latest - n + 1;
+		if (first < 0)
+		{
+			first = 0;
+		}
+		*history = latest - first + 1;
+		async_printf("fastnisdoct: Writing %lli pre-trigger frames from frame %lli\n", *history, first);
+		return first;
+	}
+	ring->clear();
+	*history = 0;
+	return 0;
+}
+
+
+// Parameters of the acquisition stored with the frames by formats which support it
+inline std::vector<std::pair<std::string, double>> acquisition_parameters()
+{
+	return {
+		{ "aline_size", (double)aline_size },
+		{ "alines_in_scan", (double)alines_in_scan },
+		{ "alines_in_image", (double)alines_in_image },
+		{ "alines_per_bline", (double)alines_per_bline },
+		{ "n_aline_repeat", (double)n_aline_repeat },
+		{ "n_bline_repeat", (double)n_bline_repeat },
+		{ "roi_offset", (double)roi_offset },
+		{ "roi_size", (double)roi_size },
+		{ "subtract_background", (double)subtract_background },
+		{ "interp", (double)interp },
+		{ "interpdk", interpdk },
+		{ "line_rate", (double)line_rate },
+		{ "dac_rate", (double)dac_rate }
+	};
+}
+
+
+// Allocate the spectral export ring for frames of preprocessed_alines_size samples, packed if pack_spectra
+inline void allocate_spectral_ring()
+{
+	if (raw_frame_slot.element != NULL)
+	{
+		spectral_image_buffer->release(&raw_frame_slot);
 	}
+	spectral_ring_frame_size = pack_spectra ? packed12_elements(preprocessed_alines_size) : preprocessed_alines_size;
+	int frames = pack_spectra ? (frames_to_buffer * 4) / 3 : frames_to_buffer;  // Packed frames fit 4/3 as many in the same memory
+	spectral_image_buffer = std::make_unique<CircAcqBuffer<uint16_t>>(frames, spectral_ring_frame_size);
+	raw_frame_to_process = raw_frame_roi.get();
+	page_sizes[1].store(spectral_image_buffer->get_page_size());
 }
 
 
 inline void start_scanning()
 {
 	aline_proc_pool->start();
+	line_telemetry.restart();
 	if (ni::start_scan() == 0)
 	{
-		printf("fastnisdoct: Scanning!\n");
+		async_printf("fastnisdoct: Scanning!\n");
 		state.store(STATE_SCANNING);
 	}
 	else
 	{
 		aline_proc_pool->terminate();
-		printf("fastnisdoct: Failed to start scanning.");
+		async_printf("fastnisdoct: Failed to start scanning.");
 		ni::print_error_msg();
 	}
 }
@@ -253,13 +377,14 @@ inline void stop_scanning()
 {
 	if (ni::stop_scan() == 0)
 	{
-		printf("fastnisdoct: Stopping scan!\n");
+		async_printf("fastnisdoct: Stopping scan!\n");
 		aline_proc_pool->terminate();
+		frame_notifier.interrupt();  // No more frames will be ready
 		state.store(STATE_READY);
 	}
 	else
 	{
-		printf("fastnisdoct: Failed to stop scanning.\n");
+		async_printf("fastnisdoct: Failed to stop scanning.\n");
 		ni::print_error_msg();
 	}
 }
@@ -271,7 +396,8 @@ inline void set_up_processing_pool()
 	if (aline_proc_pool == NULL)
 	{
 		aline_proc_pool = std::make_unique<AlineProcessingPool>(aline_size, alines_in_image, roi_offset, roi_size, true);
-		printf("fastnisdoct: Processing pool created for the first time.\n");
+		aline_proc_pool->timing = &pipeline_stats;
+		async_printf("fastnisdoct: Processing pool created for the first time.\n");
 		return;
 	}
 	else
@@ -280,11 +406,67 @@ inline void set_up_processing_pool()
 			(aline_proc_pool->roi_offset != roi_offset) || (aline_proc_pool->roi_size != roi_size))
 		{
 			aline_proc_pool = std::make_unique<AlineProcessingPool>(aline_size, alines_in_image, roi_offset, roi_size, true);
-			printf("fastnisdoct: Processing pool recreated.\n");
+			aline_proc_pool->timing = &pipeline_stats;
+			async_printf("fastnisdoct: Processing pool recreated.\n");
 			return;
 		}
 	}
-	printf("fastnisdoct: Processing pool does not need to be recreated.\n");
+	async_printf("fastnisdoct: Processing pool does not need to be recreated.\n");
+}
+
+
+// The client copies from its own thread. Returns false if the copy is locked out
+inline bool client_borrow(std::atomic_int& client)
+{
+	int free = TRIPLE_BUFFER_FREE;
+	return client.compare_exchange_strong(free, TRIPLE_BUFFER_BORROWED);
+}
+
+
+inline void client_release(std::atomic_int& client)
+{
+	client.store(TRIPLE_BUFFER_FREE);
+}
+
+
+// Wait for the client to finish its copy, which is short, and keep it from starting another
+inline void client_lock_out(std::atomic_int& client)
+{
+	int free = TRIPLE_BUFFER_FREE;
+	while (!client.compare_exchange_strong(free, TRIPLE_BUFFER_LOCKED))
+	{
+		free = TRIPLE_BUFFER_FREE;
+		Sleep(0);
+	}
+}
+
+
+// Display products depend on the processed frame geometry and on the number of workers which reduce it
+inline void set_up_display_products()
+{
+	int n_blines = alines_in_image / alines_per_bline;
+	int nx = processed_frame_size / ((int64_t)roi_size * n_blines);
+	if (display_products == NULL || display_products->roi_size != roi_size || display_products->nx != nx ||
+		display_products->ny != n_blines || display_products->number_of_workers != aline_proc_pool->number_of_workers)
+	{
+		client_lock_out(display_products_client);  // The client may be copying from the products being replaced
+		display_products = std::make_unique<DisplayProducts>(roi_size, nx, n_blines, aline_proc_pool->number_of_workers);
+		client_release(display_products_client);
+		async_printf("fastnisdoct: Display products allocated: B-scan [%i, %i] or [%i, %i], en face [%i, %i]\n", roi_size, nx, roi_size, n_blines, nx, n_blines);
+	}
+	display_products->configure(display_config);
+}
+
+
+inline void set_up_spectrometer_stats()
+{
+	if (spectrometer_stats == NULL || spectrometer_stats->aline_size != aline_size || spectrometer_stats->number_of_alines != alines_in_image ||
+		spectrometer_stats->roi_size != roi_size || spectrometer_stats->number_of_workers != aline_proc_pool->number_of_workers)
+	{
+		client_lock_out(spectrometer_stats_client);
+		spectrometer_stats = std::make_unique<SpectrometerStats>(aline_size, alines_in_image, roi_size, aline_proc_pool->number_of_workers);
+		client_release(spectrometer_stats_client);
+	}
 }
 
 
@@ -344,12 +526,19 @@ inline void recv_msg()
 	{
 		if (msg.flag & MSG_CONFIGURE_IMAGE)
 		{
-			printf("fastnisdoct: MSG_CONFIGURE_IMAGE received\n");
+			async_printf("fastnisdoct: MSG_CONFIGURE_IMAGE received\n");
 			bool restart = false;  // Set true if scan should be started after configuration
 			auto current_state = state.load();
 			if (current_state == STATE_ACQUIRING)
 			{
-				printf("fastnisdoct: Cannot configure image during acquisition!\n");
+				async_printf("fastnisdoct: Cannot configure image during acquisition!\n");
+				return;
+			}
+			else if (spectral_frame_streamer.is_streaming() || processed_frame_streamer.is_streaming())  // Still draining the rings
+			{
+				async_printf("fastnisdoct: Cannot configure image while frames are still being written to disk!\n");
+				delete msg.image_mask;
+				delete msg.scanpattern;
 				return;
 			}
 			else if (current_state == STATE_SCANNING)
@@ -360,13 +549,36 @@ inline void recv_msg()
 			}
 			if (current_state == STATE_READY || current_state == STATE_OPEN)
 			{
+				// The client may hold the display buffer or be borrowing it from its own thread, so it can only be resized once
+				// the client has returned it
+				bool display_locked_out = false;
+				if (processed_frame_display != NULL && processed_frame_display->element_size != (uint64_t)msg.roi_size * msg.alines_in_image)
+				{
+					ULONGLONG deadline = GetTickCount64() + DISPLAY_LOCK_OUT_TIMEOUT_MS;
+					while (!(display_locked_out = processed_frame_display->lock_out()) && GetTickCount64() < deadline)
+					{
+						Sleep(1);
+					}
+					if (!display_locked_out)
+					{
+						async_printf("fastnisdoct: Cannot configure image while the client has a frame borrowed!\n");
+						delete msg.image_mask;
+						delete msg.scanpattern;
+						if (restart)
+						{
+							start_scanning();
+						}
+						return;
+					}
+				}
+
 				state.store(STATE_OPEN);  // While in this block, we are not ready to scan.
 				image_configured = false;
 				processing_configured = false;
 
 				if (aline_size != msg.aline_size)  // If A-line size has changed
 				{
-					printf("fastnisdoct: Allocating A-line-sized processing buffers with size %i\n", msg.aline_size);
+					async_printf("fastnisdoct: Allocating A-line-sized processing buffers with size %i\n", msg.aline_size);
 
 					// Allocate processing buffers
 					background_spectrum.resize(msg.aline_size);
@@ -376,7 +588,7 @@ inline void recv_msg()
 				}
 				else
 				{
-					printf("fastnisdoct: A-line size unchanged.\n");
+					async_printf("fastnisdoct: A-line size unchanged.\n");
 				}
 
 				if (alines_in_scan != msg.alines_in_scan)
@@ -389,33 +601,35 @@ inline void recv_msg()
 				{
 					buffers_per_frame = msg.alines_in_scan / msg.alines_per_buffer;
 					frames_to_buffer = msg.frames_to_buffer;
-					if (ni::setup_buffers(msg.aline_size, msg.alines_per_buffer, buffers_per_frame * frames_to_buffer) == 0)
+					bool buffers_allocated = ni::setup_buffers(msg.aline_size, msg.alines_per_buffer, buffers_per_frame * frames_to_buffer) == 0;
+					if (buffers_allocated)
 					{
-						printf("fastnisdoct: %i buffers allocated with %i A-lines per buffer, %i buffers per frame.\n", buffers_per_frame * frames_to_buffer, msg.alines_per_buffer, buffers_per_frame);
+						async_printf("fastnisdoct: %i buffers allocated with %i A-lines per buffer, %i buffers per frame.\n", buffers_per_frame * frames_to_buffer, msg.alines_per_buffer, buffers_per_frame);
 						cumulative_buffer_number = 0;
 						cumulative_frame_number = 0;
+						frame_notifier.reset();
 						image_configured = true;
 					}
 					else
 					{
-						printf("fastnisdoct: Failed to allocate buffers.\n");
+						async_printf("fastnisdoct: Failed to allocate buffers.\n");
 						ni::print_error_msg();
 					}
 
 					aline_size = msg.aline_size;
 					alines_in_scan = msg.alines_in_scan;
 					alines_in_image = msg.alines_in_image;
-					printf("fastnisdoct: A-lines in scan: %i\n", alines_in_scan);
-					printf("fastnisdoct: A-lines in image: %i\n", alines_in_image);
+					async_printf("fastnisdoct: A-lines in scan: %i\n", alines_in_scan);
+					async_printf("fastnisdoct: A-lines in image: %i\n", alines_in_image);
 					alines_per_bline = msg.alines_per_bline;
-					alines_per_buffer = msg.alines_per_buffer;
+					alines_per_buffer = buffers_allocated ? msg.alines_per_buffer : 0;  // If not, set the buffers up again when the image is next configured
 
 					spectrum_display_buffer = std::make_unique<float[]>(aline_size);
 					memset(spectrum_display_buffer.get(), 0.0, aline_size * sizeof(float));
 				}
 				else
 				{
-					printf("fastnisdoct: Buffers did not change size!\n");
+					async_printf("fastnisdoct: Buffers did not change size!\n");
 					image_configured = true;
 				}
 
@@ -423,11 +637,15 @@ inline void recv_msg()
 				if (msg.aline_size * msg.alines_in_image != preprocessed_alines_size)
 				{
 					preprocessed_alines_size = msg.aline_size * msg.alines_in_image;
+					if (raw_frame_slot.element != NULL)
+					{
+						spectral_image_buffer->release(&raw_frame_slot);
+					}
 					raw_frame_roi = std::make_unique<uint16_t[]>(preprocessed_alines_size);
 					raw_frame_roi_new = std::make_unique<uint16_t[]>(preprocessed_alines_size);
 					memset(raw_frame_roi.get(), 0, preprocessed_alines_size * sizeof(uint16_t));
 					memset(raw_frame_roi_new.get(), 0, preprocessed_alines_size * sizeof(uint16_t));
-					spectral_image_buffer = std::make_unique<CircAcqBuffer<uint16_t>>(frames_to_buffer, preprocessed_alines_size);
+					allocate_spectral_ring();
 				}
 				
 				// Allocate rings
@@ -439,6 +657,19 @@ inline void recv_msg()
 				roi_offset = msg.roi_offset;
 				roi_size = msg.roi_size;
 
+				page_sizes[0].store(ni::buffer_page_size());
+				page_sizes[1].store(spectral_image_buffer->get_page_size());
+				page_sizes[2].store(processed_image_buffer->get_page_size());
+				async_printf("fastnisdoct: Buffers are locked in %lli KiB pages (IMAQ), %lli KiB pages (spectral ring) and %lli KiB pages (processed ring)\n", page_sizes[0].load() / 1024, page_sizes[1].load() / 1024, page_sizes[2].load() / 1024);
+				if (page_sizes[1].load() == 0 || page_sizes[2].load() == 0 || (image_configured && page_sizes[0].load() == 0))
+				{
+					async_printf("fastnisdoct: Failed to allocate the rings. The image is not configured!\n");
+					image_configured = false;
+					alines_per_buffer = 0;  // Allocate every buffer again when the image is next configured
+					preprocessed_alines_size = 0;
+					processed_alines_size = 0;
+				}
+
 				// Processed frame size is smaller than processed A-lines size if A-lines or frames are combined via averaging or differencing
 				processed_frame_size = processed_alines_size;
 				if (msg.a_rpt_proc_flag > REPEAT_PROCESSING_NONE)
@@ -450,15 +681,24 @@ inline void recv_msg()
 					processed_frame_size /= msg.n_bline_repeat;
 				}
 
-				image_display_buffer = std::make_unique<fftwf_complex[]>(processed_frame_size);
+				// Repeats are processed in place, so the buffers must be large enough for the frame before they are
+				if (processed_frame_display == NULL)
+				{
+					processed_frame_display = std::make_unique<TripleBuffer<fftwf_complex>>(processed_alines_size);
+				}
+				else if (display_locked_out)
+				{
+					processed_frame_display->resize(processed_alines_size);
+					processed_frame_display->unlock();
+				}
 
 				n_aline_repeat = msg.n_aline_repeat;
 				n_bline_repeat = msg.n_bline_repeat;
 				a_rpt_proc_flag = msg.a_rpt_proc_flag;
 				b_rpt_proc_flag = msg.b_rpt_proc_flag;
 
-				printf("fastnisdoct: Image configured: Number of A-lines: %i\n", alines_in_image);
-				printf("fastnisdoct: Image configured: raw frame size: %i, processed frame size: %i\n", preprocessed_alines_size, processed_frame_size);
+				async_printf("fastnisdoct: Image configured: Number of A-lines: %i\n", alines_in_image);
+				async_printf("fastnisdoct: Image configured: raw frame size: %i, processed frame size: %i\n", preprocessed_alines_size, processed_frame_size);
 
 				// -- Predetermine indices to minimize copy operations  --------------------------------------------------------------------------
 				plan_acq_copy(msg.image_mask);
@@ -469,17 +709,19 @@ inline void recv_msg()
 				if (ni::set_scan_pattern(msg.scanpattern) == 0)
 				{
 					scan_defined = true;
-					printf("fastnisdoct: Buffered new scan pattern!\n");
+					async_printf("fastnisdoct: Buffered new scan pattern!\n");
 				}
 				else
 				{
-					printf("fastnisdoct: Error updating scan.\n");
+					async_printf("fastnisdoct: Error updating scan.\n");
 					ni::print_error_msg();
 				}
 				delete msg.scanpattern;  // Free the pattern memory
 
 				processing_configured = false;
 				set_up_processing_pool();
+				set_up_display_products();
+				set_up_spectrometer_stats();
 				processing_configured = true;
 
 				// -- Set back to READY --------------------------------------------------------------------------
@@ -490,27 +732,27 @@ inline void recv_msg()
 			}
 			else
 			{
-				printf("fastnisdoct: Cannot configure image! Not OPEN or READY.\n");
+				async_printf("fastnisdoct: Cannot configure image! Not OPEN or READY.\n");
 			}
-			if (restart)
+			if (restart && image_configured)  // Not without the buffers to scan into
 			{
 				start_scanning();
 			}
 		}
 		else if (msg.flag & MSG_CONFIGURE_PROCESSING)
 		{
-			printf("fastnisdoct: MSG_CONFIGURE_PROCESSING received\n");
+			async_printf("fastnisdoct: MSG_CONFIGURE_PROCESSING received\n");
 			auto current_state = state.load();
 			if (current_state == STATE_ACQUIRING)
 			{
-				printf("fastnisdoct: Cannot configure processing during acquisition.\n");
+				async_printf("fastnisdoct: Cannot configure processing during acquisition.\n");
 			}
 			else
 			{
 				processing_configured = false;
 
 				subtract_background = msg.subtract_background;
-				printf("fastnisdoct: Background subtraction %i\n", subtract_background);
+				async_printf("fastnisdoct: Background subtraction %i\n", subtract_background);
 				interp = msg.interp;
 				interpdk = msg.interpdk;
 				n_frame_avg = msg.n_frame_avg;
@@ -525,6 +767,8 @@ inline void recv_msg()
 				if (image_configured)
 				{
 					set_up_processing_pool();
+					set_up_display_products();
+					set_up_spectrometer_stats();
 					processing_configured = true;
 				}
 				// Transition to READY if necessary
@@ -536,7 +780,7 @@ inline void recv_msg()
 		}
 		else if (msg.flag & MSG_START_SCAN)
 		{
-			printf("fastnisdoct: MSG_START_SCAN received\n");
+			async_printf("fastnisdoct: MSG_START_SCAN received\n");
 			if (state.load() == STATE_READY)
 			{
 				// Initialize the AlineProcessingPool. This creates an FFTW plan and may take a long time.
@@ -545,7 +789,7 @@ inline void recv_msg()
 		}
 		else if (msg.flag & MSG_STOP_SCAN)
 		{
-			printf("fastnisdoct: MSG_STOP_SCAN received\n");
+			async_printf("fastnisdoct: MSG_STOP_SCAN received\n");
 			if (state.load() == STATE_ACQUIRING)
 			{
 				stop_acquisition();
@@ -557,33 +801,44 @@ inline void recv_msg()
 		}
 		else if (msg.flag & MSG_START_ACQUISITION)
 		{
-			printf("fastnisdoct: MSG_START_ACQUISITION received\n");
-			if (state.load() == STATE_SCANNING)
+			async_printf("fastnisdoct: MSG_START_ACQUISITION received\n");
+			if (processed_frame_streamer.is_streaming() || spectral_frame_streamer.is_streaming())
 			{
+				async_printf("fastnisdoct: Can't start acquisition: the previous acquisition is still being written to disk.\n");
+				delete[] msg.file_name;
+			}
+			else if (state.load() == STATE_SCANNING)
+			{
+				int64_t history;  // Pre-trigger frames are written in addition to the frames to acquire
 				if (msg.save_processed)
 				{
-					processed_image_buffer->clear();
+					int64_t first = begin_export(processed_image_buffer.get(), true, &history);
 					saving_processed = true;
+					processed_frame_streamer.set_frame_shape(roi_size, alines_per_bline, alines_in_image / alines_per_bline);
+					processed_frame_streamer.set_parameters(acquisition_parameters());
 					if (msg.n_frames_to_acquire > -1)
 					{
-						processed_frame_streamer.start(msg.file_name, msg.max_gb, (FileStreamType)msg.file_type, processed_image_buffer.get(), 0, roi_size * alines_in_image, msg.n_frames_to_acquire);
+						processed_frame_streamer.start(msg.file_name, msg.max_gb, (FileStreamType)msg.file_type, processed_image_buffer.get(), first, roi_size * alines_in_image, msg.n_frames_to_acquire + (int)history);
 					}
 					else
 					{
-						processed_frame_streamer.start(msg.file_name, msg.max_gb, (FileStreamType)msg.file_type, processed_image_buffer.get(), 0, roi_size * alines_in_image, -1);
+						processed_frame_streamer.start(msg.file_name, msg.max_gb, (FileStreamType)msg.file_type, processed_image_buffer.get(), first, roi_size * alines_in_image, -1);
 					}
 				}
 				else  // Save spectral data
 				{
-					spectral_image_buffer->clear();
+					int64_t first = begin_export(spectral_image_buffer.get(), false, &history);
 					saving_processed = false;
+					spectral_frame_streamer.set_frame_shape(aline_size, alines_per_bline, alines_in_image / alines_per_bline);
+					spectral_frame_streamer.set_parameters(acquisition_parameters());
+					spectral_frame_streamer.set_packed12(pack_spectra);
 					if (msg.n_frames_to_acquire > -1)
 					{
-						spectral_frame_streamer.start(msg.file_name, msg.max_gb, (FileStreamType)msg.file_type, spectral_image_buffer.get(), 0, preprocessed_alines_size, msg.n_frames_to_acquire);
+						spectral_frame_streamer.start(msg.file_name, msg.max_gb, (FileStreamType)msg.file_type, spectral_image_buffer.get(), first, spectral_ring_frame_size, msg.n_frames_to_acquire + (int)history);
 					}
 					else
 					{
-						spectral_frame_streamer.start(msg.file_name, msg.max_gb, (FileStreamType)msg.file_type, spectral_image_buffer.get(), 0, preprocessed_alines_size, -1);
+						spectral_frame_streamer.start(msg.file_name, msg.max_gb, (FileStreamType)msg.file_type, spectral_image_buffer.get(), first, spectral_ring_frame_size, -1);
 					}
 				}
 				ni::drive_start_trigger_high();
@@ -593,12 +848,79 @@ inline void recv_msg()
 		}
 		else if (msg.flag & MSG_STOP_ACQUISITION)
 		{
-			printf("fastnisdoct: MSG_STOP_ACQUISITION received\n");
+			async_printf("fastnisdoct: MSG_STOP_ACQUISITION received\n");
 			if (state.load() == STATE_ACQUIRING)
 			{
 				stop_acquisition();
 			}
 		}
+		else if (msg.flag & MSG_CONFIGURE_SPILL)
+		{
+			async_printf("fastnisdoct: MSG_CONFIGURE_SPILL received\n");
+			spectral_frame_streamer.set_spill(msg.file_name, msg.spill_frames);
+			processed_frame_streamer.set_spill(msg.file_name, msg.spill_frames);
+			delete[] msg.file_name;
+		}
+		else if (msg.flag & MSG_CONFIGURE_STRIPING)
+		{
+			async_printf("fastnisdoct: MSG_CONFIGURE_STRIPING received\n");
+			spectral_frame_streamer.set_stripes(msg.file_name);
+			processed_frame_streamer.set_stripes(msg.file_name);
+			delete[] msg.file_name;
+		}
+		else if (msg.flag & MSG_CONFIGURE_MAT)
+		{
+			async_printf("fastnisdoct: MSG_CONFIGURE_MAT received\n");
+			spectral_frame_streamer.set_mat_compression(msg.deflate_level);
+			processed_frame_streamer.set_mat_compression(msg.deflate_level);
+		}
+		else if (msg.flag & MSG_CONFIGURE_TIFF)
+		{
+			async_printf("fastnisdoct: MSG_CONFIGURE_TIFF received\n");
+			spectral_frame_streamer.set_tiff_format(msg.tiff_bits, msg.tiff_db_range[0], msg.tiff_db_range[1]);
+			processed_frame_streamer.set_tiff_format(msg.tiff_bits, msg.tiff_db_range[0], msg.tiff_db_range[1]);
+		}
+		else if (msg.flag & MSG_CONFIGURE_PACKING)
+		{
+			async_printf("fastnisdoct: MSG_CONFIGURE_PACKING received\n");
+			if (state.load() == STATE_ACQUIRING || spectral_frame_streamer.is_streaming())
+			{
+				async_printf("fastnisdoct: Can't change the packing of spectra while they are being written to disk.\n");
+			}
+			else if (msg.pack_spectra != pack_spectra)
+			{
+				pack_spectra = msg.pack_spectra;
+				if (spectral_image_buffer != NULL)
+				{
+					allocate_spectral_ring();
+					if (spectral_image_buffer->get_page_size() == 0)
+					{
+						async_printf("fastnisdoct: Failed to allocate the spectral ring. The image must be configured again!\n");
+						image_configured = false;
+						preprocessed_alines_size = 0;
+						if (state.load() == STATE_READY)
+						{
+							state.store(STATE_OPEN);
+						}
+					}
+				}
+			}
+		}
+		else if (msg.flag & MSG_CONFIGURE_PRETRIGGER)
+		{
+			async_printf("fastnisdoct: MSG_CONFIGURE_PRETRIGGER received\n");
+			pretrigger_frames = msg.pretrigger_frames;
+			pretrigger_processed = msg.save_processed;
+		}
+		else if (msg.flag & MSG_CONFIGURE_DISPLAY)
+		{
+			// Workers are never busy while messages are received, so the products can be reconfigured in place
+			display_config = msg.display_config;
+			if (display_products != NULL)
+			{
+				display_products->configure(display_config);
+			}
+		}
 	}
 }
 
@@ -608,6 +930,8 @@ void _main()
 {
 	// Initializations
 
+	TRACE_THREAD_NAME("main");
+
 	bool scanning_successfully;
 
 	LARGE_INTEGER frequency;
@@ -635,21 +959,58 @@ void _main()
 		}
 		else if (current_state == STATE_ERROR)
 		{
-			printf("fastnisdoct: Fatal error. Restart fastnisdoct.\n");
+			async_printf("fastnisdoct: Fatal error. Restart fastnisdoct.\n");
 			return;
 		}
 		else  // if SCANNING or ACQUIRING
 		{
 
-			processed_alines_addr = processed_image_buffer->lock_out_head();  // Lock out the export ring element we are writing to. This is what gets written to disk by a Writer
+			processed_alines_addr = processed_frame_display->get_back();  // Frames are processed in place in the display buffer and pushed to the export ring only if they are to be written to disk
 
 			QueryPerformanceCounter(&start);  // Time the frame processing to make sure we should be able to keep up
+			int64_t stage_start = start.QuadPart;
+
+			// Frames are fed to an export ring while acquiring, or while scanning if pre-trigger frames are kept
+			bool exporting = current_state == STATE_ACQUIRING || pretrigger_frames > 0;
+			bool exporting_processed = (current_state == STATE_ACQUIRING) ? saving_processed : pretrigger_processed;
+
+			// Display products are reduced by the workers unless repeat processing changes the layout of the frame after they finish
+			bool reduce_display_products = display_products_refresh.load();
+			bool workers_reduce_display_products = reduce_display_products && (processed_frame_size == processed_alines_size);
+			bool accumulate_spectrometer_stats = spectrometer_stats_refresh.load();
 
 			// Send async job to AlineProcessingPool unless we have not grabbed a frame yet
 			if (cumulative_frame_number > 0)
 			{
-				aline_proc_pool->submit(processed_alines_addr, (uint16_t*)raw_frame_roi.get(), interp, interpdk, &apodization_window[0], &background_spectrum[0]);
+				if (reduce_display_products)
+				{
+					display_products->begin_frame();
+				}
+				if (accumulate_spectrometer_stats)
+				{
+					spectrometer_stats->begin_frame(saturation_level.load());
+				}
+				aline_proc_pool->submit(processed_alines_addr, raw_frame_to_process, interp, interpdk, &apodization_window[0], &background_spectrum[0],
+					workers_reduce_display_products ? display_products.get() : NULL, accumulate_spectrometer_stats ? spectrometer_stats.get() : NULL);
+				pipeline_stats.record(PIPELINE_SUBMIT, stage_start, cumulative_frame_number - 1);
+			}
+
+			// If spectra are being recorded, the frame is assembled directly in the head of the export ring, which the pool
+			// then processes in place. Otherwise, or if the ring is full of borrowed frames, it is assembled in raw_frame_roi_new
+			uint16_t* raw_frame_dst = raw_frame_roi_new.get();
+			if (exporting && !exporting_processed && !pack_spectra)
+			{
+				stage_start = PipelineStats::now();
+				uint16_t* slot = spectral_image_buffer->lock_out_head();
+				if (slot != NULL)
+				{
+					raw_frame_dst = slot;
+				}
+				pipeline_stats.record(PIPELINE_RING_PUSH, stage_start, cumulative_frame_number);
 			}
+			bool assembled_in_slot = raw_frame_dst != raw_frame_roi_new.get();
+			CircAcqBorrow<uint16_t> assembled_slot;
+			assembled_slot.element = NULL;
 
 			// Set background spectrum to zero. We sum to it while holding each buffer
 			std::fill(background_spectrum_new.begin(), background_spectrum_new.end(), 0.0);
@@ -669,13 +1030,15 @@ void _main()
 				}
 
 				// Lock out frame with IMAQ function
+				stage_start = PipelineStats::now();
 				int examined = ni::examine_buffer(&locked_out_addr, cumulative_buffer_number);
+				stage_start = pipeline_stats.record(PIPELINE_BUFFER_WAIT, stage_start, cumulative_buffer_number);
 				if (examined > -1)
 				{
 					
 					if (examined != cumulative_buffer_number)
 					{
-						printf("fastnisdoct: Acquisition loop expected %i, got %i... Dropped frames.\n", cumulative_buffer_number, examined);
+						async_printf_every(LOG_PERIOD_MS, "fastnisdoct: Acquisition loop expected %i, got %i... Dropped frames.\n", cumulative_buffer_number, examined);
 						cumulative_buffer_number = examined;
 					}
 
@@ -684,27 +1047,39 @@ void _main()
 						aline_stamp_buffer[i_buf * alines_per_buffer + i] = locked_out_addr[i * aline_size];
 						locked_out_addr[i * aline_size] = 0;
 					}
+
+					int64_t buffer_time = stage_start;
+					if (i_buf == 0)
+					{
+						line_telemetry.frame_acquired(cumulative_frame_number, buffer_time);
+					}
+					int64_t dropped_lines = line_telemetry.analyse_buffer(&aline_stamp_buffer[i_buf * alines_per_buffer], alines_per_buffer, buffer_time);
+					if (dropped_lines > 0)
+					{
+						async_printf_every(LOG_PERIOD_MS, "fastnisdoct: A-line stamps skipped %lli lines before or within buffer %i.\n", dropped_lines, cumulative_buffer_number);
+					}
 					
 					// Copy buffer to frame
 					if (alines_in_image != alines_in_scan)
 					{
 						for (int j = 0; j < roi_cpy_map[i_buf].size(); j++)
 						{
-							memcpy(raw_frame_roi.get() + buffer_copy_p, locked_out_addr + std::get<0>(roi_cpy_map[i_buf][j]), std::get<1>(roi_cpy_map[i_buf][j]) * sizeof(uint16_t));
+							memcpy(raw_frame_dst + buffer_copy_p, locked_out_addr + std::get<0>(roi_cpy_map[i_buf][j]), std::get<1>(roi_cpy_map[i_buf][j]) * sizeof(uint16_t));
  							buffer_copy_p += std::get<1>(roi_cpy_map[i_buf][j]);
 						}
 					}
 					else
 					{
-						memcpy(raw_frame_roi.get() + buffer_copy_p, locked_out_addr, alines_per_buffer * aline_size * sizeof(uint16_t));
-						buffer_copy_p += i_buf * alines_per_buffer * aline_size;
+						memcpy(raw_frame_dst + buffer_copy_p, locked_out_addr, alines_per_buffer * aline_size * sizeof(uint16_t));
+						buffer_copy_p += alines_per_buffer * aline_size;
 					}
 
 					if (ni::release_buffer() != 0)
 					{
-						printf("fastnisdoct: Failed to release buffer!\n");
+						async_printf("fastnisdoct: Failed to release buffer!\n");
 						ni::print_error_msg();
 					}
+					pipeline_stats.record(PIPELINE_COPY, stage_start, cumulative_buffer_number);
 
 					cumulative_buffer_number += 1;
 					i_buf++;
@@ -712,11 +1087,11 @@ void _main()
 				}
 				else  // If frame not grabbed properly
 				{
-					printf("fastnisdoct: Error examining buffer %i.\n", cumulative_buffer_number);
+					async_printf("fastnisdoct: Error examining buffer %i.\n", cumulative_buffer_number);
 					ni::print_error_msg();
 					if (ni::release_buffer() != 0)
 					{
-						printf("fastnisdoct: Failed to release buffer!\n");
+						async_printf("fastnisdoct: Failed to release buffer!\n");
 						ni::print_error_msg();
 					}
 					scanning_successfully = false;
@@ -725,11 +1100,27 @@ void _main()
 
 			}  // Buffers per frame
 
-			if (!saving_processed && current_state == STATE_ACQUIRING)
+			if (assembled_in_slot)
 			{
-				uint16_t* spectral_dst = spectral_image_buffer->lock_out_head();
-				memcpy(spectral_dst, raw_frame_roi.get(), preprocessed_alines_size * sizeof(uint16_t));
-				spectral_image_buffer->release_head();
+				if (scanning_successfully)
+				{
+					spectral_image_buffer->release_head(&assembled_slot);  // Publish the frame but keep it until the pool has processed it
+				}
+				else
+				{
+					spectral_image_buffer->abandon_head();
+				}
+			}
+			else if (exporting && !exporting_processed && pack_spectra && scanning_successfully)  // Pack the assembled frame into the ring
+			{
+				stage_start = PipelineStats::now();
+				uint16_t* slot = spectral_image_buffer->lock_out_head();
+				if (slot != NULL)
+				{
+					pack12(raw_frame_dst, preprocessed_alines_size, slot);
+					spectral_image_buffer->release_head();
+				}
+				pipeline_stats.record(PIPELINE_RING_PUSH, stage_start, cumulative_frame_number);
 			}
 
 			// Only process a frame if we need it for export or if it is time to display one
@@ -742,7 +1133,7 @@ void _main()
 					{
 						for (int j = 0; j < aline_size; j++)
 						{
-							background_spectrum_new[j] += raw_frame_roi_new.get()[aline_size * i + j];
+							background_spectrum_new[j] += raw_frame_dst[aline_size * i + j];
 						}
 					}
 					// Normalize the background spectrum
@@ -760,15 +1151,12 @@ void _main()
 					std::fill(background_spectrum.begin(), background_spectrum.end(), 0.0);
 				}
 
-				// Pointer swap new grab buffer buffer in
-				std::swap(raw_frame_roi, raw_frame_roi_new);
-
 				// Buffer a spectrum for output to GUI
 				if (spectrum_display_buffer_refresh.load())
 				{
 					for (int i = 0; i < aline_size; i++)
 					{
-						spectrum_display_buffer[i] = raw_frame_roi.get()[i] - background_spectrum[i] * (int)(subtract_background);  // Always grab from beginning of the buffer 
+						spectrum_display_buffer[i] = raw_frame_dst[i] - background_spectrum[i] * (int)(subtract_background);  // Always grab from beginning of the buffer 
 					}
 					spectrum_display_buffer_refresh.store(false);
 				}
@@ -777,99 +1165,86 @@ void _main()
 				if (cumulative_frame_number > 0)
 				{
 					// Wait for async job to finish. If the above is false, we haven't started one yet
+					stage_start = PipelineStats::now();
 					int spins = 0;
 					while (!aline_proc_pool->is_finished())
 					{
 						spins += 1;
 					}
+					stage_start = pipeline_stats.record(PIPELINE_JOIN_WAIT, stage_start, cumulative_frame_number - 1);
 
-					fftwf_complex r;
-					int alines_per_bline_now;  // A-lines per B-line following A-line repeat processing
-					if (a_rpt_proc_flag == REPEAT_PROCESSING_MEAN && n_aline_repeat > 1)  // A-line averaging
-					{
-						alines_per_bline_now = alines_per_bline / n_aline_repeat;
-						for (int b = 0; b < alines_in_image / alines_per_bline; b++)  // For each B-line in the preprocessed frames
-						{
-							for (int x = 0; x < alines_per_bline_now; x++)  // For each A-line in the reduced B-line
-							{
-								for (int z = 0; z < roi_size; z++)
-								{
-									r[0] = 0;
-									r[1] = 0;
-									for (int k = 0; k < n_aline_repeat; k++)
-									{
-										r[0] += processed_alines_addr[(b * alines_per_bline + x * n_aline_repeat + k) * roi_size + z][0];
-										r[1] += processed_alines_addr[(b * alines_per_bline + x * n_aline_repeat + k) * roi_size + z][1];
-									}
-									processed_alines_addr[(b * alines_per_bline_now + x) * roi_size + z][0] = r[0] / n_aline_repeat;
-									processed_alines_addr[(b * alines_per_bline_now + x) * roi_size + z][1] = r[1] / n_aline_repeat;
-								}
-							}
-						}
-					}
-					else
+					if (accumulate_spectrometer_stats)
 					{
-						// If A-line repeats are left in the frame for B-line processing
-						alines_per_bline_now = alines_per_bline;
+						spectrometer_stats->finish(cumulative_frame_number - 1);
+						spectrometer_stats_refresh.store(false);
 					}
 
-					if (b_rpt_proc_flag > REPEAT_PROCESSING_NONE && n_bline_repeat > 1)
+					process_repeats(processed_alines_addr, roi_size, alines_in_image, alines_per_bline, n_aline_repeat, n_bline_repeat, a_rpt_proc_flag, b_rpt_proc_flag);
+
+					pipeline_stats.record(PIPELINE_REPEAT_PROCESSING, stage_start, cumulative_frame_number - 1);
+
+					// Perform frame averaging
+
+					if (reduce_display_products)
 					{
-						for (int b = 0; b < alines_in_image / alines_per_bline; b++)  // For each B-line in the (potentially A-line averaged) preprocessed frames
+						if (!workers_reduce_display_products)
 						{
-							for (int x = 0; x < alines_per_bline_now / n_bline_repeat; x++)  // For each element of each B-line (minus repeats)
-							{
-
-								if (b_rpt_proc_flag == REPEAT_PROCESSING_DIFF && n_bline_repeat == 2)
-								{
-									for (int z = 0; z < roi_size; z++)
-									{
-										processed_alines_addr[(b * alines_per_bline_now / 2 + x) * roi_size + z][0] = std::abs(processed_alines_addr[(b * alines_per_bline_now + x) * roi_size + z][0] - processed_alines_addr[(b * alines_per_bline_now + x + alines_per_bline_now / 2) * roi_size + z][0]);
-										processed_alines_addr[(b * alines_per_bline_now / 2 + x) * roi_size + z][1] = std::abs(processed_alines_addr[(b * alines_per_bline_now + x) * roi_size + z][1] - processed_alines_addr[(b * alines_per_bline_now + x + alines_per_bline_now / 2) * roi_size + z][1]);
-									}
-								}
-								else  // REPEAT_PROCESSING_AVERAGING
-								{
-									float norm = 1.0 / n_bline_repeat;
-									for (int z = 0; z < roi_size; z++)
-									{
-										r[0] = 0.0;
-										r[1] = 0.0;
-										for (int k = 0; k < n_bline_repeat; k++)
-										{
-											r[0] += processed_alines_addr[(b * alines_per_bline_now + x + (alines_per_bline_now / n_bline_repeat) * k) * roi_size + z][0];
-											r[1] += processed_alines_addr[(b * alines_per_bline_now + x + (alines_per_bline_now / n_bline_repeat) * k) * roi_size + z][1];
-										}
-										processed_alines_addr[(b * (alines_per_bline_now / n_bline_repeat) + x) * roi_size + z][0] = r[0] * norm;
-										processed_alines_addr[(b * (alines_per_bline_now / n_bline_repeat) + x) * roi_size + z][1] = r[1] * norm;
-									}
-								}
-							}
+							display_products->accumulate(processed_alines_addr, 0, processed_frame_size / roi_size, 0);
 						}
+						display_products->finish(cumulative_frame_number - 1);
+						display_products_refresh.store(false);
 					}
 
-					// Perform frame averaging
-
-					// Buffer an image for output to GUI
-					if (image_display_buffer_refresh.load())
+					// Export the frame to be written to disk by a Writer
+					if (exporting && exporting_processed)
 					{
-						memcpy(image_display_buffer.get(), processed_alines_addr, processed_frame_size * sizeof(fftwf_complex));
-						image_display_buffer_refresh.store(false);
+						stage_start = PipelineStats::now();
+						processed_image_buffer->push(processed_alines_addr);
+						pipeline_stats.record(PIPELINE_RING_PUSH, stage_start, cumulative_frame_number - 1);
 					}
 
+					// Hand the frame to the client and receive a new buffer to process the next into
+					processed_frame_display->publish(cumulative_frame_number - 1);
+					frame_notifier.notify(cumulative_frame_number - 1);
+					line_telemetry.frame_processed(cumulative_frame_number - 1, LineTelemetry::now());
+
 					QueryPerformanceCounter(&end);
 					frame_processing_period = (float)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+					pipeline_stats.record(PIPELINE_FRAME, start.QuadPart, cumulative_frame_number - 1);
 
 					if (cumulative_frame_number % 256 == 0)
 					{
-						printf("fastnisdoct: Processed frame %i elapsed %f, %f Hz, \n", cumulative_frame_number - 1, frame_processing_period, 1.0 / frame_processing_period);
-						fflush(stdout);
+						async_printf("fastnisdoct: Processed frame %i elapsed %f, %f Hz, \n", cumulative_frame_number - 1, frame_processing_period, 1.0 / frame_processing_period);
 					}
 				}
 				cumulative_frame_number++;
 			}
-			while (!aline_proc_pool->is_finished()) {}  // Don't release buffer without joining the task'
-			processed_image_buffer->release_head();
+			while (!aline_proc_pool->is_finished()) {}  // Don't reuse the buffer without joining the task
+
+			// The frame just assembled is processed next
+			if (scanning_successfully)
+			{
+				if (raw_frame_slot.element != NULL)
+				{
+					spectral_image_buffer->release(&raw_frame_slot);
+				}
+				if (assembled_in_slot)
+				{
+					raw_frame_slot = assembled_slot;
+					raw_frame_to_process = raw_frame_dst;
+				}
+				else
+				{
+					std::swap(raw_frame_roi, raw_frame_roi_new);
+					raw_frame_to_process = raw_frame_roi.get();
+				}
+			}
+			else if (raw_frame_slot.element != NULL)  // Don't keep the last frame pinned in the ring while scanning has failed or stopped
+			{
+				memcpy(raw_frame_roi.get(), raw_frame_to_process, preprocessed_alines_size * sizeof(uint16_t));  // It is processed again next
+				spectral_image_buffer->release(&raw_frame_slot);
+				raw_frame_to_process = raw_frame_roi.get();
+			}
 		}
 	}
 	if (state.load() == STATE_ACQUIRING)
@@ -880,8 +1255,7 @@ void _main()
 	{
 		stop_scanning();
 	}
-	printf("fastnisdoct: Main thread exiting\n");
-	fflush(stdout);
+	async_printf("fastnisdoct: Main thread exiting\n");
 }
 
 
@@ -898,35 +1272,36 @@ extern "C"  // DLL interface. Functions should enqueue messages or interact with
 	{
 		if (main_running.load())
 		{
-			printf("fastnisdoct: Can't open controller, already open\n");
+			async_printf("fastnisdoct: Can't open controller, already open\n");
 			return;
 		}
-		printf("fastnisdoct: Opening NI hardware interface:\n");
-		printf("fastnisdoct: Camera ID: %s\n", cam_name);
-		printf("fastnisdoct: X channel ID: %s\n", ao_x_ch);
-		printf("fastnisdoct: Y channel ID: %s\n", ao_y_ch);
-		printf("fastnisdoct: Line trig channel ID: %s\n", ao_lt_ch);
-		printf("fastnisdoct: Start trigger channel ID: %s\n", ao_st_ch);
+		async_logger().start();
+		async_printf("fastnisdoct: Opening NI hardware interface:\n");
+		async_printf("fastnisdoct: Camera ID: %s\n", cam_name);
+		async_printf("fastnisdoct: X channel ID: %s\n", ao_x_ch);
+		async_printf("fastnisdoct: Y channel ID: %s\n", ao_y_ch);
+		async_printf("fastnisdoct: Line trig channel ID: %s\n", ao_lt_ch);
+		async_printf("fastnisdoct: Start trigger channel ID: %s\n", ao_st_ch);
 
 		// If you don't use these strings here, dynamically put them somewhere until you do--their values are undefined once Python scope changes or if enqueued
 
 		if (ni::imaq_open(cam_name) == 0)
 		{
-			printf("fastnisdoct: NI IMAQ interface opened.\n");
+			async_printf("fastnisdoct: NI IMAQ interface opened.\n");
 			if (ni::daq_open(ao_x_ch, ao_y_ch, ao_lt_ch, ao_st_ch) == 0)
 			{
-				printf("fastnisdoct: NI DAQmx interface opened.\n");
+				async_printf("fastnisdoct: NI DAQmx interface opened.\n");
 				init_fastnisdoct();
 				main_running = true;
 				main_t = std::thread(&_main);
 				return;
 			}
-			printf("fastnisdoct: Failed to open DAQmx interface.\n");
+			async_printf("fastnisdoct: Failed to open DAQmx interface.\n");
 			ni::print_error_msg();
 		}
 		else
 		{
-			printf("fastnisdoct: Failed to open IMAQ interface.\n");
+			async_printf("fastnisdoct: Failed to open IMAQ interface.\n");
 			ni::print_error_msg();
 		}
 	}
@@ -937,21 +1312,24 @@ extern "C"  // DLL interface. Functions should enqueue messages or interact with
 		{
 			main_running = false;
 			main_t.join();
+			spectral_frame_streamer.stop();  // A stream still draining reads from the rings
+			processed_frame_streamer.stop();
 			StateMsg msg;
 			while (msg_queue.dequeue(msg)) {}  // Empty the message queue
 			if (ni::daq_close() == 0 && ni::imaq_close() == 0)
 			{
-				printf("fastnisdoct: NI IMAQ and NI DAQmx interfaces closed.\n");
+				async_printf("fastnisdoct: NI IMAQ and NI DAQmx interfaces closed.\n");
 			}
 			else
 			{
-				printf("fastnisdoct: Failed to close NI IMAQ and NI DAQmx interfaces.\n");
+				async_printf("fastnisdoct: Failed to close NI IMAQ and NI DAQmx interfaces.\n");
 				ni::print_error_msg();
 			}
+			async_logger().stop();
 		}
 		else
 		{
-			printf("fastnisdoct: Can't close: fastnisdoct not running!\n");
+			async_printf("fastnisdoct: Can't close: fastnisdoct not running!\n");
 		}
 	}
 
@@ -1058,6 +1436,203 @@ extern "C"  // DLL interface. Functions should enqueue messages or interact with
 		msg_queue.enqueue(msg);
 	}
 
+	// Spill up to n_frames frames to a temporary file at path when the writer falls behind the ring. Takes effect the
+	// next time acquisition is started. 0 to disable.
+	__declspec(dllexport) void nisdoct_configure_spill(const char* path, int n_frames)
+	{
+		StateMsg msg;
+		msg.file_name = new char[512];
+		memcpy((void*)msg.file_name, path, strlen(path) * sizeof(char) + 1);
+		msg.spill_frames = n_frames;
+		msg.flag = MSG_CONFIGURE_SPILL;
+		msg_queue.enqueue(msg);
+	}
+
+	// Stripe frames written to disk round-robin across one file in each of directories, separated by semicolons, each
+	// with its own writer thread. Takes effect the next time acquisition is started. An empty string disables striping.
+	__declspec(dllexport) void nisdoct_configure_striping(const char* directories)
+	{
+		StateMsg msg;
+		msg.file_name = new char[strlen(directories) + 1];
+		memcpy((void*)msg.file_name, directories, strlen(directories) * sizeof(char) + 1);
+		msg.flag = MSG_CONFIGURE_STRIPING;
+		msg_queue.enqueue(msg);
+	}
+
+	// Deflate .mat files at deflate_level 1-9 on a pool of compression threads, or 0 to write them uncompressed. Takes
+	// effect the next time acquisition is started. Requires a build with FASTNISDOCT_HDF5.
+	__declspec(dllexport) void nisdoct_configure_mat(int deflate_level)
+	{
+		StateMsg msg;
+		msg.deflate_level = deflate_level;
+		msg.flag = MSG_CONFIGURE_MAT;
+		msg_queue.enqueue(msg);
+	}
+
+	// Write the pages of .tif files as bits_per_sample 8 or 16 bit unsigned integers or 32 bit floats. Processed frames
+	// are written in dB, scaled from db_min to db_max if written as integers. Takes effect the next time acquisition
+	// is started.
+	__declspec(dllexport) void nisdoct_configure_tiff(int bits_per_sample, float db_min, float db_max)
+	{
+		StateMsg msg;
+		msg.tiff_bits = bits_per_sample;
+		msg.tiff_db_range[0] = db_min;
+		msg.tiff_db_range[1] = db_max;
+		msg.flag = MSG_CONFIGURE_TIFF;
+		msg_queue.enqueue(msg);
+	}
+
+	// Pack raw spectra to 12 bits in the export ring and on disk if packed is true. The spectra written to disk are then
+	// packed per nisdoct_unpack12. Samples of 4096 and above are truncated. Can't be changed during acquisition.
+	__declspec(dllexport) void nisdoct_configure_packing(bool packed)
+	{
+		StateMsg msg;
+		msg.pack_spectra = packed;
+		msg.flag = MSG_CONFIGURE_PACKING;
+		msg_queue.enqueue(msg);
+	}
+
+	// Unpack n 12-bit samples, packed two to every three bytes of src, into dst
+	__declspec(dllexport) void nisdoct_unpack12(const void* src, int64_t n, uint16_t* dst)
+	{
+		unpack12(src, n, dst);
+	}
+
+	// Map the recording made to file, without its suffix. Returns a handle to pass to the nisdoct_reader functions, or
+	// NULL if the recording can't be read. Requires no hardware.
+	__declspec(dllexport) void* nisdoct_reader_open(const char* file)
+	{
+		RecordingReader* reader = new RecordingReader;
+		if (!reader->open(file))
+		{
+			delete reader;
+			return NULL;
+		}
+		return reader;
+	}
+
+	__declspec(dllexport) void nisdoct_reader_close(void* reader)
+	{
+		delete (RecordingReader*)reader;
+	}
+
+	// Number of frames in the recording
+	__declspec(dllexport) int64_t nisdoct_reader_frames(void* reader)
+	{
+		return ((RecordingReader*)reader)->frames();
+	}
+
+	// Copy the shape [z, x, y] of the frames and their size in bytes to dst. Returns the RecordingDtype of the frames
+	__declspec(dllexport) int nisdoct_reader_geometry(void* reader, int64_t* dst)
+	{
+		RecordingReader* r = (RecordingReader*)reader;
+		memcpy(dst, r->shape(), 3 * sizeof(int64_t));
+		dst[3] = r->frame_bytes();
+		return r->dtype();
+	}
+
+	// Copy the acquisition count, timestamp, offset, part and frames dropped before the k-th frame to dst. Returns -1 if
+	// there is no k-th frame
+	__declspec(dllexport) int nisdoct_reader_record(void* reader, int64_t k, int64_t* dst)
+	{
+		const FrameIndexRecord* r = ((RecordingReader*)reader)->record(k);
+		if (r == NULL)
+		{
+			return -1;
+		}
+		dst[0] = r->count;
+		dst[1] = r->timestamp;
+		dst[2] = r->offset;
+		dst[3] = r->part;
+		dst[4] = r->dropped_before;
+		return 0;
+	}
+
+	// Address of the k-th frame in place, valid until the reader is closed. NULL if it can't be read
+	__declspec(dllexport) const void* nisdoct_reader_frame(void* reader, int64_t k)
+	{
+		return ((RecordingReader*)reader)->frame(k);
+	}
+
+	// Address of frames k through k + n - 1 in place if they are contiguous, otherwise NULL
+	__declspec(dllexport) const void* nisdoct_reader_slab(void* reader, int64_t k, int64_t n)
+	{
+		return ((RecordingReader*)reader)->slab(k, n);
+	}
+
+	// Read frames k through k + n - 1 from disk in the background
+	__declspec(dllexport) void nisdoct_reader_prefetch(void* reader, int64_t k, int64_t n)
+	{
+		((RecordingReader*)reader)->prefetch(k, n);
+	}
+
+	// Process the raw spectra recorded to in_file with the given parameters and all cores and write the processed frames
+	// to out_file as a recording of file_type, as if they had been acquired. apod_window has a sample per spectral bin
+	// or is NULL. Blocks until every frame has been written. Requires no hardware and does not need the controller to
+	// be open. Returns the number of frames written or -1 if the recording can't be reprocessed
+	__declspec(dllexport) int64_t nisdoct_reprocess(
+		const char* in_file,
+		const char* out_file,
+		int file_type,
+		float max_gb,
+		int roi_offset,
+		int roi_size,
+		bool subtract_background,
+		bool interp,
+		double interpdk,
+		float* apod_window,
+		int n_aline_repeat,
+		int n_bline_repeat,
+		int a_rpt_proc_flag,
+		int b_rpt_proc_flag
+	)
+	{
+		ReprocessingConfig config;
+		config.roi_offset = roi_offset;
+		config.roi_size = roi_size;
+		config.subtract_background = subtract_background;
+		config.interp = interp;
+		config.interpdk = interpdk;
+		config.apod_window = apod_window;
+		config.n_aline_repeat = n_aline_repeat;
+		config.n_bline_repeat = n_bline_repeat;
+		config.a_rpt_proc_flag = (RepeatProcessingType)a_rpt_proc_flag;
+		config.b_rpt_proc_flag = (RepeatProcessingType)b_rpt_proc_flag;
+		std::unique_ptr<Reprocessor> reprocessor = std::make_unique<Reprocessor>();
+		return reprocessor->run(in_file, out_file, (FileStreamType)file_type, max_gb, config);
+	}
+
+	// Keep the latest n_frames frames in the export ring while scanning, processed frames if processed is true or spectra
+	// otherwise, so that an acquisition of the same kind begins by writing them. 0 to disable. Limited by the ring size.
+	__declspec(dllexport) void nisdoct_configure_pretrigger(int n_frames, bool processed)
+	{
+		StateMsg msg;
+		msg.pretrigger_frames = n_frames;
+		msg.save_processed = processed;
+		msg.flag = MSG_CONFIGURE_PRETRIGGER;
+		msg_queue.enqueue(msg);
+	}
+
+	// Like nisdoct_start_bin_acquisition, with the FileStreamType of the files to write
+	__declspec(dllexport) void nisdoct_start_acquisition(
+		const char* file,
+		int file_type,
+		float max_gb,
+		int n_frames_to_acquire,
+		bool save_processed
+	)
+	{
+		StateMsg msg;
+		msg.file_name = new char[512];
+		memcpy((void*)msg.file_name, file, strlen(file) * sizeof(char) + 1);
+		msg.max_gb = max_gb;
+		msg.file_type = file_type;
+		msg.n_frames_to_acquire = n_frames_to_acquire;
+		msg.save_processed = save_processed;
+		msg.flag = MSG_START_ACQUISITION;
+		msg_queue.enqueue(msg);
+	}
+
 	__declspec(dllexport) void nisdoct_stop_acquisition()
 	{
 		StateMsg msg;
@@ -1090,14 +1665,17 @@ extern "C"  // DLL interface. Functions should enqueue messages or interact with
 		auto current_state = state.load();
 		if (current_state == STATE_SCANNING || current_state == STATE_ACQUIRING)
 		{
-			if (image_display_buffer_refresh.load())
+			fftwf_complex* frame;
+			int64_t n = processed_frame_display->borrow(&frame);
+			if (n == -1)
 			{
 				return -1;  // No new frame ready
 			}
 			else
 			{
-				memcpy(dst, image_display_buffer.get(), processed_frame_size * sizeof(fftwf_complex));
-				image_display_buffer_refresh.store(true);
+				line_telemetry.frame_displayed(n, LineTelemetry::now());
+				memcpy(dst, frame, processed_frame_size * sizeof(fftwf_complex));
+				processed_frame_display->release();
 				return 0;
 			}
 		}
@@ -1107,6 +1685,129 @@ extern "C"  // DLL interface. Functions should enqueue messages or interact with
 		}
 	}
 
+	// Borrow the latest processed frame without a copy. *dst is valid until nisdoct_release_frame is called.
+	// Returns the number of the frame or -1 if no new frame is ready, in which case nothing needs to be released.
+	__declspec(dllexport) int nisdoct_borrow_frame(fftwf_complex** dst)
+	{
+		auto current_state = state.load();
+		if (current_state == STATE_SCANNING || current_state == STATE_ACQUIRING)
+		{
+			int64_t n = processed_frame_display->borrow(dst);
+			if (n > -1)
+			{
+				line_telemetry.frame_displayed(n, LineTelemetry::now());
+			}
+			return (int)n;
+		}
+		else
+		{
+			return -1;
+		}
+	}
+
+	__declspec(dllexport) void nisdoct_release_frame()
+	{
+		if (processed_frame_display != NULL)
+		{
+			processed_frame_display->release();
+		}
+	}
+
+	__declspec(dllexport) void nisdoct_configure_display(
+		int bscan_axis,
+		int bscan_projection,
+		int bscan_index,
+		int enface_projection,
+		int enface_index,
+		bool log_scale,
+		bool auto_levels,
+		float percentile_low,
+		float percentile_high,
+		float* bscan_levels,
+		float* enface_levels
+	)
+	{
+		StateMsg msg;
+		msg.display_config.bscan_axis = bscan_axis;
+		msg.display_config.bscan_projection = bscan_projection;
+		msg.display_config.bscan_index = bscan_index;
+		msg.display_config.enface_projection = enface_projection;
+		msg.display_config.enface_index = enface_index;
+		msg.display_config.log_scale = log_scale;
+		msg.display_config.auto_levels = auto_levels;
+		msg.display_config.percentile_low = percentile_low;
+		msg.display_config.percentile_high = percentile_high;
+		memcpy(msg.display_config.bscan_levels, bscan_levels, 2 * sizeof(float));
+		memcpy(msg.display_config.enface_levels, enface_levels, 2 * sizeof(float));
+		msg.flag = MSG_CONFIGURE_DISPLAY;
+		msg_queue.enqueue(msg);
+	}
+
+	// Copies the latest uint8 B-scan and en face images, their histograms and the levels used to quantize them.
+	// bscan must be large enough for either B-scan axis. Returns the DisplayBScanAxis of the B-scan or -1 if no new products are ready.
+	__declspec(dllexport) int nisdoct_grab_display(uint8_t* bscan, uint8_t* enface, uint32_t* histograms, float* levels)
+	{
+		if (!client_borrow(display_products_client))  // Being replaced
+		{
+			return -1;
+		}
+		auto current_state = state.load();
+		if (current_state == STATE_SCANNING || current_state == STATE_ACQUIRING)
+		{
+			if (display_products_refresh.load())
+			{
+				client_release(display_products_client);
+				return -1;
+			}
+			else
+			{
+				memcpy(bscan, display_products->bscan_image.get(), display_products->bscan_image_size() * sizeof(uint8_t));
+				memcpy(enface, display_products->enface_image.get(), display_products->enface_size() * sizeof(uint8_t));
+				memcpy(histograms, display_products->bscan_histogram, DISPLAY_HISTOGRAM_BINS * sizeof(uint32_t));
+				memcpy(histograms + DISPLAY_HISTOGRAM_BINS, display_products->enface_histogram, DISPLAY_HISTOGRAM_BINS * sizeof(uint32_t));
+				memcpy(levels, display_products->bscan_levels, 2 * sizeof(float));
+				memcpy(levels + 2, display_products->enface_levels, 2 * sizeof(float));
+				int axis = display_products->bscan_image_axis;
+				line_telemetry.frame_displayed(display_products->frame_number, LineTelemetry::now());
+				display_products_refresh.store(true);
+				client_release(display_products_client);
+				return axis;
+			}
+		}
+		else
+		{
+			client_release(display_products_client);
+			return -1;
+		}
+	}
+
+	// Block until a frame newer than last_frame is ready to be grabbed or borrowed. Returns its number, or -1 if
+	// timed out, if scanning stopped or if not scanning.
+	__declspec(dllexport) int nisdoct_wait_frame(int last_frame, int timeout_ms)
+	{
+		auto current_state = state.load();
+		if (current_state == STATE_SCANNING || current_state == STATE_ACQUIRING)
+		{
+			return (int)frame_notifier.wait(last_frame, timeout_ms);
+		}
+		else
+		{
+			return -1;
+		}
+	}
+
+	// Auto-reset event set each time a frame is ready or scanning stops. For one client only, as each wakeup wakes one waiter
+	__declspec(dllexport) HANDLE nisdoct_get_frame_event()
+	{
+		return frame_notifier.handle();
+	}
+
+	// cb is called with the frame number on the acquisition thread each time a frame is ready. Pass NULL to unregister.
+	__declspec(dllexport) void nisdoct_set_frame_callback(FrameCallback cb)
+	{
+		frame_notifier.set_callback(cb);
+	}
+
 	__declspec(dllexport) int nisdoct_grab_spectrum(float* dst)
 	{
 		auto current_state = state.load();
@@ -1129,6 +1830,110 @@ extern "C"  // DLL interface. Functions should enqueue messages or interact with
 		}
 	}
 
+	// Grab the spectrometer stats of the latest frame. saturated must hold an int for each A-line in the image and summary
+	// SPECTROMETER_STATS_SUMMARY_SIZE floats. Returns the frame number or -1 if no new stats are available.
+	__declspec(dllexport) int nisdoct_grab_spectrometer_stats(float* mean_spectrum, float* max_spectrum, int32_t* saturated, float* summary)
+	{
+		if (!client_borrow(spectrometer_stats_client))  // Being replaced
+		{
+			return -1;
+		}
+		auto current_state = state.load();
+		if (current_state == STATE_SCANNING || current_state == STATE_ACQUIRING)
+		{
+			if (spectrometer_stats_refresh.load())
+			{
+				client_release(spectrometer_stats_client);
+				return -1;
+			}
+			else
+			{
+				memcpy(mean_spectrum, spectrometer_stats->mean_spectrum.get(), spectrometer_stats->aline_size * sizeof(float));
+				memcpy(max_spectrum, spectrometer_stats->max_spectrum.get(), spectrometer_stats->aline_size * sizeof(float));
+				memcpy(saturated, spectrometer_stats->saturated.get(), spectrometer_stats->number_of_alines * sizeof(int32_t));
+				spectrometer_stats->summary(summary);
+				int frame_number = (int)spectrometer_stats->frame_number;
+				spectrometer_stats_refresh.store(true);
+				client_release(spectrometer_stats_client);
+				return frame_number;
+			}
+		}
+		else
+		{
+			client_release(spectrometer_stats_client);
+			return -1;
+		}
+	}
+
+	// Copy LINE_TELEMETRY_COUNTERS counters [lines, dropped lines, gaps, discontinuities, frames processed, frames displayed]
+	// and LINE_TELEMETRY_HISTOGRAMS histograms of LOG_HISTOGRAM_SNAPSHOT_SIZE [count, sum, max, buckets...] in ns
+	// [line period jitter, stamp to processed, stamp to display]
+	__declspec(dllexport) void nisdoct_get_line_telemetry(int64_t* counters, uint64_t* histograms)
+	{
+		line_telemetry.snapshot(counters, histograms);
+	}
+
+	// Discard any recorded trace events and begin recording pipeline events
+	__declspec(dllexport) void nisdoct_start_trace()
+	{
+		trace_recorder().start();
+	}
+
+	// Stop recording pipeline events and write them to path as Chrome trace JSON. Returns the number of events written
+	// or -1 if the file could not be opened.
+	__declspec(dllexport) int nisdoct_dump_trace(const char* path)
+	{
+		return (int)trace_recorder().dump(path);
+	}
+
+	// Copy PIPELINE_STAGE_COUNT histograms of LOG_HISTOGRAM_SNAPSHOT_SIZE [count, sum, max, buckets...] of the time in ns
+	// spent in each PipelineStage. Returns the number of stages.
+	__declspec(dllexport) int nisdoct_get_stats(uint64_t* histograms)
+	{
+		pipeline_stats.snapshot(histograms);
+		return PIPELINE_STAGE_COUNT;
+	}
+
+	// Copy the size in bytes of the pages backing the IMAQ buffers, the spectral ring and the processed ring to dst. 0 if
+	// not allocated. Returns the number of sizes.
+	__declspec(dllexport) int nisdoct_get_page_sizes(int64_t* dst)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			dst[i] = page_sizes[i].load();
+		}
+		return 3;
+	}
+
+	// Raw bytes per byte written to disk by the latest compressed acquisition of spectra, live while it is written. 0 if
+	// none has been written.
+	__declspec(dllexport) double nisdoct_get_compression_ratio()
+	{
+		return spectral_frame_streamer.get_compression_ratio();
+	}
+
+	__declspec(dllexport) void nisdoct_reset_stats()
+	{
+		pipeline_stats.reset();
+	}
+
+	__declspec(dllexport) void nisdoct_reset_line_telemetry()
+	{
+		line_telemetry.reset();
+	}
+
+	// The camera's line stamp advances by stamp_increment each A-line and wraps at stamp_modulus
+	__declspec(dllexport) void nisdoct_configure_line_telemetry(int stamp_increment, int stamp_modulus)
+	{
+		line_telemetry.configure(stamp_increment, stamp_modulus);
+	}
+
+	// Pixel value at or above which spectrometer pixels are counted as saturated
+	__declspec(dllexport) void nisdoct_set_saturation_level(int level)
+	{
+		saturation_level.store(level);
+	}
+
 }
 
 
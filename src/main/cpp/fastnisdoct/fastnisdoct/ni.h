@@ -2,6 +2,8 @@
 
 #include "niimaq.h"
 #include "NIDAQmx.h"
+#include "AsyncLogger.h"
+#include "LargePageArena.h"
 
 // TODO remove. For testing
 #include <stdlib.h>
@@ -31,6 +33,7 @@ uInt32 examined_number;  // Cumulative number of the currently examined IMAQ rin
 Int8** imaq_buffers;  // Ring buffer elements managed by IMAQ
 
 uint16_t** buffers = NULL;  // Ring buffer elements allocated manually
+LargePageArena* buffer_arena = NULL;  // Locked memory of the ring buffer elements
 
 // NI-DAQ
 
@@ -88,13 +91,13 @@ inline void print_daqmx_error_msg(int error_code)
 	{
 		char* buf = new char[512];
 		DAQmxGetErrorString(error_code, buf, 512);
-		printf(buf);
-		printf("\n");
+		async_printf("%s", buf);
+		async_printf("\n");
 		delete[] buf;
 	}
 	else
 	{
-		printf("No error.\n");
+		async_printf("No error.\n");
 	}
 }
 
@@ -126,13 +129,13 @@ namespace ni
 		{
 			char* buf = new char[512];
 			DAQmxGetErrorString(err, buf, 512);
-			printf(buf);
-			printf("\n");
+			async_printf("%s", buf);
+			async_printf("\n");
 			delete[] buf;
 		}
 		else
 		{
-			printf("No error.\n");
+			async_printf("No error.\n");
 		}
 	}
 
@@ -155,15 +158,19 @@ namespace ni
 
 	int imaq_buffer_cleanup()
 	{
-		for (int i = 0; i < numberOfBuffers; i++)
-		{
-			delete[] buffers[i];
-		}
-		delete buffers;
+		delete buffer_arena;
+		buffer_arena = NULL;
+		delete[] buffers;
 		buffers = NULL;
 		return 0;
 	}
 
+	// Size of the pages backing the IMAQ buffers in bytes, 0 if there are none
+	size_t buffer_page_size()
+	{
+		return (buffer_arena != NULL) ? buffer_arena->page_size() : 0;
+	}
+
 	int imaq_close()
 	{
 		err = imgClose(session_id, TRUE);
@@ -200,10 +207,18 @@ namespace ni
 		bufferSize = acqWinWidth * acqWinHeight * bytesPerPixel;
 
 		buffers = new uint16_t*[number_of_buffers];
+		size_t buffer_bytes = arena_round_up(aline_size * number_of_alines * sizeof(uint16_t), ARENA_ALIGNMENT);
+		buffer_arena = new LargePageArena(buffer_bytes * number_of_buffers);  // Zeroed by the OS
 		for (int i = 0; i < number_of_buffers; i++)
 		{
-			buffers[i] = new uint16_t[aline_size * number_of_alines];
-			memset(buffers[i], 0, aline_size * number_of_alines * sizeof(uint16_t));
+			buffers[i] = (uint16_t*)buffer_arena->carve(buffer_bytes);
+			if (buffers[i] == NULL)
+			{
+				async_printf("fastnisdoct: Failed to allocate %i IMAQ buffers of %llu bytes!\n", number_of_buffers, (unsigned long long)buffer_bytes);
+				imaq_buffer_cleanup();
+				numberOfBuffers = 0;
+				return -1;
+			}
 		}
 		if (number_of_buffers > 0)
 		{
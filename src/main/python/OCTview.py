@@ -2,9 +2,10 @@ import ctypes
 import os
 import datetime
 import json
+import time
 import numpy as np
 import qdarkstyle
-from PyQt5.QtCore import QTimer, Qt
+from PyQt5.QtCore import QTimer, Qt, QThread, pyqtSignal
 from PyQt5.QtGui import QFont
 from fbs_runtime.application_context.PyQt5 import ApplicationContext
 
@@ -15,6 +16,54 @@ CALLBACK_DEBOUNCE_MS = 400
 MAX_DISPLAY_UPDATE_RATE = 20
 MAX_2D_IMAGE_SIZE = 128 * 128
 MAX_ALINES_IN_SINGLE_BUFFER = 64 * 64
+FRAME_WAIT_TIMEOUT_MS = 100
+
+
+class _FrameWaiter(QThread):
+    """Blocks in the backend until a frame is ready, then signals the GUI to display it.
+
+    Frames which arrive while the GUI is still displaying the last one, or faster than MAX_DISPLAY_UPDATE_RATE, are
+    skipped so that the display always shows the latest frame. The latest frame skipped is still signalled once the
+    GUI is ready for it, so the display is never left a frame behind when frames stop arriving.
+    """
+
+    frame_ready = pyqtSignal(int)
+
+    def __init__(self, controller):
+        super().__init__()
+        self._controller = controller
+        self._running = False
+        self._displaying = False
+
+    def run(self):
+        self._running = True
+        last_frame = -1
+        last_emitted = 0
+        skipped = -1  # Latest frame which has yet to be signalled
+        while self._running:
+            if skipped >= 0 and not self._displaying and time.perf_counter() - last_emitted >= 1 / MAX_DISPLAY_UPDATE_RATE:
+                self._displaying = True
+                last_emitted = time.perf_counter()
+                self.frame_ready.emit(skipped)
+                skipped = -1
+            # Check back soon for a skipped frame rather than waiting for the next
+            n = self._controller.wait_frame(last_frame, FRAME_WAIT_TIMEOUT_MS if skipped < 0 else 10)
+            if n < 0:
+                if not (self._controller.scanning() or self._controller.acquiring()):
+                    last_frame = -1  # Frame numbers restart if the image is reconfigured
+                    self.msleep(10)
+                continue
+            last_frame = n
+            skipped = n
+
+    def displayed(self):
+        """Called by the GUI once it has displayed the frame."""
+        self._displaying = False
+
+    def stop(self):
+        self._running = False
+        self.wait()
+
 
 class _AppContext(ApplicationContext):
 
@@ -48,11 +97,19 @@ class _AppContext(ApplicationContext):
         self._update_timer = QTimer()
         self._update_timer.timeout.connect(self._update)
 
-        # Periodic display of grabbed frame
-        self._display_update_timer = QTimer()
-        self._display_update_timer.timeout.connect(self._display_update)
-        self._image_buffer = None
+        # Display of frames as the backend signals they are ready. Created when the controller is opened
+        self._frame_waiter = None
+        self._image_shape = None
         self._spectrum_buffer = None
+        self._mean_spectrum_buffer = None
+        self._max_spectrum_buffer = None
+        self._saturated_buffer = None
+        self._spectrometer_summary_buffer = np.zeros(5, dtype=np.float32)
+        self._bscan_buffer = None
+        self._enface_buffer = None
+        self._histogram_buffer = np.zeros(512, dtype=np.uint32)
+        self._levels_buffer = np.zeros(4, dtype=np.float32)
+        self._display_config = None
 
         # Assigned on run
         self.window = None  # Qt window
@@ -121,15 +178,43 @@ class _AppContext(ApplicationContext):
                 # print('GUI in unready state:', state)
                 self.window.set_mode_not_ready()
 
-    def _display_update(self):
-        if self._grab_buffer is not None and self._image_buffer is not None:
-            if self.controller.grab_frame(self._grab_buffer) > -1:
-                if not any(np.isnan(self._grab_buffer)):
-                    self._image_buffer = np.reshape(self._grab_buffer, self.window.image_dimensions(), order='F')
-                    self.window.display_frame(self._image_buffer)
+    def _display_update(self, frame_number: int = -1):
+        try:
+            self._grab_display()
+        finally:
+            if self._frame_waiter is not None:
+                self._frame_waiter.displayed()
+
+    def _grab_display(self):
+        if self.window.volume_display_enabled():
+            if self._image_shape is not None:
+                frame = self.controller.borrow_frame(self._image_shape)
+                if frame is not None:
+                    try:
+                        if not np.isnan(frame).any():
+                            self.window.display_frame(frame)
+                    finally:
+                        self.controller.release_frame()
+        elif self._bscan_buffer is not None:
+            # The backend reduces each frame to the 2D images on display, so only these are grabbed
+            config = self.window.display_config()
+            if config != self._display_config:
+                self.controller.configure_display(**config)
+                self._display_config = config
+            axis = self.controller.grab_display(self._bscan_buffer, self._enface_buffer, self._histogram_buffer, self._levels_buffer)
+            if axis > -1:
+                z, nx, ny = self.window.image_dimensions()
+                n = nx if axis == 0 else ny
+                bscan = np.reshape(self._bscan_buffer[:z * n], (z, n), order='F')
+                enface = np.reshape(self._enface_buffer, (nx, ny), order='F')
+                self.window.display_products(bscan, enface, axis)
         if self._spectrum_buffer is not None:
             if self.controller.grab_spectrum(self._spectrum_buffer) > -1:
                 self.window.display_spectrum(self._spectrum_buffer)
+        if self._max_spectrum_buffer is not None:
+            if self.controller.grab_spectrometer_stats(self._mean_spectrum_buffer, self._max_spectrum_buffer,
+                                                       self._saturated_buffer, self._spectrometer_summary_buffer) > -1:
+                self.window.display_spectrometer_stats(self._max_spectrum_buffer, self._spectrometer_summary_buffer)
         # else:
         #     print("Failed to grab frame. Maybe one wasnt available yet")
 
@@ -217,6 +302,8 @@ class _AppContext(ApplicationContext):
 
     def _close_controller(self):
         if self.controller is not None:
+            self._stop_display()
+            self._frame_waiter = None
             self.controller.close()
 
     def _configure_image(self):
@@ -255,9 +342,14 @@ class _AppContext(ApplicationContext):
             self._unprocessed_frame_size = self.window.unprocessed_frame_size()
             self._processed_frame_size = self.window.processed_frame_size()
             processed_shape = self.window.image_dimensions()
-            self._image_buffer = np.zeros(processed_shape, dtype=np.complex64)
-            self._grab_buffer = np.zeros(self._processed_frame_size, dtype=np.complex64)
+            self._image_shape = processed_shape
             self._spectrum_buffer = np.zeros(self.window.aline_size(), dtype=np.float32)
+            self._mean_spectrum_buffer = np.zeros(self.window.aline_size(), dtype=np.float32)
+            self._max_spectrum_buffer = np.zeros(self.window.aline_size(), dtype=np.float32)
+            self._saturated_buffer = np.zeros(pat.points_in_image, dtype=np.int32)
+            self._bscan_buffer = np.zeros(processed_shape[0] * max(processed_shape[1:]), dtype=np.uint8)
+            self._enface_buffer = np.zeros(processed_shape[1] * processed_shape[2], dtype=np.uint8)
+            self._display_config = None  # Force the display to be configured again
             self._bline_proc_mode = self.window.bline_repeat_processing()
 
     def _configure_processing(self, unprocessed_frame_size: int, processed_frame_size: int):
@@ -283,15 +375,13 @@ class _AppContext(ApplicationContext):
             self.controller.stop_acquisition()
         else:
             self.controller.start_scan()
-            t = max(int(1 / self.window.scan_pattern().pattern_rate * 1000), int(1 / MAX_DISPLAY_UPDATE_RATE * 1000))
-            print('OCTview: Polling display buffer every', t, 'ms,', 1 / (t / 1000), 'Hz')
-            self._display_update_timer.start(t)
+            self._start_display()
 
     def _start_acquisition(self):
         if self.controller.state == 'ready' or self.controller.state == 'scanning':
             if self.controller.state == 'ready':
                 self.controller.start_scan()
-                self._display_update_timer.start(int(1 / self.window.scan_pattern().pattern_rate * 1000))
+                self._start_display()
             if self.window.should_create_metadata_file():
                 self._create_metadata_json()
             self.controller.start_acquisition(
@@ -303,7 +393,18 @@ class _AppContext(ApplicationContext):
 
     def _stop(self):
         self.controller.stop_scan()
-        self._display_update_timer.stop()
+        self._stop_display()
+
+    def _start_display(self):
+        if self._frame_waiter is None:
+            self._frame_waiter = _FrameWaiter(self.controller)
+            self._frame_waiter.frame_ready.connect(self._display_update)
+        if not self._frame_waiter.isRunning():
+            self._frame_waiter.start()
+
+    def _stop_display(self):
+        if self._frame_waiter is not None:
+            self._frame_waiter.stop()
 
 
 # Module interface
@@ -1,17 +1,41 @@
 import ctypes as c
 import numpy as np
 from numpy.ctypeslib import ndpointer
+from reader import Recording
 
 c_bool_p = ndpointer(dtype=np.bool, ndim=1, flags='C_CONTIGUOUS')
 c_int_p = ndpointer(dtype=np.int32, ndim=1, flags='C_CONTIGUOUS')
 c_bool_p = ndpointer(dtype=np.bool, ndim=1, flags='C_CONTIGUOUS')
+c_uint8_p = ndpointer(dtype=np.uint8, ndim=1, flags='C_CONTIGUOUS')
 c_uint16_p = ndpointer(dtype=np.uint16, ndim=1, flags='C_CONTIGUOUS')
 c_uint32_p = ndpointer(dtype=np.uint32, ndim=1, flags='C_CONTIGUOUS')
+c_int64_p = ndpointer(dtype=np.int64, ndim=1, flags='C_CONTIGUOUS')
+c_uint64_p = ndpointer(dtype=np.uint64, ndim=1, flags='C_CONTIGUOUS')
 c_float_p = ndpointer(dtype=np.float32, ndim=1, flags='C_CONTIGUOUS')
 c_double_p = ndpointer(dtype=np.float64, ndim=1, flags='C_CONTIGUOUS')
 c_complex64_p = ndpointer(dtype=np.complex64, ndim=1, flags='C_CONTIGUOUS')
 c_complex64_p_3d = ndpointer(dtype=np.complex64, ndim=3, flags='C_CONTIGUOUS')
 
+FRAME_CALLBACK = c.CFUNCTYPE(None, c.c_int)
+
+LOG_HISTOGRAM_BUCKETS = 64
+LINE_TELEMETRY_COUNTERS = ('lines', 'dropped_lines', 'gaps', 'discontinuities', 'frames_processed', 'frames_displayed')
+LINE_TELEMETRY_HISTOGRAMS = ('line_period_jitter_ns', 'stamp_to_processed_ns', 'stamp_to_display_ns')
+FILE_TYPES = {'tif': 1, 'npy': 2, 'mat': 3, 'bin': 4, 'fnz': 5}  # FileStreamType
+PIPELINE_STAGES = ('buffer_wait', 'copy', 'submit', 'worker_compute', 'join_wait', 'repeat_processing', 'ring_push',
+                   'disk_write', 'frame')
+
+
+def _log_histogram(snapshot: np.ndarray) -> dict:
+    """Unpack a [count, sum, max, buckets...] snapshot of a backend LogHistogram. Bucket i counts values in [2^(i-1), 2^i)."""
+    count, total, maximum = (int(v) for v in snapshot[:3])
+    return {
+        'count': count,
+        'mean': total / count if count > 0 else 0,
+        'max': maximum,
+        'buckets': snapshot[3:].copy()
+    }
+
 
 class NIOCTController:
     """
@@ -31,8 +55,42 @@ class NIOCTController:
                                                       c_double_p, c_double_p, c.c_long, c.c_int]
         self._lib.nisdoct_configure_processing.argtypes = [c.c_bool, c.c_bool, c.c_double, c_float_p, c.c_int, c.c_int]
         self._lib.nisdoct_start_bin_acquisition.argtypes = [c.c_char_p, c.c_float, c.c_int, c.c_bool]
+        self._lib.nisdoct_start_acquisition.argtypes = [c.c_char_p, c.c_int, c.c_float, c.c_int, c.c_bool]
+        self._lib.nisdoct_configure_spill.argtypes = [c.c_char_p, c.c_int]
+        self._lib.nisdoct_configure_pretrigger.argtypes = [c.c_int, c.c_bool]
+        self._lib.nisdoct_configure_striping.argtypes = [c.c_char_p]
+        self._lib.nisdoct_configure_mat.argtypes = [c.c_int]
+        self._lib.nisdoct_configure_tiff.argtypes = [c.c_int, c.c_float, c.c_float]
+        self._lib.nisdoct_get_compression_ratio.restype = c.c_double
+        self._lib.nisdoct_configure_packing.argtypes = [c.c_bool]
+        self._lib.nisdoct_unpack12.argtypes = [c.c_void_p, c.c_int64, c_uint16_p]
+        self._lib.nisdoct_reprocess.argtypes = [c.c_char_p, c.c_char_p, c.c_int, c.c_float, c.c_int, c.c_int, c.c_bool,
+                                                c.c_bool, c.c_double, c.c_void_p, c.c_int, c.c_int, c.c_int, c.c_int]
+        self._lib.nisdoct_reprocess.restype = c.c_int64
         self._lib.nisdoct_grab_frame.argtypes = [c_complex64_p]
         self._lib.nisdoct_grab_spectrum.argtypes = [c_float_p]
+        self._lib.nisdoct_grab_spectrometer_stats.argtypes = [c_float_p, c_float_p, c_int_p, c_float_p]
+        self._lib.nisdoct_grab_spectrometer_stats.restype = c.c_int
+        self._lib.nisdoct_set_saturation_level.argtypes = [c.c_int]
+        self._lib.nisdoct_get_line_telemetry.argtypes = [c_int64_p, c_uint64_p]
+        self._lib.nisdoct_configure_line_telemetry.argtypes = [c.c_int, c.c_int]
+        self._lib.nisdoct_get_stats.argtypes = [c_uint64_p]
+        self._lib.nisdoct_get_stats.restype = c.c_int
+        self._lib.nisdoct_get_page_sizes.argtypes = [c_int64_p]
+        self._lib.nisdoct_get_page_sizes.restype = c.c_int
+        self._lib.nisdoct_dump_trace.argtypes = [c.c_char_p]
+        self._lib.nisdoct_dump_trace.restype = c.c_int
+        self._lib.nisdoct_borrow_frame.argtypes = [c.POINTER(c.c_void_p)]
+        self._lib.nisdoct_borrow_frame.restype = c.c_int
+        self._lib.nisdoct_wait_frame.argtypes = [c.c_int, c.c_int]
+        self._lib.nisdoct_wait_frame.restype = c.c_int
+        self._lib.nisdoct_get_frame_event.restype = c.c_void_p
+        self._lib.nisdoct_set_frame_callback.argtypes = [FRAME_CALLBACK]
+        self._frame_callback = None  # Reference must be kept for as long as it is registered
+        self._lib.nisdoct_configure_display.argtypes = [c.c_int, c.c_int, c.c_int, c.c_int, c.c_int, c.c_bool, c.c_bool,
+                                                        c.c_float, c.c_float, c_float_p, c_float_p]
+        self._lib.nisdoct_grab_display.argtypes = [c_uint8_p, c_uint8_p, c_uint32_p, c_float_p]
+        self._lib.nisdoct_grab_display.restype = c.c_int
 
         self._lib.nisdoct_get_state.restype = c.c_int
         self._lib.nisdoct_ready.restype = c.c_bool
@@ -182,7 +240,7 @@ class NIOCTController:
         """Stops scanning."""
         self._lib.nisdoct_stop_scan()
 
-    def start_acquisition(self, file: str, max_gb: float, frames_to_acquire: int = -1, processed=True):
+    def start_acquisition(self, file: str, max_gb: float, frames_to_acquire: int = -1, processed=True, file_type='bin'):
         """Starts streaming arrays to disk at the path supplied by file.
 
         Only successful if the controller is scanning.
@@ -192,18 +250,143 @@ class NIOCTController:
             max_gb: Maximum number of gigabytes to write to a single file before starting a new one.
             frames_to_acquire: The number of frames to acquire. If -1, acquisition continues until `stop_acquisition` is called.
             processed: If True, the processed frames are written to disk. If false, the raw image spectral data are saved.
+            file_type: One of FILE_TYPES. 'npy' files hold a FORTRAN order array of shape (z, x, y, t) and can be loaded
+                with np.load(mmap_mode='r'). 'mat' files are MATLAB v7.3 files holding the frames as an array of shape
+                [z, x, y, t] and the acquisition parameters as a struct.
+                'tif' files are BigTIFF stacks with a page per B-scan, formatted per `configure_tiff`.
+                'fnz' files hold raw spectra losslessly compressed on a pool of threads, and can only be used with
+                `processed=False`. See `compression_ratio`.
         """
-        self._lib.nisdoct_start_bin_acquisition(
+        self._lib.nisdoct_start_acquisition(
             bytes(file, encoding='utf8'),
+            FILE_TYPES[file_type],
             float(max_gb),
             int(frames_to_acquire),
             bool(processed)
         )
 
     def stop_acquisition(self):
-        """Stops acquisition of a file. Will interrupt a numbered acquisition."""
+        """Stops acquisition of a file. Will interrupt a numbered acquisition. If a spill is configured, frames which have
+        already been buffered continue to be written to disk in the background."""
         self._lib.nisdoct_stop_acquisition()
 
+    def configure_striping(self, directories: list):
+        """Stripe recorded frames round-robin across a file in each of `directories`, ideally each on its own disk, with
+        a writer thread per directory. An index with the suffix .stripes is written alongside the file name passed to
+        `start_acquisition`, listing the stripe files and the stripe and byte offset of each frame. Takes effect when
+        the next acquisition starts. Fewer than two directories disables striping.
+        """
+        self._lib.nisdoct_configure_striping(bytes(';'.join(directories), encoding='utf8'))
+
+    def configure_mat(self, deflate_level: int):
+        """Compress the frames of 'mat' files with shuffle and deflate at `deflate_level` 1-9, on a pool of threads so
+        that recording keeps pace with the line rate. 0 writes them uncompressed. Takes effect when the next acquisition
+        starts.
+        """
+        self._lib.nisdoct_configure_mat(int(deflate_level))
+
+    def configure_tiff(self, bits: int = 32, db_range=(0.0, 100.0)):
+        """Format the pages of 'tif' files. Processed frames are written in dB.
+
+        Args:
+            bits: 8 or 16 for unsigned integer pages, 32 for float pages. 8 bit pages of raw spectra hold their top 8 of
+                12 bits.
+            db_range: (min, max) dB spanned by integer pages of processed frames.
+        """
+        self._lib.nisdoct_configure_tiff(int(bits), float(db_range[0]), float(db_range[1]))
+
+    def configure_packing(self, packed: bool):
+        """Pack raw spectra to 12 bits in memory and on disk, so that 4/3 as many frames are buffered and spectra are
+        written with 75% of the bandwidth. Packed spectra are written raw to files with the suffix .b12, which can be
+        unpacked with `unpack12`. Samples of 4096 and above are truncated. Can't be changed during acquisition.
+        """
+        self._lib.nisdoct_configure_packing(bool(packed))
+
+    def unpack12(self, packed: np.ndarray, n: int) -> np.ndarray:
+        """Unpack `n` 12-bit samples from the bytes of `packed`, i.e. a frame read from a .b12 file."""
+        src = np.ascontiguousarray(packed)
+        if src.nbytes < (n * 3 + 1) // 2:
+            raise ValueError('{} bytes cannot hold {} packed samples'.format(src.nbytes, n))
+        dst = np.empty(n, dtype=np.uint16)
+        self._lib.nisdoct_unpack12(src.ctypes.data, int(n), dst)
+        return dst
+
+    def reprocess(
+            self,
+            file: str,
+            out_file: str,
+            max_gb: float,
+            file_type: str = 'bin',
+            roi_offset: int = 0,
+            roi_size: int = None,
+            subtract_background: bool = False,
+            interp: bool = False,
+            intpdk: float = 0.0,
+            apod_window: np.ndarray = None,
+            aline_repeat: int = 1,
+            bline_repeat: int = 1,
+            aline_repeat_processing: str = None,
+            bline_repeat_processing: str = None,
+    ) -> int:
+        """Process the raw spectra recorded to `file` as they would be processed while scanning, with all cores, and
+        write the processed frames to `out_file` as if they had been acquired. Blocks until every frame is written. Needs
+        no hardware and the controller need not be open.
+
+        Args:
+            file: Path of a recording of spectra, without a suffix. Must have been written as 'bin', to .bin or packed to .b12.
+            out_file: Path to write the processed recording to, without a suffix.
+            max_gb: Maximum number of gigabytes to write to a single file before starting a new one.
+            file_type: One of FILE_TYPES. 'tif' pages are 32 bit floats in dB and 'mat' frames are uncompressed.
+            roi_offset, roi_size: Axial ROI of the processed A-lines. By default the whole spatial A-line.
+            subtract_background, interp, intpdk, apod_window: As `configure_processing`. The mean spectrum of each frame
+                is subtracted from it.
+            aline_repeat, bline_repeat, aline_repeat_processing, bline_repeat_processing: As `configure_image`.
+
+        Returns:
+            int: The number of frames written, or -1 if `file` is not a recording of spectra
+        """
+        flags = {None: 0, 'average': 1, 'difference': 2, 0: 0, 1: 1, 2: 2}
+        apod = None if apod_window is None else np.ascontiguousarray(apod_window, dtype=np.float32)
+        if apod is not None:
+            with Recording(file) as recording:
+                spectral_bins = recording.shape[0]
+        if apod is not None and len(apod) != spectral_bins:
+            raise ValueError('The apodization window must have a sample per spectral bin of {}'.format(file))
+        return self._lib.nisdoct_reprocess(
+            bytes(file, encoding='utf8'),
+            bytes(out_file, encoding='utf8'),
+            FILE_TYPES[file_type],
+            float(max_gb),
+            int(roi_offset),
+            -1 if roi_size is None else int(roi_size),
+            bool(subtract_background),
+            bool(interp),
+            float(intpdk),
+            None if apod is None else apod.ctypes.data,
+            int(aline_repeat),
+            int(bline_repeat),
+            flags[aline_repeat_processing],
+            flags[bline_repeat_processing]
+        )
+
+    def configure_pretrigger(self, frames: int, processed=True):
+        """Keep the latest `frames` frames while scanning so that the next acquisition begins with the frames which were
+        on screen when it was started. Limited by the number of frames buffered. 0 disables pre-trigger capture.
+
+        Args:
+            frames: The number of frames to keep.
+            processed: If True, processed frames are kept for acquisitions of processed frames. If False, raw spectral
+                data are kept for acquisitions of spectral data. Keeping spectra costs no additional copies.
+        """
+        self._lib.nisdoct_configure_pretrigger(int(frames), bool(processed))
+
+    def configure_spill(self, path: str, frames: int):
+        """Buffer up to `frames` frames which the writer cannot keep up with in a temporary file at `path`, ideally on a
+        fast local disk, so that bursts larger than the in-memory ring are saved without dropping frames. The file is
+        deleted once the acquisition has been written. Takes effect when the next acquisition starts. 0 disables the spill.
+        """
+        self._lib.nisdoct_configure_spill(bytes(path, encoding='utf8'), int(frames))
+
     def get_state(self) -> int:
         """Get state of the controller as an integer.
 
@@ -231,5 +414,190 @@ class NIOCTController:
     def grab_frame(self, output):
         return self._lib.nisdoct_grab_frame(output)
 
+    def borrow_frame(self, shape):
+        """Borrow the latest processed frame from the backend without copying it.
+
+        The returned array is a view of backend memory and must not be used after `release_frame` is called.
+
+        Args:
+            shape (tuple): The [z, x, y] shape of the processed frame.
+
+        Returns: A FORTRAN-ordered complex64 view of the frame, or None if no new frame is ready.
+        """
+        address = c.c_void_p()
+        if self._lib.nisdoct_borrow_frame(c.byref(address)) < 0:
+            return None
+        buffer = (c.c_float * (2 * int(np.prod(shape)))).from_address(address.value)
+        return np.ctypeslib.as_array(buffer).view(np.complex64).reshape(shape, order='F')
+
+    def release_frame(self):
+        """Return the frame borrowed by `borrow_frame` to the backend."""
+        self._lib.nisdoct_release_frame()
+
     def grab_spectrum(self, output):
         return self._lib.nisdoct_grab_spectrum(output)
+
+    def grab_spectrometer_stats(self, mean_spectrum, max_spectrum, saturated, summary) -> int:
+        """Grab the spectrometer stats accumulated from the latest processed frame.
+
+        Args:
+            mean_spectrum (np.ndarray): A-line sized float32 buffer for the mean raw spectrum
+            max_spectrum (np.ndarray): A-line sized float32 buffer for the max raw spectrum
+            saturated (np.ndarray): int32 buffer for the saturated pixel count of each A-line in the image
+            summary (np.ndarray): float32 buffer of length 5 for the saturated pixel count, the fraction of A-lines
+                with saturated pixels, the noise floor (dB), the mean A-line peak (dB) and the SNR (dB)
+        Returns:
+            int: The number of the frame the stats were taken from, or -1 if no new stats were available
+        """
+        return self._lib.nisdoct_grab_spectrometer_stats(mean_spectrum, max_spectrum, saturated, summary)
+
+    def line_telemetry(self) -> dict:
+        """Dropped A-lines, line period jitter and stamp-to-processed and stamp-to-display latency measured from the
+        camera's A-line stamps since the telemetry was last reset.
+
+        Returns:
+            dict: The counters in LINE_TELEMETRY_COUNTERS and a histogram dict for each of LINE_TELEMETRY_HISTOGRAMS
+        """
+        counters = np.zeros(len(LINE_TELEMETRY_COUNTERS), dtype=np.int64)
+        histograms = np.zeros(len(LINE_TELEMETRY_HISTOGRAMS) * (LOG_HISTOGRAM_BUCKETS + 3), dtype=np.uint64)
+        self._lib.nisdoct_get_line_telemetry(counters, histograms)
+        telemetry = dict(zip(LINE_TELEMETRY_COUNTERS, (int(v) for v in counters)))
+        for name, snapshot in zip(LINE_TELEMETRY_HISTOGRAMS, np.split(histograms, len(LINE_TELEMETRY_HISTOGRAMS))):
+            telemetry[name] = _log_histogram(snapshot)
+        return telemetry
+
+    def stats(self) -> dict:
+        """Time spent in each stage of the acquisition and processing pipeline since the stats were last reset.
+
+        Returns:
+            dict: A histogram dict of the time in ns spent in each of PIPELINE_STAGES
+        """
+        histograms = np.zeros(len(PIPELINE_STAGES) * (LOG_HISTOGRAM_BUCKETS + 3), dtype=np.uint64)
+        n = self._lib.nisdoct_get_stats(histograms)
+        if n != len(PIPELINE_STAGES):
+            raise RuntimeError('Backend reports {} pipeline stages, expected {}'.format(n, len(PIPELINE_STAGES)))
+        return {name: _log_histogram(snapshot) for name, snapshot in zip(PIPELINE_STAGES, np.split(histograms, n))}
+
+    def reset_stats(self):
+        self._lib.nisdoct_reset_stats()
+
+    def page_sizes(self) -> dict:
+        """Size in bytes of the pages backing each buffer, 0 if it has not been allocated. The size is larger than 4096
+        if large pages could be used."""
+        sizes = np.zeros(3, dtype=np.int64)
+        self._lib.nisdoct_get_page_sizes(sizes)
+        return {'imaq': int(sizes[0]), 'spectral_ring': int(sizes[1]), 'processed_ring': int(sizes[2])}
+
+    def compression_ratio(self) -> float:
+        """Raw bytes per byte written to disk by the latest 'fnz' acquisition, updated live. 0 if none has been written."""
+        return self._lib.nisdoct_get_compression_ratio()
+
+    def start_trace(self):
+        """Begin recording a timeline of pipeline events. Each thread keeps its latest 65536 events."""
+        self._lib.nisdoct_start_trace()
+
+    def dump_trace(self, path: str) -> int:
+        """Stop recording pipeline events and write them to `path` as Chrome trace JSON, which can be opened with
+        chrome://tracing or ui.perfetto.dev.
+
+        Returns:
+            int: The number of events written, or -1 if the file could not be opened
+        """
+        return self._lib.nisdoct_dump_trace(bytes(path, encoding='utf8'))
+
+    def reset_line_telemetry(self):
+        self._lib.nisdoct_reset_line_telemetry()
+
+    def configure_line_telemetry(self, stamp_increment: int = 1, stamp_modulus: int = 65536):
+        """Describe the camera's A-line stamp: a line counter which advances by `stamp_increment` and wraps at `stamp_modulus`."""
+        self._lib.nisdoct_configure_line_telemetry(int(stamp_increment), int(stamp_modulus))
+
+    def set_saturation_level(self, level: int):
+        """Set the raw pixel value at or above which spectrometer pixels are counted as saturated."""
+        self._lib.nisdoct_set_saturation_level(int(level))
+
+    def configure_display(
+            self,
+            bscan_axis: str = 'x',
+            bscan_projection: str = None,
+            bscan_index: int = 0,
+            enface_projection: str = 'max',
+            enface_index: int = 0,
+            log_scale: bool = True,
+            auto_levels: bool = True,
+            percentiles=(1.0, 99.9),
+            bscan_levels=(0.0, 1.0),
+            enface_levels=(0.0, 1.0)
+    ):
+        """Configure the 2D display images reduced from each processed frame by the backend. Can be called during a scan.
+
+        Args:
+            bscan_axis (str): `'x'` for a [z, x] B-scan at y = `bscan_index` or `'y'` for a [z, y] B-scan at x = `bscan_index`.
+            bscan_projection (str): None to slice the frame at `bscan_index`, or `'max'` or `'mean'` to project it
+                along the axis not displayed.
+            bscan_index (int): Index of the B-scan slice.
+            enface_projection (str): None to slice the frame at `enface_index`, or `'max'` or `'mean'` to project along z.
+            enface_index (int): Index in z of the en face slice.
+            log_scale (bool): If True, 20 * log10 is taken of the magnitude prior to quantization.
+            auto_levels (bool): If True, levels are set by `percentiles` of each image's histogram.
+            percentiles (tuple): Low and high percentiles mapped to 0 and 255 if `auto_levels`.
+            bscan_levels (tuple): Values mapped to 0 and 255 in the B-scan if not `auto_levels`.
+            enface_levels (tuple): Values mapped to 0 and 255 in the en face image if not `auto_levels`.
+        """
+        projections = {None: 0, 'max': 1, 'mean': 2}
+        self._lib.nisdoct_configure_display(
+            int(bscan_axis == 'y'),
+            projections[bscan_projection],
+            int(bscan_index),
+            projections[enface_projection],
+            int(enface_index),
+            bool(log_scale),
+            bool(auto_levels),
+            float(percentiles[0]),
+            float(percentiles[1]),
+            np.array(bscan_levels).astype(np.float32),
+            np.array(enface_levels).astype(np.float32)
+        )
+
+    def grab_display(self, bscan, enface, histograms, levels) -> int:
+        """Grab the latest uint8 display images.
+
+        Args:
+            bscan (np.ndarray): uint8 buffer large enough for either B-scan axis. Filled with the FORTRAN-ordered B-scan.
+            enface (np.ndarray): uint8 buffer filled with the FORTRAN-ordered [x, y] en face image.
+            histograms (np.ndarray): uint32 buffer of size 512 filled with the B-scan and then the en face histogram.
+            levels (np.ndarray): float32 buffer of size 4 filled with the B-scan and then the en face levels.
+
+        Returns: 0 if the B-scan is [z, x], 1 if it is [z, y], -1 if no new images were ready.
+        """
+        return self._lib.nisdoct_grab_display(bscan, enface, histograms, levels)
+
+    def wait_frame(self, last_frame: int = -1, timeout_ms: int = 100) -> int:
+        """Block until a frame newer than `last_frame` is ready to be grabbed or borrowed. Releases the GIL.
+
+        Returns: The number of the ready frame, or -1 if timed out, if scanning stopped or if not scanning.
+        """
+        return self._lib.nisdoct_wait_frame(int(last_frame), int(timeout_ms))
+
+    def frame_event(self) -> int:
+        """Win32 handle of an auto-reset event which is set each time a frame is ready or scanning stops.
+
+        Each time it is set, the event wakes only one of the threads waiting on it, so only one thread should. Use
+        `wait_frame` to wait from any number of threads.
+        """
+        return self._lib.nisdoct_get_frame_event()
+
+    def set_frame_callback(self, callback):
+        """Register `callback(frame_number)` to be called each time a frame is ready, or None to unregister.
+
+        The callback is called on the acquisition thread and blocks it while it waits for the GIL. Prefer
+        `wait_frame` from a thread of your own.
+        """
+        # The DLL must stop calling the old callback before its reference is dropped
+        if callback is None:
+            self._lib.nisdoct_set_frame_callback(c.cast(None, FRAME_CALLBACK))
+            self._frame_callback = None
+        else:
+            frame_callback = FRAME_CALLBACK(callback)
+            self._lib.nisdoct_set_frame_callback(frame_callback)
+            self._frame_callback = frame_callback
@@ -0,0 +1,171 @@
+"""Reader of recordings made by fastnisdoct, which memory-maps the recording's part files so that frames are read in
+place, without loading the recording into memory and without the fastnisdoct library or any hardware.
+
+The .idx written alongside each recording gives the geometry and type of the frames and the part file and offset of
+every frame. The frames of a striped recording are in the stripe files listed in the .stripes of each part, where the
+j-th frame of a part is at its offset in the file of stripe j % stripes. See FrameIndex.h and RecordingReader.h, the
+equivalent C++ reader.
+
+Recordings can be opened while they are being recorded, and read the frames indexed when they were opened.
+"""
+
+import os
+import numpy as np
+
+INDEX_HEADER_SIZE = 64
+INDEX_RECORD = np.dtype([
+    ('count', '<i8'),  # Acquisition count of the frame
+    ('timestamp', '<i8'),  # When the frame was written, in 100 ns intervals since 1601
+    ('offset', '<i8'),  # Byte offset of the frame in its part file, -1 if it is not stored whole
+    ('part', '<i4'),
+    ('dropped_before', '<u4'),  # Frames dropped between the previous frame and this one
+])
+INDEX_FLAG_PACKED12 = 0x1
+INDEX_FLAG_STRIPED = 0x2
+FILE_TYPE_NPY = 2
+FILE_TYPE_RAW = 4
+
+
+def unpack12(packed: np.ndarray, n: int) -> np.ndarray:
+    """Unpack `n` 12-bit samples packed two to every three bytes of `packed`."""
+    b = np.frombuffer(np.ascontiguousarray(packed).data, dtype=np.uint8, count=(n * 3 + 1) // 2)
+    out = np.empty(n + (n % 2), dtype=np.uint16)
+    triples = np.zeros((len(out) // 2, 3), dtype=np.uint16)
+    triples.flat[:len(b)] = b
+    out[0::2] = triples[:, 0] | ((triples[:, 1] & 0xF) << 8)
+    out[1::2] = (triples[:, 1] >> 4) | (triples[:, 2] << 4)
+    return out[:n]
+
+
+class Recording:
+
+    def __init__(self, file: str):
+        """Map the recording made to `file`, the file name passed to `start_acquisition` without a suffix.
+
+        Args:
+            file: Path of the recording, without a suffix.
+        """
+        self._file = file
+        with open(file + '.idx', 'rb') as f:
+            header = f.read(INDEX_HEADER_SIZE)
+        if len(header) < INDEX_HEADER_SIZE or header[:8] != b'FNSDIDX1':
+            raise ValueError('{}.idx is not the index of a recording'.format(file))
+        version, record_size = np.frombuffer(header, dtype='<u4', count=2, offset=8)
+        if record_size != INDEX_RECORD.itemsize:
+            raise ValueError('Unsupported index version {}'.format(version))
+        self.frame_bytes = int(np.frombuffer(header, dtype='<u8', count=1, offset=16)[0])
+        self.file_type, self.flags = (int(v) for v in np.frombuffer(header, dtype='<u4', count=2, offset=24))
+        self.shape = tuple(int(v) for v in np.frombuffer(header, dtype='<i8', count=3, offset=32))
+        self.stripes = int(np.frombuffer(header, dtype='<u4', count=1, offset=56)[0]) \
+            if self.flags & INDEX_FLAG_STRIPED else 0
+        if self.file_type not in (FILE_TYPE_RAW, FILE_TYPE_NPY):
+            raise ValueError('Recordings of type {} store frames which cannot be mapped'.format(self.file_type))
+        n = (os.path.getsize(file + '.idx') - INDEX_HEADER_SIZE) // INDEX_RECORD.itemsize
+        self.index = np.memmap(file + '.idx', dtype=INDEX_RECORD, mode='r', offset=INDEX_HEADER_SIZE, shape=(n,)) \
+            if n > 0 else np.zeros(0, dtype=INDEX_RECORD)
+        self.packed = bool(self.flags & INDEX_FLAG_PACKED12)
+        voxels = int(np.prod(self.shape))
+        if self.packed:
+            self.dtype = np.dtype(np.uint16)
+        elif self.frame_bytes == voxels * 2:
+            self.dtype = np.dtype(np.uint16)
+        elif self.frame_bytes == voxels * 8:
+            self.dtype = np.dtype(np.complex64)
+        else:
+            raise ValueError('Frames of {} bytes do not have shape {}'.format(self.frame_bytes, self.shape))
+        self._parts = {}
+        # Frame which begins each part, to find the stripe of a frame by its place in its part
+        parts = self.index['part']
+        self._part_first = {int(p): int(k) for p, k in zip(*np.unique(parts, return_index=True))} if n > 0 else {}
+
+    def close(self):
+        """Release the recording's files. Each is unmapped once no frame read from it is still referenced."""
+        self._parts = {}
+        self.index = np.zeros(0, dtype=INDEX_RECORD)
+        self._part_first = {}
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def _suffix(self) -> str:
+        if self.file_type == FILE_TYPE_NPY:
+            return '.npy'
+        return '.b12' if self.packed else '.bin'
+
+    def _part_name(self, p: int) -> str:
+        return self._file + self._suffix() if p == 0 else '{}_{:04d}{}'.format(self._file, p, self._suffix())
+
+    def _stripe_names(self, p: int) -> dict:
+        names = {}
+        with open(self._part_name(p) + '.stripes', 'r') as f:
+            for line in f:
+                fields = line.rstrip('\r\n').split(' ', 2)
+                if len(fields) == 3 and fields[0] == 'stripe':
+                    names[int(fields[1])] = fields[2]
+        return names
+
+    def _part(self, p: int, s: int = 0) -> np.memmap:
+        """The part file `p`, or its stripe `s` if the recording is striped."""
+        if (p, s) not in self._parts:
+            if self.stripes > 0:
+                names = self._stripe_names(p)
+                if s not in names:
+                    raise IndexError('Stripe {} of part {} is not listed in its .stripes'.format(s, p))
+                name = names[s]
+            else:
+                name = self._part_name(p)
+            self._parts[(p, s)] = np.memmap(name, dtype=np.uint8, mode='r')
+        return self._parts[(p, s)]
+
+    def __len__(self) -> int:
+        return len(self.index)
+
+    def __getitem__(self, k: int) -> np.ndarray:
+        return self.frame(k)
+
+    def __iter__(self):
+        for k in range(len(self)):
+            yield self.frame(k)
+
+    @property
+    def counts(self) -> np.ndarray:
+        """Acquisition count of each frame."""
+        return self.index['count']
+
+    @property
+    def dropped(self) -> int:
+        """Number of frames dropped from the recording."""
+        return int(np.sum(self.index['dropped_before'], dtype=np.int64))
+
+    def raw(self, k: int) -> np.ndarray:
+        """Bytes of the `k`-th frame in place."""
+        r = self.index[k]
+        if r['offset'] < 0:
+            raise IndexError('Frame {} was indexed without an offset in its part file and cannot be read'.format(k))
+        p = int(r['part'])
+        s = (k % len(self) - self._part_first[p]) % self.stripes if self.stripes > 0 else 0
+        return self._part(p, s)[int(r['offset']):int(r['offset']) + self.frame_bytes]
+
+    def frame(self, k: int) -> np.ndarray:
+        """The `k`-th frame, of shape [z, x, y] in FORTRAN order. A view in place unless the frame is packed."""
+        b = self.raw(k)
+        if self.packed:
+            return unpack12(b, int(np.prod(self.shape))).reshape(self.shape, order='F')
+        return b.view(self.dtype).reshape(self.shape, order='F')
+
+    def slab(self, k: int, n: int) -> np.ndarray:
+        """Frames `k` through `k` + `n` - 1 as an array of shape [z, x, y, n]. A view in place if the frames are
+        contiguous in one part file and not packed, otherwise a copy."""
+        r = self.index[k:k + n]
+        if len(r) != n:
+            raise IndexError('Frames {} through {} are not in the recording'.format(k, k + n - 1))
+        contiguous = not self.packed and self.stripes == 0 and np.all(r['part'] == r['part'][0]) and r['offset'][0] >= 0 \
+            and np.all(np.diff(r['offset']) == self.frame_bytes)
+        if contiguous:
+            start = int(r['offset'][0])
+            b = self._part(int(r['part'][0]))[start:start + n * self.frame_bytes]
+            return b.view(self.dtype).reshape(self.shape + (n,), order='F')
+        return np.stack([self.frame(i) for i in range(k, k + n)], axis=-1)
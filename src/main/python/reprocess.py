@@ -0,0 +1,83 @@
+"""Reprocess recordings of raw spectra with the fastnisdoct library, without hardware.
+
+Each recording is processed as it would have been while scanning, with all cores, and written alongside it with the
+suffix _reprocessed, or to --out. Recordings are named as they were passed to `start_acquisition`, without a suffix.
+
+    python reprocess.py D:/2022-06-01/scan_* --interpdk 0.21 --apod hanning --roi 20 400 --type npy
+"""
+
+import argparse
+import ctypes
+import glob
+import os
+import sys
+import numpy as np
+
+from controller import NIOCTController, FILE_TYPES
+from reader import Recording
+
+DEFAULT_LIBRARY = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'resources', 'windows', 'fastnisdoct.dll')
+
+
+def _recordings(patterns: list) -> list:
+    """Names of the recordings matching each of `patterns`, i.e. of the .idx files which match them."""
+    names = []
+    for pattern in patterns:
+        for idx in sorted(glob.glob(pattern if pattern.endswith('.idx') else pattern + '.idx')):
+            names.append(idx[:-len('.idx')])
+    return names
+
+
+def main(argv=None) -> int:
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('recordings', nargs='+', help='Recordings without a suffix. Wildcards are expanded')
+    parser.add_argument('--out', help='Directory to write the reprocessed recordings to. By default, beside each')
+    parser.add_argument('--type', default='bin', choices=sorted(FILE_TYPES), help='File type to write')
+    parser.add_argument('--max-gb', type=float, default=4.0, help='Maximum gigabytes per file')
+    parser.add_argument('--roi', type=int, nargs=2, metavar=('OFFSET', 'SIZE'), help='Axial ROI of each A-line')
+    parser.add_argument('--background', action='store_true', help='Subtract the mean spectrum of each frame')
+    parser.add_argument('--interpdk', type=float, help='Interpolate to linear-in-wavenumber with this parameter')
+    parser.add_argument('--apod', default=None, choices=('hanning', 'hamming', 'blackman'), help='Apodization window')
+    parser.add_argument('--aline-repeat', type=int, nargs=2, metavar=('N', 'PROCESSING'), default=(1, None))
+    parser.add_argument('--bline-repeat', type=int, nargs=2, metavar=('N', 'PROCESSING'), default=(1, None),
+                        help='Repeats and their processing: 1 to average or 2 to difference')
+    parser.add_argument('--library', default=DEFAULT_LIBRARY, help='Path of fastnisdoct.dll')
+    args = parser.parse_args(argv)
+
+    names = _recordings(args.recordings)
+    if len(names) == 0:
+        print('reprocess: No recordings match', ' '.join(args.recordings))
+        return 1
+    ctypes.cdll.LoadLibrary(os.path.join(os.path.dirname(args.library), 'libfftw3f-3.dll'))
+    controller = NIOCTController(args.library)
+
+    failed = 0
+    for name in names:
+        out = name + '_reprocessed'
+        if args.out is not None:
+            out = os.path.join(args.out, os.path.basename(name))
+        apod_window = None
+        if args.apod is not None:
+            with Recording(name) as recording:
+                apod_window = getattr(np, args.apod)(recording.shape[0])
+        roi_offset, roi_size = args.roi if args.roi is not None else (0, None)
+        print('reprocess: {} -> {}'.format(name, out))
+        n = controller.reprocess(
+            name, out, args.max_gb, file_type=args.type,
+            roi_offset=roi_offset, roi_size=roi_size,
+            subtract_background=args.background,
+            interp=args.interpdk is not None, intpdk=args.interpdk or 0.0,
+            apod_window=apod_window,
+            aline_repeat=args.aline_repeat[0], aline_repeat_processing=args.aline_repeat[1],
+            bline_repeat=args.bline_repeat[0], bline_repeat_processing=args.bline_repeat[1]
+        )
+        if n < 0:
+            print('reprocess: {} could not be reprocessed'.format(name))
+            failed += 1
+        else:
+            print('reprocess: Wrote {} frames'.format(n))
+    return 1 if failed > 0 else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
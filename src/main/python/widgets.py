@@ -719,6 +719,7 @@ class SpectrumPlotWidget(pyqtgraph.GraphicsWindow):
         self._plot.setYRange(yrange[0], yrange[1])
         self._plot.setLabel('bottom', text='λ (nm)')
 
+        self._max_spectrum = self._plot.plot(pen='#FF4040')
         self._spectrum = self._plot.plot(color='#FFFFFF')
 
         self._current_data = 0
@@ -730,6 +731,18 @@ class SpectrumPlotWidget(pyqtgraph.GraphicsWindow):
         self._current_data = data
         self._spectrum.setData(wavelengths, self._current_data)
 
+    def plot_stats(self, max_spectrum, summary, wavelengths=None):
+        if wavelengths is None:
+            wavelengths = self._wavelengths
+        self._max_spectrum.setData(wavelengths, max_spectrum)
+        saturated_pixels, saturated_fraction, noise_floor, peak, snr = summary
+        if saturated_pixels > 0:
+            title = '<span style="color:#FF4040">Saturated: {:.0f} px in {:.1f}% of A-lines</span>'.format(
+                saturated_pixels, saturated_fraction * 100)
+        else:
+            title = 'Not saturated'
+        self._plot.setTitle('{}, noise floor {:.1f} dB, SNR {:.1f} dB'.format(title, noise_floor, snr), size='8pt')
+
     @yrange.setter
     def yrange(self, yrange):
         self.plot.setYRange(yrange[0], yrange[1])
@@ -850,7 +863,7 @@ class BScanWidget(pyqtgraph.GraphicsLayoutWidget):
             self._hslider.setBounds([0, self._sf[1] * self._data_shape[1]])
         self._image.scale(self._sf[0], self._sf[1])
 
-    def updateData(self, image, fov=None):
+    def updateData(self, image, fov=None, levels=None):
         self._data_shape = image.shape
         if fov is not None:
             self.setAspect(fov[0], fov[1])
@@ -863,9 +876,10 @@ class BScanWidget(pyqtgraph.GraphicsLayoutWidget):
             n = int(image.size / 4)  # TODO make this smarter
         else:
             n = image.size
-        # pyqtgraph auto levels doesn't work for images >= 2**16
-        self._image.setImage(image, levels=[np.nanmin(image),
-                                            np.nanmax(image)])
+        if levels is None:
+            # pyqtgraph auto levels doesn't work for images >= 2**16
+            levels = [np.nanmin(image), np.nanmax(image)]
+        self._image.setImage(image, levels=levels)
         if self._slice_not_set:
             self._setSlice()
             self._slice_not_set = False
@@ -981,6 +995,47 @@ class DisplayWidget(QWidget, UiWidget):
             self._volume.updateData(np.abs(frame))
         # pyqtgraph.QtGui.QApplication.processEvents()
 
+    def volume_display_enabled(self) -> bool:
+        """If True, the whole frame is needed for display. Otherwise only the 2D products of `display_config` are."""
+        return self.tabDisplay.currentIndex() == 1
+
+    def display_config(self) -> dict:
+        """Keyword arguments to `NIOCTController.configure_display` which reproduce the 2D views of `display_frame`."""
+        if self.radioViewX.isChecked():
+            bscan_index = self._enface.hslice
+        else:
+            bscan_index = self._enface.vslice
+        bscan_projection = None
+        if self.checkBScanProjection.isChecked():
+            bscan_projection = 'max' if self.radioBScanMax.isChecked() else 'mean'
+        enface_projection = None
+        if self.checkEnfaceProjection.isChecked():
+            enface_projection = 'max' if self.radioEnfaceMax.isChecked() else 'mean'
+        return {
+            'bscan_axis': 'x' if self.radioViewX.isChecked() else 'y',
+            'bscan_projection': bscan_projection,
+            'bscan_index': bscan_index if bscan_index is not None else 0,
+            'enface_projection': enface_projection,
+            'enface_index': self._bscan.hslice if self._bscan.hslice is not None else 0,
+            'log_scale': self.checkDb.isChecked()
+        }
+
+    def display_products(self, bscan: np.ndarray, enface: np.ndarray, bscan_axis: int, fov=[1, 1, 1]):
+        """Display the uint8 images reduced from a frame by the backend.
+
+        Args:
+            bscan (np.ndarray): [z, x] B-scan if `bscan_axis` is 0, else [z, y]
+            enface (np.ndarray): [x, y] en face image
+            bscan_axis (int): 0 if the B-scan is along x, 1 if along y
+            fov: Dimensions in meters of the frame volume or area.
+        """
+        self._enface.updateData(enface, fov=(fov[1], fov[2]), levels=[0, 255])
+        if bscan_axis == 0:
+            dim = (fov[1], fov[0])
+        else:
+            dim = (fov[2], fov[0])
+        self._bscan.updateData(np.rot90(bscan), fov=dim, levels=[0, 255])
+
 
 class SpectrumWidget(QWidget, UiWidget):
 
@@ -992,6 +1047,9 @@ class SpectrumWidget(QWidget, UiWidget):
     def plot(self, wavelengths: np.ndarray, spectrum: np.ndarray):
         self.SpectrumPlotWidget.plot(spectrum, wavelengths=wavelengths)
 
+    def plot_stats(self, wavelengths: np.ndarray, max_spectrum: np.ndarray, summary: np.ndarray):
+        self.SpectrumPlotWidget.plot_stats(max_spectrum, summary, wavelengths=wavelengths)
+
 
 class CancelDiscardsChangesDialog(QDialog, UiWidget):
     changed = pyqtSignal()
@@ -1292,9 +1350,24 @@ class MainWindow(QMainWindow, UiWidget):
         fov = np.concatenate([[self._settings_dialog.spinAxialPixelSize.value() * self.roi_size() * 10**-6], fov])
         self.DisplayWidget.display_frame(frame, fov=fov)
 
+    def display_products(self, bscan: np.ndarray, enface: np.ndarray, bscan_axis: int):
+        """Display 2D images reduced from a frame by the backend using the display widgets."""
+        fov = np.array(self.scan_pattern().fov) * 10**-3
+        fov = np.concatenate([[self._settings_dialog.spinAxialPixelSize.value() * self.roi_size() * 10**-6], fov])
+        self.DisplayWidget.display_products(bscan, enface, bscan_axis, fov=fov)
+
+    def volume_display_enabled(self) -> bool:
+        return self.DisplayWidget.volume_display_enabled()
+
+    def display_config(self) -> dict:
+        return self.DisplayWidget.display_config()
+
     def display_spectrum(self, spectrum: np.ndarray):
         self.SpectrumWidget.plot(np.linspace(*self.spectrometer_range(), self.aline_size()), spectrum)
 
+    def display_spectrometer_stats(self, max_spectrum: np.ndarray, summary: np.ndarray):
+        self.SpectrumWidget.plot_stats(np.linspace(*self.spectrometer_range(), self.aline_size()), max_spectrum, summary)
+
     def trigger_gain(self) -> float:
         return self._settings_dialog.spinTriggerGain.value()
         return self._settings_dialog.spinTriggerGain.value()